@@ -46,6 +46,14 @@
   #define DF_DEVICE_ID_BYTE2                      0x01 // Device ID (Byte 2)
   #define DF_EDI_STRING_LEN                       0x01 // Extended Device Information (EDI) String Length
   #define DF_EDI_BYTE1                            0x01 // [Optional to Read] EDI Byte 1
+  #define DF_DEVICE_ID_DENSITY_MASK               0x1F // Density Code field of Device ID (Byte 1)
+  #define DF_DEVICE_ID_DENSITY_32MBIT             0x07 // AT45DB321E: 8192 pages of 512/528 bytes
+  #define DF_DEVICE_ID_DENSITY_64MBIT             0x08 // AT45DB641E: 32768 pages of 256/264 bytes
+
+  /* Security Register Format */
+  #define DF_SECURITYREG_DUMMY_BYTES              3    // Dummy bytes following DF_CMD_READSECURITYREG
+  #define DF_SECURITYREG_USER_BYTES               64   // User programmable bytes, read first
+  #define DF_SECURITYREG_UNIQUE_BYTES             64   // Factory programmed unique identifier, following the user bytes
 
   /* Read Commands */
   #define DF_CMD_MAINMEMPAGEREAD                  0xD2 // Main Memory Page Read
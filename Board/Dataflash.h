@@ -7,30 +7,69 @@
 
   /* Includes: */
     #include "AT45DB321E.h"
+    #include "DataflashBus.h"
 
   /* Preprocessor Checks: */
     #if !defined(__INCLUDE_FROM_DATAFLASH_H)
       #error Do not include this file directly. Include LUFA/Drivers/Board/Dataflash.h instead.
     #endif
 
+  /* Public Interface - May be used in end-application: */
+    /* Macros: */
+      #if !defined(DATAFLASH_TOTALCHIPS)
+        #define DATAFLASH_TOTALCHIPS      1 // Number of fitted Dataflash ICs, consecutive pages are striped across two chips
+      #endif
+
   /* Private Interface - For use in library only: */
   #if !defined(__DOXYGEN__)
     /* Macros: */
       #define DATAFLASH_CHIPCS_PORT  PORTB
       #define DATAFLASH_CHIPCS_DDR   DDRB
-      #define DATAFLASH_CHIPCS_MASK  (1<<4)
+      #if (DATAFLASH_TOTALCHIPS == 2)
+        #define DATAFLASH_CHIPCS_MASK  ((1<<4) | (1<<5))
+      #else
+        #define DATAFLASH_CHIPCS_MASK  (1<<4)
+      #endif
   #endif
 
   /* Public Interface - May be used in end-application: */
     /* Macros: */
-      #define DATAFLASH_TOTALCHIPS        1
       #define DATAFLASH_NO_CHIP           DATAFLASH_CHIPCS_MASK
       #define DATAFLASH_CHIP1             (DATAFLASH_CHIPCS_MASK ^ (1<<4))
-      #define DATAFLASH_CHIP2             // TODO: Replace with mask to hold /CS of second Dataflash low, and all others high
-      #define DATAFLASH_PAGE_SIZE         512
-      #define DATAFLASH_PAGES             8192
-      #define DATAFLASH_PAGE_ADDR_WIDTH   13
-      #define DATAFLASH_OFFSET_ADDR_WIDTH  9 
+      #define DATAFLASH_CHIP2             (DATAFLASH_CHIPCS_MASK ^ (1<<5))
+      #define DATAFLASH_PAGE_SHIFT        (Dataflash_Geometry.PageShift)
+      #define DATAFLASH_PAGE_SIZE         ((uint16_t)1 << DATAFLASH_PAGE_SHIFT)
+      #define DATAFLASH_PAGE_MASK         (DATAFLASH_PAGE_SIZE - 1)
+      #define DATAFLASH_PAGES             (Dataflash_Geometry.Pages)
+      #define DATAFLASH_OFFSET_ADDR_WIDTH (Dataflash_Geometry.OffsetAddrWidth)
+
+      /* False when the fitted part was not recognised, whose geometry is then unknown and which is left alone */
+      #define DATAFLASH_IDENTIFIED        (DATAFLASH_PAGES != 0)
+
+      /* True when a continuous array read runs from one board page straight into the next, false when pages are
+       * striped across two chips or the unused tail of standard size pages sits between them
+       */
+      #define DATAFLASH_PAGES_CONTIGUOUS  ((DATAFLASH_TOTALCHIPS == 1) && (DATAFLASH_OFFSET_ADDR_WIDTH == DATAFLASH_PAGE_SHIFT))
+
+      /* Geometry assumed until Dataflash_DetectGeometry() has identified the part, that of a binary page AT45DB321E */
+      #define DATAFLASH_DEFAULT_PAGE_SHIFT        9
+      #define DATAFLASH_DEFAULT_PAGES             8192
+      #define DATAFLASH_DEFAULT_OFFSET_ADDR_WIDTH 9
+
+    /* Type Defines: */
+      /** Geometry of the fitted dataflash ICs, all chips on a board must be of the same part. Only the first
+       *  (1 << PageShift) bytes of each page are used, so that board addresses split into a page number and a
+       *  byte-in-page offset with shifts and masks even on parts configured for the standard (528 byte) page size.
+       */
+      typedef struct
+      {
+        uint8_t  PageShift;       // log2 of the number of bytes used in each page
+        uint8_t  OffsetAddrWidth; // Width of the byte address field of a device address, PageShift + 1 on standard page size parts
+        uint16_t Pages;           // Number of pages in each chip
+      } Dataflash_Geometry_t;
+
+    /* External Variables: */
+      extern Dataflash_Geometry_t Dataflash_Geometry;
 
     /* Inline Functions: */
       /*
@@ -55,11 +94,21 @@
        * Sends a set of page and buffer address bytes to the currently selected dataflash IC, for use with
        *  dataflash commands which require a complete 24-byte address.
        *
-       *  \param[in] PageAddress  Page address within the selected dataflash IC
+       *  \param[in] PageAddress  Page address within the board's dataflash ICs, the chip holding it must
+       *                          already be selected via \ref Dataflash_SelectChipFromPage()
        *  \param[in] BufferByte   Address within the dataflash's buffer
        */
       static inline void Dataflash_SendAddressBytes(uint16_t PageAddress, const uint16_t BufferByte)
       {
+        #if (DATAFLASH_TOTALCHIPS == 2)
+          PageAddress >>= 1; // Even pages live on CHIP1, odd pages on CHIP2
+        #endif
+
+        uint32_t Address = ((uint32_t)PageAddress << DATAFLASH_OFFSET_ADDR_WIDTH) | BufferByte;
+
+        Dataflash_SendByte((Address >> 16) & 0xFF);
+        Dataflash_SendByte((Address >>  8) & 0xFF);
+        Dataflash_SendByte((Address >>  0) & 0xFF);
       }
 
       /** Determines the currently selected dataflash chip.
@@ -106,7 +155,7 @@
       {
         Dataflash_DeselectChip();
 
-        if (PageAddress >= DATAFLASH_PAGES)
+        if ((PageAddress >> (DATAFLASH_TOTALCHIPS - 1)) >= DATAFLASH_PAGES)
           return;
 
         #if (DATAFLASH_TOTALCHIPS == 2)
@@ -139,6 +188,116 @@
         Dataflash_ToggleSelectedChipCS();
       }
 
+      /** Spin-loops until every dataflash IC on the board has finished its current command, then
+       *  deselects them all.
+       */
+      static inline void Dataflash_WaitWhileAllBusy(void)
+      {
+        Dataflash_SelectChip(DATAFLASH_CHIP1);
+        Dataflash_WaitWhileBusy();
+
+        #if (DATAFLASH_TOTALCHIPS == 2)
+          Dataflash_SelectChip(DATAFLASH_CHIP2);
+          Dataflash_WaitWhileBusy();
+        #endif
+
+        Dataflash_DeselectChip();
+      }
+
+      /** Polls the status of the currently selected dataflash once, without waiting for it.
+       *
+       *  \return Boolean true if the dataflash is still executing a command, false otherwise
+       */
+      static inline bool Dataflash_IsBusy(void)
+      {
+        Dataflash_SendByte(DF_CMD_GETSTATUS);
+        uint8_t Status = Dataflash_ReceiveByte();
+        Dataflash_ToggleSelectedChipCS();
+
+        return !(Status & DF_STATUSREG_BYTE1_READY);
+      }
+
+      /** Polls the status of every dataflash IC on the board once, then deselects them all.
+       *
+       *  \return Boolean true if any dataflash is still executing a command, false otherwise
+       */
+      static inline bool Dataflash_IsAnyBusy(void)
+      {
+        Dataflash_SelectChip(DATAFLASH_CHIP1);
+        bool Busy = Dataflash_IsBusy();
+
+        #if (DATAFLASH_TOTALCHIPS == 2)
+          Dataflash_SelectChip(DATAFLASH_CHIP2);
+          Busy |= Dataflash_IsBusy();
+        #endif
+
+        Dataflash_DeselectChip();
+        return Busy;
+      }
+
+      /** Reads the manufacturer and device ID and the page size status bit of the first dataflash IC and fills in
+       *  the given geometry to match. Unknown parts are given no pages, see \ref DATAFLASH_IDENTIFIED.
+       *
+       *  \param[out] Geometry  Geometry to fill in, which need not be \ref Dataflash_Geometry
+       */
+      static inline void Dataflash_ReadGeometry(Dataflash_Geometry_t* const Geometry)
+      {
+        Dataflash_SelectChip(DATAFLASH_CHIP1);
+
+        Dataflash_SendByte(DF_CMD_READMANUFACTURERDEVICEINFO);
+        uint8_t Manufacturer = Dataflash_ReceiveByte();
+        uint8_t Density      = Dataflash_ReceiveByte() & DF_DEVICE_ID_DENSITY_MASK;
+        Dataflash_ToggleSelectedChipCS();
+
+        Dataflash_SendByte(DF_CMD_GETSTATUS);
+        uint8_t Status = Dataflash_ReceiveByte();
+        Dataflash_DeselectChip();
+
+        Geometry->PageShift = DATAFLASH_DEFAULT_PAGE_SHIFT;
+        Geometry->Pages     = 0;
+
+        if (Manufacturer == DF_MANUFACTURER_ID && Density == DF_DEVICE_ID_DENSITY_32MBIT) {
+          Geometry->Pages     = 8192;
+        }
+        else if (Manufacturer == DF_MANUFACTURER_ID && Density == DF_DEVICE_ID_DENSITY_64MBIT) {
+          Geometry->PageShift = 8;
+          Geometry->Pages     = 32768;
+        }
+
+        /* Standard page size parts carry the extra bytes of each page in one more byte address bit */
+        Geometry->OffsetAddrWidth = Geometry->PageShift + ((Status & DF_STATUSREG_BYTE1_PAGESIZE) ? 0 : 1);
+      }
+
+      /** Identifies the fitted dataflash ICs and sets up \ref Dataflash_Geometry to match. */
+      static inline void Dataflash_DetectGeometry(void)
+      {
+        Dataflash_ReadGeometry(&Dataflash_Geometry);
+      }
+
+      /** Reads the factory programmed unique identifier from the security register of the first dataflash IC,
+       *  folding its \ref DF_SECURITYREG_UNIQUE_BYTES bytes down to the given length by XOR so that every byte of
+       *  the identifier counts towards the result.
+       *
+       *  \param[out] ID      Buffer to receive the folded identifier
+       *  \param[in]  Length  Size of the buffer, between 1 and \ref DF_SECURITYREG_UNIQUE_BYTES
+       */
+      static inline void Dataflash_ReadUniqueID(uint8_t* const ID, const uint8_t Length)
+      {
+        for (uint8_t i = 0; i < Length; i++)
+          ID[i] = 0;
+
+        Dataflash_SelectChip(DATAFLASH_CHIP1);
+        Dataflash_SendByte(DF_CMD_READSECURITYREG);
+
+        for (uint8_t i = 0; i < (DF_SECURITYREG_DUMMY_BYTES + DF_SECURITYREG_USER_BYTES); i++)
+          Dataflash_ReceiveByte();
+
+        for (uint8_t i = 0; i < DF_SECURITYREG_UNIQUE_BYTES; i++)
+          ID[i % Length] ^= Dataflash_ReceiveByte();
+
+        Dataflash_DeselectChip();
+      }
+
       /** 
        *  
        */
@@ -155,7 +314,7 @@
         // Dummy bytes 
         uint8_t dummy_cycles = 0;
         switch(_read_command){
-          //case DF_CMD_MAINMEMPAGEREAD   : dummy_cycles = 4; break;
+          case DF_CMD_MAINMEMPAGEREAD   : dummy_cycles = 4; break;
           case DF_CMD_CONTARRAYREAD_LP  : dummy_cycles = 0; break;
           case DF_CMD_CONTARRAYREAD_LF  : dummy_cycles = 0; break;
           //case DF_CMD_CONTARRAYREAD_HF  : dummy_cycles = 1; break;
@@ -171,10 +330,13 @@
 
       }
 
-      /** 
+      /** Sends a read command for the given board page, the chip holding it must already be selected.
        *  
        */
       static inline void Dataflash_Configure_Read_Page_Offset(uint8_t _read_command, uint16_t _page, uint16_t _offset){
+        #if (DATAFLASH_TOTALCHIPS == 2)
+          _page >>= 1;
+        #endif
         Dataflash_Configure_Read_Address(_read_command, ((uint32_t)_page << DATAFLASH_OFFSET_ADDR_WIDTH) + (uint32_t)_offset);
       }
 
@@ -193,11 +355,12 @@
 
       }
 
-      /** 
+      /** Sends a write command for the given board page, the chip holding it must already be selected.
        *  
        */
       static inline void Dataflash_Configure_Write_Page_Offset(uint8_t _write_command, uint16_t _page, uint16_t _offset){
-        Dataflash_Configure_Write_Address(_write_command, ((uint32_t)_page << DATAFLASH_OFFSET_ADDR_WIDTH) + (uint32_t)_offset);
+        Dataflash_SendByte(_write_command);
+        Dataflash_SendAddressBytes(_page, _offset);
       }
 
 #endif
@@ -0,0 +1,74 @@
+/*
+   Board Dataflash bus driver for the RRAM Testchip
+
+   The Dataflash ICs are driven either from the plain SPI peripheral (default) or, when DATAFLASH_USE_USART_SPI
+   is defined, from USART1 in Master SPI mode. The USART transmitter is double buffered, so back to back bytes
+   leave no gap on the bus. With the USART backend the Dataflash MISO, MOSI and SCK lines are wired to RXD1 (PD2),
+   TXD1 (PD3) and XCK1 (PD5) instead of PB3, PB2 and PB1.
+*/
+
+#ifndef __DATAFLASH_BUS_RRAM_TESTCHIP_H__
+#define __DATAFLASH_BUS_RRAM_TESTCHIP_H__
+
+  /* Preprocessor Checks: */
+    #if !defined(__INCLUDE_FROM_DATAFLASH_H)
+      #error Do not include this file directly. Include LUFA/Drivers/Board/Dataflash.h instead.
+    #endif
+
+  /* Private Interface - For use in library only: */
+  #if !defined(__DOXYGEN__)
+    /* Macros: */
+      #define DATAFLASH_USART_XCK_DDR  DDRD
+      #define DATAFLASH_USART_XCK_MASK (1<<5)
+      #define DATAFLASH_USART_UCPHA    (1<<1) // UCSZ10 doubles as UCPHA1 in Master SPI mode
+      #define DATAFLASH_USART_UCPOL    (1<<0)
+  #endif
+
+  /* Public Interface - May be used in end-application: */
+    /* Inline Functions: */
+    #if defined(DATAFLASH_USE_USART_SPI)
+      /** Sends a byte to the currently selected dataflash IC over USART1 and returns the byte clocked back. */
+      static inline uint8_t Dataflash_USART_TransferByte(const uint8_t Byte)
+      {
+        UDR1 = Byte;
+        while (!(UCSR1A & (1 << RXC1)));
+        return UDR1;
+      }
+
+      /* Route the dataflash byte functions to the USART, so that the rest of the dataflash API runs unchanged */
+      #define Dataflash_TransferByte(Byte) Dataflash_USART_TransferByte(Byte)
+      #define Dataflash_SendByte(Byte)     ((void)Dataflash_USART_TransferByte(Byte))
+      #define Dataflash_ReceiveByte()      Dataflash_USART_TransferByte(0x00)
+
+      /** Sets up USART1 as an SPI master at F_CPU/2 in SPI mode 3, MSB first. */
+      static inline void Dataflash_BusInit(void)
+      {
+        UBRR1  = 0;
+        DATAFLASH_USART_XCK_DDR |= DATAFLASH_USART_XCK_MASK;
+        UCSR1C = (1 << UMSEL11) | (1 << UMSEL10) | DATAFLASH_USART_UCPHA | DATAFLASH_USART_UCPOL;
+        UCSR1B = (1 << RXEN1) | (1 << TXEN1);
+        UBRR1  = 0; // The baud rate must be set after the transmitter is enabled
+      }
+
+      /** Releases USART1 and its clock pin. */
+      static inline void Dataflash_BusShutDown(void)
+      {
+        UCSR1B = 0;
+        UCSR1C = 0;
+        DATAFLASH_USART_XCK_DDR &= ~DATAFLASH_USART_XCK_MASK;
+      }
+    #else
+      /** Sets up the SPI peripheral as a master at F_CPU/2 in SPI mode 3, MSB first. */
+      static inline void Dataflash_BusInit(void)
+      {
+        SPI_Init(SPI_SPEED_FCPU_DIV_2 | SPI_ORDER_MSB_FIRST | SPI_SCK_LEAD_FALLING | SPI_SAMPLE_TRAILING | SPI_MODE_MASTER);
+      }
+
+      /** Releases the SPI peripheral. */
+      static inline void Dataflash_BusShutDown(void)
+      {
+        SPI_ShutDown();
+      }
+    #endif
+
+#endif
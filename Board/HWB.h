@@ -0,0 +1,46 @@
+/*
+   Board hardware button driver for the RRAM Testchip
+
+   The HWB button pulls PD7 to ground while it is pressed. Holding it through a reset keeps the bootloader running
+   even when a valid application is present.
+*/
+
+#ifndef __HWB_RRAM_TESTCHIP_H__
+#define __HWB_RRAM_TESTCHIP_H__
+
+  /* Preprocessor Checks: */
+    #if !defined(__INCLUDE_FROM_HWB_H)
+      #error Do not include this file directly. Include LUFA/Drivers/Board/HWB.h instead.
+    #endif
+
+  /* Private Interface - For use in library only: */
+  #if !defined(__DOXYGEN__)
+    /* Macros: */
+      #define HWB_PORT  PORTD
+      #define HWB_DDR   DDRD
+      #define HWB_PIN   PIND
+      #define HWB_MASK  (1<<7)
+  #endif
+
+  /* Public Interface - May be used in end-application: */
+    /* Inline Functions: */
+      /** Configures the HWB pin as an input with its pull-up enabled. */
+      static inline void HWB_Init(void)
+      {
+        HWB_DDR  &= ~HWB_MASK;
+        HWB_PORT |=  HWB_MASK;
+      }
+
+      /** Returns the HWB pin to its reset state, so that the application finds it untouched. */
+      static inline void HWB_ShutDown(void)
+      {
+        HWB_PORT &= ~HWB_MASK;
+      }
+
+      /** Returns true while the HWB button is pressed. */
+      static inline bool HWB_GetStatus(void)
+      {
+        return !(HWB_PIN & HWB_MASK);
+      }
+
+#endif
@@ -0,0 +1,237 @@
+
+/* \file
+ *
+ * Dataflash and flash programming services exported to the application through the jump table in
+ * BootloaderAPITable.S.
+ */
+
+#include "BootloaderAPI.h"
+#include "atmel-usbdfu.h"
+
+/** Selects the given chip, 0 for the first and 1 for the second, and waits for it to finish its previous command. */
+static void BootloaderAPI_SelectChip(uint8_t chip)
+{
+#if (DATAFLASH_TOTALCHIPS == 2)
+  Dataflash_SelectChip(chip ? DATAFLASH_CHIP2 : DATAFLASH_CHIP1);
+#else
+  (void)chip;
+  Dataflash_SelectChip(DATAFLASH_CHIP1);
+#endif
+
+  Dataflash_WaitWhileBusy();
+}
+
+/** Reads the geometry of the fitted Dataflash ICs onto the caller's stack and finds the board page, as numbered by
+ *  the bootloader's page bitmap, holding the given device address of the given chip.
+ */
+static uint16_t BootloaderAPI_GetBoardPage(Dataflash_Geometry_t* geometry, uint8_t chip, uint32_t address)
+{
+  Dataflash_WaitWhileAllBusy();
+  Dataflash_ReadGeometry(geometry);
+
+  return ((uint16_t)(address >> geometry->OffsetAddrWidth) << (DATAFLASH_TOTALCHIPS - 1)) | chip;
+}
+
+/** Sets the bit of a board page in the bootloader's page bitmap, so that the bootloader no longer takes the page
+ *  for erased. The bitmap page is rewritten through buffer 2 only when the bit is still clear, which leaves the data
+ *  the application has written into buffer 1 alone.
+ */
+static void BootloaderAPI_MarkPageProgrammed(const Dataflash_Geometry_t* geometry, uint16_t page)
+{
+  uint16_t bitmapPage = DATAFLASH_BITMAP_PAGE_OF(*geometry) + ((page >> 3) >> geometry->PageShift);
+  uint32_t pageAddr   = (uint32_t)(bitmapPage >> (DATAFLASH_TOTALCHIPS - 1)) << geometry->OffsetAddrWidth;
+  uint16_t offset     = (page >> 3) & (((uint16_t)1 << geometry->PageShift) - 1);
+
+  BootloaderAPI_SelectChip(bitmapPage & (DATAFLASH_TOTALCHIPS - 1));
+  Dataflash_Configure_Read_Address(DF_CMD_CONTARRAYREAD_LF, pageAddr + offset);
+  uint8_t bitmapByte = Dataflash_ReceiveByte();
+  Dataflash_ToggleSelectedChipCS();
+
+  if(!(bitmapByte & _BV(page & 0x07))){
+    Dataflash_Configure_Write_Address(DF_CMD_MAINMEMTOBUFF2, pageAddr);
+    Dataflash_ToggleSelectedChipCS();
+    Dataflash_WaitWhileBusy();
+
+    Dataflash_Configure_Write_Address(DF_CMD_BUFF2WRITE, offset);
+    Dataflash_SendByte(bitmapByte | _BV(page & 0x07));
+    Dataflash_ToggleSelectedChipCS();
+
+    Dataflash_Configure_Write_Address(DF_CMD_BUFF2TOMAINMEMWITHERASE, pageAddr);
+  }
+
+  Dataflash_DeselectChip();
+}
+
+/** Sets up the chip select lines and the bus the Dataflash ICs hang off, which the application must leave alone. */
+void BootloaderAPI_DataflashInit(void)
+{
+  Dataflash_Init();
+  Dataflash_BusInit();
+}
+
+/** Identifies the fitted Dataflash ICs.
+ *
+ *  \param[out] geometry  Geometry of each chip
+ *
+ *  \return Number of fitted chips, 0 when the part is not recognised
+ */
+uint8_t BootloaderAPI_DataflashGetGeometry(Dataflash_Geometry_t* geometry)
+{
+  Dataflash_WaitWhileAllBusy();
+  Dataflash_ReadGeometry(geometry);
+
+  return geometry->Pages ? DATAFLASH_TOTALCHIPS : 0;
+}
+
+/** Reads from one page through the main memory page read command, which wraps round at the end of the page. */
+void BootloaderAPI_DataflashReadPage(uint8_t chip, uint32_t address, uint8_t* buffer, uint16_t length)
+{
+  BootloaderAPI_SelectChip(chip);
+  Dataflash_Configure_Read_Address(DF_CMD_MAINMEMPAGEREAD, address);
+
+  while(length--)
+    *(buffer++) = Dataflash_ReceiveByte();
+
+  Dataflash_DeselectChip();
+}
+
+/** Reads through the continuous array read command, which runs on from one page into the next. */
+void BootloaderAPI_DataflashReadContinuous(uint8_t chip, uint32_t address, uint8_t* buffer, uint16_t length)
+{
+  BootloaderAPI_SelectChip(chip);
+  Dataflash_Configure_Read_Address(DF_CMD_CONTARRAYREAD_LF, address);
+
+  while(length--)
+    *(buffer++) = Dataflash_ReceiveByte();
+
+  Dataflash_DeselectChip();
+}
+
+/** Writes into buffer 1 of the chip, from which BootloaderAPI_DataflashProgramPage() programs a page. The main
+ *  memory is not touched, so any offset is accepted.
+ */
+void BootloaderAPI_DataflashWriteBuffer(uint8_t chip, uint16_t offset, const uint8_t* data, uint16_t length)
+{
+  BootloaderAPI_SelectChip(chip);
+  Dataflash_Configure_Write_Address(DF_CMD_BUFF1WRITE, offset);
+
+  while(length--)
+    Dataflash_SendByte(*(data++));
+
+  Dataflash_DeselectChip();
+}
+
+/** Programs the page holding the address from buffer 1, erasing it first. The page is marked in the bootloader's
+ *  page bitmap as possibly programmed beforehand.
+ *
+ *  \return BOOTLOADER_API_ERR_ADDRESS for a page in the area reserved for the bootloader or on an unrecognised part,
+ *          BOOTLOADER_API_OK otherwise
+ */
+uint8_t BootloaderAPI_DataflashProgramPage(uint8_t chip, uint32_t address)
+{
+  Dataflash_Geometry_t geometry;
+  uint16_t page = BootloaderAPI_GetBoardPage(&geometry, chip, address);
+
+  if(!geometry.Pages || page >= DATAFLASH_BITMAP_PAGE_OF(geometry))
+    return BOOTLOADER_API_ERR_ADDRESS;
+
+  BootloaderAPI_MarkPageProgrammed(&geometry, page);
+
+  BootloaderAPI_SelectChip(chip);
+  Dataflash_Configure_Write_Address(DF_CMD_BUFF1TOMAINMEMWITHERASE, address);
+  Dataflash_DeselectChip();
+
+  return BOOTLOADER_API_OK;
+}
+
+/** Erases the page holding the address. Its bit in the page bitmap is left as it is, the bootloader reads the page
+ *  back before taking it for erased.
+ *
+ *  \return BOOTLOADER_API_ERR_ADDRESS for a page in the area reserved for the bootloader or on an unrecognised part,
+ *          BOOTLOADER_API_OK otherwise
+ */
+uint8_t BootloaderAPI_DataflashErasePage(uint8_t chip, uint32_t address)
+{
+  Dataflash_Geometry_t geometry;
+  uint16_t page = BootloaderAPI_GetBoardPage(&geometry, chip, address);
+
+  if(!geometry.Pages || page >= DATAFLASH_BITMAP_PAGE_OF(geometry))
+    return BOOTLOADER_API_ERR_ADDRESS;
+
+  BootloaderAPI_SelectChip(chip);
+  Dataflash_Configure_Write_Address(DF_CMD_PAGEERASE, address);
+  Dataflash_DeselectChip();
+
+  return BOOTLOADER_API_OK;
+}
+
+/** Programs one application flash page from an SRAM buffer: the page is erased, filled, written and read back once
+ *  the RWW section has been enabled again. Interrupts are held off throughout, as the application's vectors cannot
+ *  be read while the RWW section is busy.
+ *
+ *  \param[in] address  Byte address of the page, which must be page aligned and below the boot section
+ *  \param[in] data     SPM_PAGESIZE bytes to program
+ *
+ *  \return A BootloaderAPI_Status_t value
+ */
+uint8_t BootloaderAPI_WriteFlashPage(uint16_t address, const uint8_t* data)
+{
+  uint16_t page = address / SPM_PAGESIZE;
+  uint8_t  sreg;
+
+  if((address & (SPM_PAGESIZE - 1)) || address >= BOOT_START_ADDR)
+    return BOOTLOADER_API_ERR_ADDRESS;
+
+  /* The image is incomplete until committed, and the page is no longer known to be erased */
+  SetApplicationValid(false);
+  eeprom_update_byte((uint8_t*)(FLASH_BITMAP_EEPROM_ADDR + (page >> 3)),
+                     eeprom_read_byte((uint8_t*)(FLASH_BITMAP_EEPROM_ADDR + (page >> 3))) | _BV(page & 0x07));
+
+  sreg = SREG;
+  cli();
+
+  /* SPM cannot run while the EEPROM is being written */
+  eeprom_busy_wait();
+
+  boot_page_erase(address);
+  boot_spm_busy_wait();
+
+  for(uint8_t i=0;i<SPM_PAGESIZE;i+=2)
+    boot_page_fill(address + i, data[i] | ((uint16_t)data[i + 1] << 8));
+
+  boot_page_write(address);
+  boot_spm_busy_wait();
+  boot_rww_enable();
+
+  SREG = sreg;
+
+  for(uint8_t i=0;i<SPM_PAGESIZE;i++){
+    if(pgm_read_byte(address + i) != data[i])
+      return BOOTLOADER_API_ERR_VERIFY;
+  }
+
+  return BOOTLOADER_API_OK;
+}
+
+/** Records the application image the same way a completed download does, then sets the application valid marker.
+ *  Unlike RecordApplication() it runs to completion, keeping the record on the stack.
+ *
+ *  \return A BootloaderAPI_Status_t value
+ */
+uint8_t BootloaderAPI_CommitApplication(void)
+{
+  App_Record_t record;
+
+  record.Length = FindApplicationEnd();
+  if(!record.Length)
+    return BOOTLOADER_API_ERR_BLANK;
+
+  record.Header  = pgm_read_word(0);
+  record.Trailer = pgm_read_word(record.Length - 2);
+  record.Crc     = ~Flash_Crc32(0, record.Length, 0xFFFFFFFF);
+
+  eeprom_update_block(&record, (void*)APP_RECORD_EEPROM_ADDR, sizeof(App_Record_t));
+  SetApplicationValid(true);
+
+  return BOOTLOADER_API_OK;
+}
@@ -0,0 +1,82 @@
+
+/** \file
+ *
+ *  Header file for BootloaderAPI.c.
+ *
+ *  The bootloader exports its Dataflash driver to the application through a jump table at a fixed address at the end
+ *  of the boot section, one rjmp per entry in the order listed below. An application calls entry n through a function
+ *  pointer to the word address (BOOTLOADER_API_TABLE_START / 2) + n. The signature words at BOOTLOADER_API_SIGNATURES
+ *  tell whether a bootloader exporting this table is present.
+ *
+ *  The functions use the stack only, never the bootloader's SRAM variables, which the running application owns, and
+ *  drive the bus by polling, as the bootloader's interrupt vectors are not in use. Dataflash addresses are the raw
+ *  24-bit device addresses of the given chip, built by the caller from the geometry BootloaderAPI_DataflashGetGeometry()
+ *  reports. Every call first waits for the chip to finish its previous command, so programming and erasing return
+ *  as soon as the command has been issued.
+ *
+ *  The top of the Dataflash belongs to the bootloader: the page bitmap, which tells it the pages known to be erased,
+ *  and above it the delta staging area, (BOOT_START_ADDR >> PageShift) pages holding a copy of the installed image.
+ *  Programming or erasing a page from the bitmap up is refused with BOOTLOADER_API_ERR_ADDRESS. Programming a page
+ *  below it marks the page in the bitmap through buffer 2, buffer 1 is only ever written by the application. A part
+ *  the bootloader does not recognise is reported with no chips and is neither programmed nor erased.
+ *
+ *  The table also lets the application program its own flash, which only code in the boot section can do. Writing a
+ *  page clears the application valid marker, so that an update cut short leaves the bootloader running at the next
+ *  reset; BootloaderAPI_CommitApplication() records the new image and sets the marker again once it is complete.
+ */
+
+#ifndef _BOOTLOADER_API_H_
+#define _BOOTLOADER_API_H_
+
+#include <avr/io.h>
+#include <stdint.h>
+
+#include <LUFA/Drivers/Board/Dataflash.h>
+
+/** Byte address of the jump table, which must match the section start given to the linker in the makefile */
+#define BOOTLOADER_API_TABLE_START  (FLASHEND - 0x1F)
+
+/** Byte address of the signature words, which must match the section start given to the linker in the makefile */
+#define BOOTLOADER_API_SIGNATURES   (FLASHEND - 0x07)
+
+/** Signature word telling the application that the Dataflash service table is present */
+#define BOOTLOADER_API_SIGNATURE    0xDF45
+
+/** Version of the table layout, raised whenever entries are added */
+#define BOOTLOADER_API_VERSION      2
+
+/** Jump table entries, in table order */
+enum BootloaderAPI_Entry_t
+{
+  BOOTLOADER_API_DATAFLASH_INIT           = 0,
+  BOOTLOADER_API_DATAFLASH_GETGEOMETRY    = 1,
+  BOOTLOADER_API_DATAFLASH_READPAGE       = 2,
+  BOOTLOADER_API_DATAFLASH_READCONTINUOUS = 3,
+  BOOTLOADER_API_DATAFLASH_WRITEBUFFER    = 4,
+  BOOTLOADER_API_DATAFLASH_PROGRAMPAGE    = 5,
+  BOOTLOADER_API_DATAFLASH_ERASEPAGE      = 6,
+  BOOTLOADER_API_WRITEFLASHPAGE           = 7,
+  BOOTLOADER_API_COMMITAPPLICATION        = 8
+};
+
+/** Results of the programming entries */
+enum BootloaderAPI_Status_t
+{
+  BOOTLOADER_API_OK          = 0, // Done
+  BOOTLOADER_API_ERR_ADDRESS = 1, // Address not page aligned, within the boot section or the reserved Dataflash area, or
+                                  // Dataflash part not recognised
+  BOOTLOADER_API_ERR_VERIFY  = 2, // Page read back differently from the data written
+  BOOTLOADER_API_ERR_BLANK   = 3  // Application section blank, nothing to record
+};
+
+void BootloaderAPI_DataflashInit(void);
+uint8_t BootloaderAPI_DataflashGetGeometry(Dataflash_Geometry_t* geometry);
+void BootloaderAPI_DataflashReadPage(uint8_t chip, uint32_t address, uint8_t* buffer, uint16_t length);
+void BootloaderAPI_DataflashReadContinuous(uint8_t chip, uint32_t address, uint8_t* buffer, uint16_t length);
+void BootloaderAPI_DataflashWriteBuffer(uint8_t chip, uint16_t offset, const uint8_t* data, uint16_t length);
+uint8_t BootloaderAPI_DataflashProgramPage(uint8_t chip, uint32_t address);
+uint8_t BootloaderAPI_DataflashErasePage(uint8_t chip, uint32_t address);
+uint8_t BootloaderAPI_WriteFlashPage(uint16_t address, const uint8_t* data);
+uint8_t BootloaderAPI_CommitApplication(void);
+
+#endif /* _BOOTLOADER_API_H_ */
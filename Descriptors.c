@@ -24,7 +24,7 @@ const DFU_Mode_Descriptor_Set_t DFU_Mode_Descriptor_Set =
       .bcdDevice           = 0x0000,
       .iManufacturer       = 0x00,
       .iProduct            = 0x00,
-      .iSerialNumber       = 0x00,
+      .iSerialNumber       = 0x03,
       .bNumConfigurations  = 0x01 
     },
 
@@ -86,6 +86,28 @@ const USB_Descriptor_String_t ProductString =
   .UnicodeString  = L"ICSRL RRAM Testchip"
 };
 
+/** Serial number, kept in SRAM and filled in at startup from the unique ID of the Dataflash by
+ *  SetSerialNumberString(), so that identical boards can be told apart by the host.
+ */
+USB_Serial_Descriptor_String_t SerialString =
+{
+  .Header         = {.Size = USB_STRING_LEN(SERIAL_NUMBER_BYTES * 2), .Type = DTYPE_String}
+};
+
+/** Fills in the serial number string with the given bytes in upper case hex.
+ *
+ *  \param[in] SerialNumber  SERIAL_NUMBER_BYTES bytes identifying the board
+ */
+void SetSerialNumberString(const uint8_t* const SerialNumber)
+{
+  for (uint8_t i = 0; i < (SERIAL_NUMBER_BYTES * 2); i++)
+  {
+    uint8_t Nibble = (i & 0x01) ? (SerialNumber[i >> 1] & 0x0F) : (SerialNumber[i >> 1] >> 4);
+
+    SerialString.UnicodeString[i] = (Nibble < 10) ? ('0' + Nibble) : ('A' - 10 + Nibble);
+  }
+}
+
 uint16_t CALLBACK_USB_GetDescriptor(const uint16_t wValue, const uint8_t wIndex, const void** const DescriptorAddress)
 {
   const uint8_t DescriptorType   = (wValue >> 8);
@@ -119,6 +141,10 @@ uint16_t CALLBACK_USB_GetDescriptor(const uint16_t wValue, const uint8_t wIndex,
           Address = (void*)&(ProductString);
 					Size    = ProductString.Header.Size;
           break;
+        case 0x03: 
+          Address = (void*)&(SerialString);
+					Size    = SerialString.Header.Size;
+          break;
       }
       break;
   }
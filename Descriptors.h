@@ -16,6 +16,8 @@
 #define VENDOR_ID_CODE  0x03EB // Atmel
 #define PRODUCT_ID_CODE 0x2FF0 // ATmega32U2
 
+#define SERIAL_NUMBER_BYTES 8 // Bytes of the Dataflash unique ID in the serial number, shown as two hex digits each
+
 typedef struct
 {
   uint8_t  bLength;            // Size of this descriptor, in bytes.
@@ -80,6 +82,13 @@ typedef struct
   USB_DFU_Functional_Descriptor_t    Functional;
 } DFU_Mode_Descriptor_Set_t;
 
+typedef struct
+{
+  USB_Descriptor_Header_t Header;
+  uint16_t                UnicodeString[SERIAL_NUMBER_BYTES * 2];
+} USB_Serial_Descriptor_String_t;
+
+void SetSerialNumberString(const uint8_t* const SerialNumber);
 uint16_t CALLBACK_USB_GetDescriptor(const uint16_t wValue, const uint8_t wIndex, const void** const DescriptorAddress) ATTR_WARN_UNUSED_RESULT ATTR_NON_NULL_PTR_ARG(3);
 
 #endif
@@ -0,0 +1,107 @@
+/** \file
+ *
+ *  Hand written flash read loops for the blank check, upload and application record code.
+ *
+ *  They walk the flash with "lpm Rd, Z+", which reads a byte and steps the address in 3 cycles, instead of
+ *  reloading Z and using a 16-bit loop counter for every byte as pgm_read_byte() does.
+ */
+
+#ifndef _FLASH_KERNELS_H_
+#define _FLASH_KERNELS_H_
+
+#include <avr/io.h>
+#include <stdint.h>
+
+/** Skips over groups of four blank (0xFF) flash bytes, the four bytes of a group being ANDed together and
+ *  compared against 0xFF once.
+ *
+ *  \param[in] addr    Flash address of the first group
+ *  \param[in] groups  Number of groups to check, at least 1
+ *
+ *  \return Address of the first group holding a non-blank byte, or the address following the last group
+ */
+static inline uint16_t Flash_SkipBlankGroups(uint16_t addr, uint16_t groups)
+{
+  uint8_t all, next;
+
+  asm volatile (
+    "1:                        \n\t"
+    "lpm  %[all], Z+           \n\t"
+    "lpm  %[next], Z+          \n\t"
+    "and  %[all], %[next]      \n\t"
+    "lpm  %[next], Z+          \n\t"
+    "and  %[all], %[next]      \n\t"
+    "lpm  %[next], Z+          \n\t"
+    "and  %[all], %[next]      \n\t"
+    "cpi  %[all], 0xFF         \n\t"
+    "brne 2f                   \n\t"
+    "sbiw %[groups], 1         \n\t"
+    "brne 1b                   \n\t"
+    "rjmp 3f                   \n\t"
+    "2:                        \n\t"
+    "sbiw r30, 4               \n\t"
+    "3:                        \n\t"
+    : [all] "=&d" (all), [next] "=&r" (next), "+z" (addr), [groups] "+w" (groups)
+  );
+
+  return addr;
+}
+
+/** Copies groups of four flash bytes into the selected endpoint, one group per loop pass.
+ *
+ *  \param[in] addr    Flash address of the first byte
+ *  \param[in] groups  Number of groups to copy, at least 1
+ */
+static inline void Flash_WriteGroupsToEndpoint(uint16_t addr, uint8_t groups)
+{
+  uint8_t data;
+
+  asm volatile (
+    "1:                        \n\t"
+    ".rept 4                   \n\t"
+    "lpm  %[data], Z+          \n\t"
+    "sts  %[uedatx], %[data]   \n\t"
+    ".endr                     \n\t"
+    "dec  %[groups]            \n\t"
+    "brne 1b                   \n\t"
+    : [data] "=&r" (data), "+z" (addr), [groups] "+r" (groups)
+    : [uedatx] "n" (_SFR_MEM_ADDR(UEDATX))
+  );
+}
+
+/** Polynomial of the reflected CRC-32 used for the application record, the same as zlib's crc32() */
+#define FLASH_CRC32_POLYNOMIAL 0xEDB88320UL
+
+/** Shifts one bit out of a reflected CRC-32 */
+#define FLASH_CRC32_STEP(crc)  crc = ((crc) >> 1) ^ (((crc) & 1) ? FLASH_CRC32_POLYNOMIAL : 0)
+
+/** Folds a run of flash bytes into a reflected CRC-32, the eight bit steps of each byte written out in full
+ *  rather than looped over, which avoids both a bit counter and a 1KB lookup table.
+ *
+ *  \param[in] addr    Flash address of the first byte
+ *  \param[in] length  Number of bytes to fold in
+ *  \param[in] crc     CRC of the bytes before addr, 0xFFFFFFFF to start a new one
+ *
+ *  \return CRC including the run, to be inverted once the last run has been folded in
+ */
+static inline uint32_t Flash_Crc32(uint16_t addr, uint16_t length, uint32_t crc)
+{
+  uint8_t data;
+
+  while(length--){
+    asm volatile ("lpm %[data], Z+" : [data] "=r" (data), "+z" (addr));
+    crc ^= data;
+    FLASH_CRC32_STEP(crc);
+    FLASH_CRC32_STEP(crc);
+    FLASH_CRC32_STEP(crc);
+    FLASH_CRC32_STEP(crc);
+    FLASH_CRC32_STEP(crc);
+    FLASH_CRC32_STEP(crc);
+    FLASH_CRC32_STEP(crc);
+    FLASH_CRC32_STEP(crc);
+  }
+
+  return crc;
+}
+
+#endif /* _FLASH_KERNELS_H_ */
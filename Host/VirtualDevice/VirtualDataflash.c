@@ -0,0 +1,210 @@
+
+/** \file
+ *
+ *  Virtual AT45DB321E Dataflash, configured for binary (512 byte) pages, on the chip select line of DATAFLASH_CHIP1.
+ *
+ *  Reads and buffer accesses act byte by byte as they are clocked. Programs and erases act when the chip is
+ *  deselected at the end of their command, after which the chip reports busy for a set number of status reads.
+ *  While busy it ignores every command but the status read. Sector protection, lockdown and the power down modes
+ *  are not modelled.
+ */
+
+#include <string.h>
+
+#include "VirtualHardware.h"
+
+/** Status register of a ready chip: ready, the 32Mbit density code and binary pages */
+#define VIRTUAL_DATAFLASH_STATUS_READY 0x80
+#define VIRTUAL_DATAFLASH_STATUS       0x35
+
+/** Bytes of the security register, the user programmable half and the factory programmed unique identifier */
+#define VIRTUAL_DATAFLASH_SECURITY_SIZE 128
+
+/** Most command bytes kept, enough for the opcode, three address bytes and the dummy bytes of any read */
+#define VIRTUAL_DATAFLASH_COMMAND_SIZE  8
+
+static uint8_t* dataflashMemory;
+static unsigned dataflashBusyPolls;
+static unsigned dataflashBusyLeft;
+
+static uint8_t dataflashBuffers[2][VIRTUAL_DATAFLASH_PAGE_SIZE];
+static uint8_t dataflashSecurity[VIRTUAL_DATAFLASH_SECURITY_SIZE];
+
+/** Command being clocked in since the chip was selected */
+static uint8_t  dataflashCommand[VIRTUAL_DATAFLASH_COMMAND_SIZE];
+static uint32_t dataflashClocked;  // Bytes clocked since the chip was selected
+static uint32_t dataflashPosition; // Bytes read or written past the address of the command
+
+/** Hands the Dataflash its memory and the unique identifier of its security register.
+ *
+ *  \param[in] memory     VIRTUAL_DATAFLASH_SIZE bytes of Dataflash array
+ *  \param[in] uniqueID   VIRTUAL_DATAFLASH_UNIQUE_ID_SIZE bytes of factory programmed identifier
+ *  \param[in] busyPolls  Status reads reporting busy after each program or erase
+ */
+void VirtualDataflash_Attach(uint8_t* memory, const uint8_t* uniqueID, unsigned busyPolls)
+{
+  dataflashMemory    = memory;
+  dataflashBusyPolls = busyPolls;
+
+  memset(dataflashSecurity, 0xFF, VIRTUAL_DATAFLASH_SECURITY_SIZE - VIRTUAL_DATAFLASH_UNIQUE_ID_SIZE);
+  memcpy(&dataflashSecurity[VIRTUAL_DATAFLASH_SECURITY_SIZE - VIRTUAL_DATAFLASH_UNIQUE_ID_SIZE], uniqueID,
+         VIRTUAL_DATAFLASH_UNIQUE_ID_SIZE);
+}
+
+/** Number of dummy bytes between the address and the data of a command */
+static uint8_t VirtualDataflash_DummyBytes(uint8_t opcode)
+{
+  switch(opcode){
+    case 0x0B: return 1; // Continuous array read, high frequency
+    case 0x1B: return 2; // Continuous array read, highest frequency
+    case 0xD2: return 4; // Main memory page read
+    case 0xD4: return 1; // Buffer 1 read, high frequency
+    case 0xD6: return 1; // Buffer 2 read, high frequency
+    default:   return 0;
+  }
+}
+
+/** Page and byte addressed by the three address bytes of the command */
+static uint32_t VirtualDataflash_Address(void)
+{
+  uint32_t address = ((uint32_t)dataflashCommand[1] << 16) | ((uint32_t)dataflashCommand[2] << 8) | dataflashCommand[3];
+
+  return address % VIRTUAL_DATAFLASH_SIZE;
+}
+
+static uint8_t* VirtualDataflash_Page(void)
+{
+  return &dataflashMemory[VirtualDataflash_Address() & ~(VIRTUAL_DATAFLASH_PAGE_SIZE - 1)];
+}
+
+static uint16_t VirtualDataflash_Offset(uint32_t past)
+{
+  return (VirtualDataflash_Address() + past) & (VIRTUAL_DATAFLASH_PAGE_SIZE - 1);
+}
+
+/** Programs a buffer into the addressed page, with or without erasing the page first. */
+static void VirtualDataflash_Program(const uint8_t* buffer, bool erase)
+{
+  uint8_t* page = VirtualDataflash_Page();
+
+  for(uint16_t i=0;i<VIRTUAL_DATAFLASH_PAGE_SIZE;i++)
+    page[i] = erase ? buffer[i] : (page[i] & buffer[i]);
+}
+
+/** Carries out the program or erase command clocked in, once the chip is deselected at its end. */
+static void VirtualDataflash_Execute(void)
+{
+  uint8_t opcode = dataflashCommand[0];
+
+  if(dataflashClocked < 4)
+    return;
+
+  switch(opcode){
+    case 0x83: // Buffer to main memory page program with built-in erase
+    case 0x86:
+      VirtualDataflash_Program(dataflashBuffers[opcode == 0x86], true);
+      break;
+    case 0x88: // Buffer to main memory page program without built-in erase
+    case 0x89:
+      VirtualDataflash_Program(dataflashBuffers[opcode == 0x89], false);
+      break;
+    case 0x82: // Main memory page program through buffer, with built-in erase
+    case 0x85:
+      VirtualDataflash_Program(dataflashBuffers[opcode == 0x85], true);
+      break;
+    case 0x53: // Main memory page to buffer transfer
+    case 0x55:
+      memcpy(dataflashBuffers[opcode == 0x55], VirtualDataflash_Page(), VIRTUAL_DATAFLASH_PAGE_SIZE);
+      break;
+    case 0x81: // Page erase
+      memset(VirtualDataflash_Page(), 0xFF, VIRTUAL_DATAFLASH_PAGE_SIZE);
+      break;
+    case 0x50: // Block erase, 8 pages
+      memset(&dataflashMemory[VirtualDataflash_Address() & ~(8 * VIRTUAL_DATAFLASH_PAGE_SIZE - 1)], 0xFF,
+             8 * VIRTUAL_DATAFLASH_PAGE_SIZE);
+      break;
+    case 0xC7: // Chip erase
+      if(dataflashCommand[1] == 0x94 && dataflashCommand[2] == 0x80 && dataflashCommand[3] == 0x9A)
+        memset(dataflashMemory, 0xFF, VIRTUAL_DATAFLASH_SIZE);
+      else
+        return;
+      break;
+    default:
+      return;
+  }
+
+  dataflashBusyLeft = dataflashBusyPolls;
+}
+
+/** Follows the chip select line. A command starts on selection and a program or erase runs on deselection. */
+void VirtualDataflash_Select(bool selected)
+{
+  if(!selected && dataflashBusyLeft == 0)
+    VirtualDataflash_Execute();
+
+  dataflashClocked  = 0;
+  dataflashPosition = 0;
+}
+
+/** Clocks one byte in and out of the selected chip. */
+uint8_t VirtualDataflash_TransferByte(uint8_t data)
+{
+  uint32_t index = dataflashClocked++;
+  uint8_t  opcode;
+
+  if(index < VIRTUAL_DATAFLASH_COMMAND_SIZE)
+    dataflashCommand[index] = data;
+  opcode = dataflashCommand[0];
+
+  if(index == 0){
+    /* Each status read counts down the busy time of the command running */
+    if(opcode == 0xD7 && dataflashBusyLeft)
+      dataflashBusyLeft--;
+    return 0xFF;
+  }
+
+  if(opcode == 0xD7)
+    return dataflashBusyLeft ? VIRTUAL_DATAFLASH_STATUS : (VIRTUAL_DATAFLASH_STATUS | VIRTUAL_DATAFLASH_STATUS_READY);
+  if(dataflashBusyLeft)
+    return 0xFF;
+
+  if(opcode == 0x9F){
+    static const uint8_t identification[] = {0x1F, 0x27, 0x01, 0x01, 0x00};
+
+    return (index <= sizeof(identification)) ? identification[index - 1] : 0x00;
+  }
+
+  /* The three address bytes, and the dummy bytes of the reads which have them */
+  if(index < 4u + VirtualDataflash_DummyBytes(opcode))
+    return 0xFF;
+
+  uint32_t past = dataflashPosition++;
+
+  switch(opcode){
+    case 0x01: // Continuous array reads, running on across pages and wrapping at the end of the array
+    case 0x03:
+    case 0x0B:
+    case 0x1B:
+      return dataflashMemory[(VirtualDataflash_Address() + past) % VIRTUAL_DATAFLASH_SIZE];
+    case 0xD2: // Main memory page read, wrapping within the page
+      return VirtualDataflash_Page()[VirtualDataflash_Offset(past)];
+    case 0xD1: // Buffer reads, wrapping within the buffer
+    case 0xD4:
+      return dataflashBuffers[0][VirtualDataflash_Offset(past)];
+    case 0xD3:
+    case 0xD6:
+      return dataflashBuffers[1][VirtualDataflash_Offset(past)];
+    case 0x84: // Buffer writes, wrapping within the buffer
+    case 0x82:
+      dataflashBuffers[0][VirtualDataflash_Offset(past)] = data;
+      return 0xFF;
+    case 0x87:
+    case 0x85:
+      dataflashBuffers[1][VirtualDataflash_Offset(past)] = data;
+      return 0xFF;
+    case 0x77: // Security register read, the three bytes after the opcode being dummies
+      return (past < VIRTUAL_DATAFLASH_SECURITY_SIZE) ? dataflashSecurity[past] : 0xFF;
+    default:
+      return 0xFF;
+  }
+}
@@ -0,0 +1,241 @@
+
+/** \file
+ *
+ *  Virtual FLIP device: the bootloader of atmel-usbdfu.c, built for the host, serving its control transfers over a
+ *  Unix socket with the protocol of flip_socket.h. Host tools then run end to end against the real command handling
+ *  and DFU state machine without a board attached.
+ *
+ *  The device takes one host connection at a time. Each connection plugs the board in: a device process is forked
+ *  which starts the firmware from an external reset, so that the firmware begins from its initial state as on a
+ *  real reset, and it runs until the host disconnects, the watchdog resets the device or the bootloader starts the
+ *  application. The flash, EEPROM and Dataflash live in shared mappings, optionally backed by files, and keep their
+ *  contents from one connection to the next.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "VirtualHardware.h"
+#include "../flip_socket.h"
+
+/** main() of the firmware, renamed by VirtualDevice.h */
+int Firmware_Main(void);
+
+static const struct option deviceOptions[] =
+{
+  {"socket",    required_argument, NULL, 's'},
+  {"flash",     required_argument, NULL, 'f'},
+  {"eeprom",    required_argument, NULL, 'e'},
+  {"dataflash", required_argument, NULL, 'd'},
+  {"serial",    required_argument, NULL, 'n'},
+  {"busy",      required_argument, NULL, 'b'},
+  {"help",      no_argument,       NULL, 'h'},
+  {NULL,        0,                 NULL, 0}
+};
+
+static void VirtualDevice_Usage(const char* name)
+{
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -s, --socket PATH     socket to listen on, " FLIP_SOCKET_DEFAULT_PATH " by default\n"
+          "  -f, --flash FILE      file holding the flash, kept in memory only when not given\n"
+          "  -e, --eeprom FILE     file holding the EEPROM, kept in memory only when not given\n"
+          "  -d, --dataflash FILE  file holding the Dataflash, kept in memory only when not given\n"
+          "  -n, --serial TEXT     unique identifier in the Dataflash security register\n"
+          "  -b, --busy COUNT      Dataflash status reads reporting busy after each program or erase\n",
+          name);
+}
+
+/** Maps a memory shared with the device processes, backed by the given file when there is one. A new or short file
+ *  is extended with erased (0xFF) bytes.
+ */
+static uint8_t* VirtualDevice_MapMemory(const char* path, size_t size)
+{
+  uint8_t* memory;
+  int      fd;
+
+  if(!path){
+    memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(memory == MAP_FAILED)
+      return NULL;
+
+    memset(memory, 0xFF, size);
+    return memory;
+  }
+
+  struct stat info;
+
+  if((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0 || fstat(fd, &info) < 0){
+    perror(path);
+    return NULL;
+  }
+
+  if((size_t)info.st_size < size){
+    uint8_t erased[512];
+
+    memset(erased, 0xFF, sizeof(erased));
+    lseek(fd, info.st_size, SEEK_SET);
+    for(size_t left=size-info.st_size;left;){
+      ssize_t written = write(fd, erased, (left < sizeof(erased)) ? left : sizeof(erased));
+
+      if(written <= 0){
+        perror(path);
+        close(fd);
+        return NULL;
+      }
+      left -= written;
+    }
+  }
+
+  memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if(memory == MAP_FAILED){
+    perror(path);
+    return NULL;
+  }
+
+  return memory;
+}
+
+/** Ends the run of the firmware where the AVR would jump into the application. */
+void VirtualDevice_StartApplication(uint16_t address)
+{
+  fprintf(stderr, "virtual device: application started at 0x%04X\n", address);
+  exit(VIRTUAL_EXIT_APPLICATION);
+}
+
+/** Runs the firmware for one host connection, from reset until the run ends. */
+static void VirtualDevice_Run(int connection)
+{
+  VirtualHardware_Reset();
+  VirtualUSB_Attach(connection);
+
+  Firmware_Main();
+  exit(VIRTUAL_EXIT_UNPLUGGED);
+}
+
+/** Reports how the run of the firmware ended, the start of the application having been reported by the device
+ *  process itself.
+ */
+static void VirtualDevice_ReportExit(int status)
+{
+  if(WIFSIGNALED(status)){
+    fprintf(stderr, "virtual device: firmware crashed with signal %d\n", WTERMSIG(status));
+    return;
+  }
+
+  switch(WEXITSTATUS(status)){
+    case VIRTUAL_EXIT_UNPLUGGED:
+      fprintf(stderr, "virtual device: unplugged\n");
+      break;
+    case VIRTUAL_EXIT_WATCHDOG:
+      fprintf(stderr, "virtual device: watchdog reset\n");
+      break;
+    case VIRTUAL_EXIT_APPLICATION:
+      break;
+    default:
+      fprintf(stderr, "virtual device: firmware exited with status %d\n", WEXITSTATUS(status));
+      break;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  const char* socketPath    = FLIP_SOCKET_DEFAULT_PATH;
+  const char* flashPath     = NULL;
+  const char* eepromPath    = NULL;
+  const char* dataflashPath = NULL;
+  unsigned    busyPolls     = 0;
+  uint8_t     uniqueID[VIRTUAL_DATAFLASH_UNIQUE_ID_SIZE];
+  uint8_t*    dataflash;
+  int         option;
+
+  /* A made up identifier unless one is given */
+  for(uint8_t i=0;i<sizeof(uniqueID);i++)
+    uniqueID[i] = 0x5A ^ (i * 0x1D);
+
+  while((option = getopt_long(argc, argv, "s:f:e:d:n:b:h", deviceOptions, NULL)) != -1){
+    switch(option){
+      case 's': socketPath    = optarg; break;
+      case 'f': flashPath     = optarg; break;
+      case 'e': eepromPath    = optarg; break;
+      case 'd': dataflashPath = optarg; break;
+      case 'b': busyPolls     = strtoul(optarg, NULL, 0); break;
+      case 'n':
+        memset(uniqueID, 0, sizeof(uniqueID));
+        memcpy(uniqueID, optarg, (strlen(optarg) < sizeof(uniqueID)) ? strlen(optarg) : sizeof(uniqueID));
+        break;
+      default:
+        VirtualDevice_Usage(argv[0]);
+        return (option == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  if(!(VirtualFlash_Memory  = VirtualDevice_MapMemory(flashPath, VIRTUAL_FLASH_SIZE)) ||
+     !(VirtualEEPROM_Memory = VirtualDevice_MapMemory(eepromPath, VIRTUAL_EEPROM_SIZE)) ||
+     !(dataflash            = VirtualDevice_MapMemory(dataflashPath, VIRTUAL_DATAFLASH_SIZE)))
+    return EXIT_FAILURE;
+
+  VirtualDataflash_Attach(dataflash, uniqueID, busyPolls);
+
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  int                listener;
+
+  if(strlen(socketPath) >= sizeof(address.sun_path)){
+    fprintf(stderr, "%s: socket path too long\n", socketPath);
+    return EXIT_FAILURE;
+  }
+  strcpy(address.sun_path, socketPath);
+  unlink(socketPath);
+
+  if((listener = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+     bind(listener, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+     listen(listener, 1) < 0){
+    perror(socketPath);
+    return EXIT_FAILURE;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  fprintf(stderr, "virtual device: listening on %s\n", socketPath);
+
+  while(1){
+    int   connection = accept(listener, NULL, NULL);
+    pid_t device;
+    int   status;
+
+    if(connection < 0){
+      if(errno == EINTR)
+        continue;
+      perror("accept");
+      return EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "virtual device: plugged in\n");
+
+    if((device = fork()) == 0){
+      close(listener);
+      VirtualDevice_Run(connection);
+    }
+
+    close(connection);
+    if(device < 0){
+      perror("fork");
+      continue;
+    }
+
+    while(waitpid(device, &status, 0) < 0 && errno == EINTR);
+    VirtualDevice_ReportExit(status);
+  }
+}
@@ -0,0 +1,64 @@
+
+/** \file
+ *
+ *  Forced into the host build of atmel-usbdfu.c ahead of its own headers. It stands in for the parts of the
+ *  bootloader which are written for the AVR itself: the hand written flash loops of FlashKernels.h, rewritten here
+ *  over pgm_read_byte(), and the jump to the application, which ends the virtual device's run instead.
+ */
+
+#ifndef _VIRTUAL_DEVICE_H_
+#define _VIRTUAL_DEVICE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <LUFA/Drivers/USB/USB.h>
+
+/** The tasks of Scheduler.h resume at case labels placed inside their bodies, which falls through on purpose */
+#pragma GCC diagnostic ignored "-Wimplicit-fallthrough"
+
+/** Keep FlashKernels.h out, its loops are AVR assembly */
+#define _FLASH_KERNELS_H_
+
+#define FLASH_CRC32_POLYNOMIAL 0xEDB88320UL
+#define FLASH_CRC32_STEP(crc)  crc = ((crc) >> 1) ^ (((crc) & 1) ? FLASH_CRC32_POLYNOMIAL : 0)
+
+static inline uint16_t Flash_SkipBlankGroups(uint16_t addr, uint16_t groups)
+{
+  for(;groups;groups--,addr+=4){
+    if((pgm_read_byte(addr) & pgm_read_byte(addr + 1) & pgm_read_byte(addr + 2) & pgm_read_byte(addr + 3)) != 0xFF)
+      break;
+  }
+
+  return addr;
+}
+
+static inline void Flash_WriteGroupsToEndpoint(uint16_t addr, uint8_t groups)
+{
+  for(uint16_t i=0;i<(uint16_t)groups * 4;i++)
+    Endpoint_Write_Byte(pgm_read_byte(addr + i));
+}
+
+static inline uint32_t Flash_Crc32(uint16_t addr, uint16_t length, uint32_t crc)
+{
+  while(length--){
+    crc ^= pgm_read_byte(addr++);
+    for(uint8_t i=0;i<8;i++)
+      FLASH_CRC32_STEP(crc);
+  }
+
+  return crc;
+}
+
+/** Ends the run of the firmware as the AVR would jump to the application at the given word address. */
+void VirtualDevice_StartApplication(uint16_t address) __attribute__((noreturn));
+
+/** The application pointer of the bootloader holds a flash address, calling it starts the application */
+#define AppStartPtr() VirtualDevice_StartApplication((uint16_t)(uintptr_t)AppStartPtr)
+
+/** The firmware's main() runs once per virtual reset, called by the device process' own main() */
+#define main Firmware_Main
+
+#endif /* _VIRTUAL_DEVICE_H_ */
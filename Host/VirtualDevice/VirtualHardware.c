@@ -0,0 +1,223 @@
+
+/** \file
+ *
+ *  Registers and memories of the virtual ATmega32U2.
+ *
+ *  The accessors of avr/io.h are the only view the virtual hardware has of the firmware's register accesses, and
+ *  each is called once per access without telling a read from a write. Each accessor therefore first acts on what
+ *  the previous accesses left behind: a chip select line which has changed is passed on to the Dataflash, and a
+ *  byte the firmware has put in SPDR is shifted out once it polls SPSR for the end of the transfer.
+ */
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <avr/io.h>
+#include <avr/boot.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <avr/wdt.h>
+
+#include "VirtualHardware.h"
+
+/** Dataflash chip select line, PB4, active low while driven as an output */
+#define VIRTUAL_DATAFLASH_CS_MASK (1 << 4)
+
+/** HWB button line, PD7, pulled high while the button is released */
+#define VIRTUAL_HWB_MASK (1 << 7)
+
+volatile uint8_t VirtualIO_Registers[64];
+volatile uint8_t VirtualSRAM_Top[2] __attribute__((aligned(2)));
+
+uint8_t* VirtualFlash_Memory;
+uint8_t* VirtualEEPROM_Memory;
+
+static uint8_t portB;
+static uint8_t ddrB;
+static bool    dataflashSelected;
+
+static uint8_t spiData;
+static uint8_t spiStatus;
+static bool    spiDataTouched;
+
+static uint8_t  timerFlags;
+static uint64_t timerLastTick;
+
+static uint8_t flashPageBuffer[SPM_PAGESIZE];
+
+static uint64_t watchdogDeadline;
+
+static uint64_t VirtualHardware_Microseconds(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/** Puts the registers in their state after an external reset, with the HWB button released. */
+void VirtualHardware_Reset(void)
+{
+  memset((void*)VirtualIO_Registers, 0, sizeof(VirtualIO_Registers));
+  MCUSR = _BV(EXTRF);
+  PIND  = VIRTUAL_HWB_MASK;
+
+  portB             = 0;
+  ddrB              = 0;
+  dataflashSelected = false;
+  spiData           = 0;
+  spiStatus         = 0;
+  spiDataTouched    = false;
+  timerFlags        = 0;
+  timerLastTick     = VirtualHardware_Microseconds();
+  watchdogDeadline  = 0;
+
+  memset(flashPageBuffer, 0xFF, sizeof(flashPageBuffer));
+}
+
+/** Passes a change of the Dataflash chip select line on to the Dataflash. */
+static void VirtualHardware_UpdateChipSelect(void)
+{
+  bool selected = (ddrB & VIRTUAL_DATAFLASH_CS_MASK) && !(portB & VIRTUAL_DATAFLASH_CS_MASK);
+
+  if(selected != dataflashSelected){
+    dataflashSelected = selected;
+    VirtualDataflash_Select(selected);
+  }
+}
+
+volatile uint8_t* VirtualIO_PortB(void)
+{
+  VirtualHardware_UpdateChipSelect();
+  return &portB;
+}
+
+volatile uint8_t* VirtualIO_DdrB(void)
+{
+  VirtualHardware_UpdateChipSelect();
+  return &ddrB;
+}
+
+volatile uint8_t* VirtualIO_SpiData(void)
+{
+  VirtualHardware_UpdateChipSelect();
+  spiDataTouched = true;
+  return &spiData;
+}
+
+/** Shifts the byte last put in SPDR out to the Dataflash as the firmware starts polling for SPIF, leaving the
+ *  byte clocked back in SPDR. Transfers complete at once, so SPIF is always set.
+ */
+volatile uint8_t* VirtualIO_SpiStatus(void)
+{
+  VirtualHardware_UpdateChipSelect();
+
+  if(spiDataTouched){
+    spiDataTouched = false;
+    spiData = dataflashSelected ? VirtualDataflash_TransferByte(spiData) : 0xFF;
+  }
+
+  spiStatus = _BV(SPIF);
+  return &spiStatus;
+}
+
+/** Raises the Timer 0 compare flag once a millisecond has passed since it was last seen raised. Clearing the flag
+ *  has no effect, a tick seen is consumed.
+ */
+volatile uint8_t* VirtualIO_TimerFlags(void)
+{
+  uint64_t now = VirtualHardware_Microseconds();
+
+  timerFlags = 0;
+  if(now - timerLastTick >= 1000){
+    timerLastTick = now;
+    timerFlags    = _BV(OCF0A);
+  }
+
+  return &timerFlags;
+}
+
+/** Transfers a byte for the LUFA SPI driver, which bypasses SPDR. */
+uint8_t VirtualSPI_TransferByte(uint8_t data)
+{
+  VirtualHardware_UpdateChipSelect();
+  return dataflashSelected ? VirtualDataflash_TransferByte(data) : 0xFF;
+}
+
+uint8_t VirtualFlash_ReadByte(uint16_t addr)
+{
+  return VirtualFlash_Memory[addr & FLASHEND];
+}
+
+uint16_t VirtualFlash_ReadWord(uint16_t addr)
+{
+  return VirtualFlash_ReadByte(addr) | ((uint16_t)VirtualFlash_ReadByte(addr + 1) << 8);
+}
+
+void VirtualFlash_PageErase(uint32_t addr)
+{
+  memset(&VirtualFlash_Memory[addr & FLASHEND & ~(SPM_PAGESIZE - 1)], 0xFF, SPM_PAGESIZE);
+}
+
+void VirtualFlash_PageFill(uint32_t addr, uint16_t data)
+{
+  flashPageBuffer[addr & (SPM_PAGESIZE - 2)]       = data & 0xFF;
+  flashPageBuffer[(addr & (SPM_PAGESIZE - 2)) + 1] = data >> 8;
+}
+
+/** Programs the temporary page buffer into a page, which like the real flash can only clear bits, and empties the
+ *  buffer again.
+ */
+void VirtualFlash_PageWrite(uint32_t addr)
+{
+  uint8_t* page = &VirtualFlash_Memory[addr & FLASHEND & ~(SPM_PAGESIZE - 1)];
+
+  for(uint16_t i=0;i<SPM_PAGESIZE;i++)
+    page[i] &= flashPageBuffer[i];
+
+  memset(flashPageBuffer, 0xFF, sizeof(flashPageBuffer));
+}
+
+uint8_t VirtualEEPROM_ReadByte(uint16_t addr)
+{
+  return VirtualEEPROM_Memory[addr & E2END];
+}
+
+void VirtualEEPROM_WriteByte(uint16_t addr, uint8_t value)
+{
+  VirtualEEPROM_Memory[addr & E2END] = value;
+}
+
+void VirtualEEPROM_ReadBlock(void* dest, uint16_t addr, size_t length)
+{
+  for(size_t i=0;i<length;i++)
+    ((uint8_t*)dest)[i] = VirtualEEPROM_ReadByte(addr + i);
+}
+
+/** Arms the watchdog, WDTO_15MS standing for 16ms and each step above it doubling the period. */
+void VirtualWatchdog_Enable(uint8_t timeout)
+{
+  watchdogDeadline = VirtualHardware_Microseconds() + ((uint64_t)16000 << timeout);
+}
+
+void VirtualWatchdog_Disable(void)
+{
+  watchdogDeadline = 0;
+}
+
+/** Tells how long the device has left before the watchdog resets it.
+ *
+ *  \return Milliseconds left, 0 once expired, or -1 while the watchdog is disabled
+ */
+int VirtualWatchdog_MillisecondsLeft(void)
+{
+  uint64_t now = VirtualHardware_Microseconds();
+
+  if(!watchdogDeadline)
+    return -1;
+  if(now >= watchdogDeadline)
+    return 0;
+
+  return (int)((watchdogDeadline - now + 999) / 1000);
+}
@@ -0,0 +1,44 @@
+
+/** \file
+ *
+ *  Virtual hardware of the virtual FLIP device, shared by its modules. The memories live in shared mappings set up
+ *  by VirtualDevice.c, so that they outlast the device process forked for each virtual reset.
+ */
+
+#ifndef _VIRTUAL_HARDWARE_H_
+#define _VIRTUAL_HARDWARE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** Sizes of the memories of the ATmega32U2 and of the AT45DB321E fitted next to it */
+#define VIRTUAL_FLASH_SIZE          0x8000UL
+#define VIRTUAL_EEPROM_SIZE         0x400UL
+#define VIRTUAL_DATAFLASH_PAGE_SIZE 512UL
+#define VIRTUAL_DATAFLASH_PAGES     8192UL
+#define VIRTUAL_DATAFLASH_SIZE      (VIRTUAL_DATAFLASH_PAGE_SIZE * VIRTUAL_DATAFLASH_PAGES)
+
+/** Bytes of the factory programmed unique identifier in the Dataflash security register */
+#define VIRTUAL_DATAFLASH_UNIQUE_ID_SIZE 64
+
+/** Exit status of the device process, telling the listening process how the run of the firmware ended */
+enum VirtualDevice_Exit_t
+{
+  VIRTUAL_EXIT_UNPLUGGED   = 10, // The host closed its connection
+  VIRTUAL_EXIT_WATCHDOG    = 11, // The watchdog reset the device
+  VIRTUAL_EXIT_APPLICATION = 12  // The bootloader started the application
+};
+
+extern uint8_t* VirtualFlash_Memory;
+extern uint8_t* VirtualEEPROM_Memory;
+
+void VirtualHardware_Reset(void);
+int  VirtualWatchdog_MillisecondsLeft(void);
+
+void VirtualDataflash_Attach(uint8_t* memory, const uint8_t* uniqueID, unsigned busyPolls);
+void VirtualDataflash_Select(bool selected);
+uint8_t VirtualDataflash_TransferByte(uint8_t data);
+
+void VirtualUSB_Attach(int socket);
+
+#endif /* _VIRTUAL_HARDWARE_H_ */
@@ -0,0 +1,339 @@
+
+/** \file
+ *
+ *  Control endpoint of the virtual device, serving the control transfers of the socket protocol of flip_socket.h
+ *  through the LUFA endpoint calls the bootloader makes.
+ *
+ *  The setup packet of each request frame is handed to EVENT_USB_Device_UnhandledControlRequest(), and a request
+ *  the firmware leaves unacknowledged is stalled as the LUFA stack would. GET_DESCRIPTOR is answered from
+ *  CALLBACK_USB_GetDescriptor() of Descriptors.c, as the LUFA stack answers it itself. The data stage is then cut into packets of
+ *  FIXED_CONTROL_ENDPOINT_SIZE bytes: the OUT data of the frame is released a packet at a time as the firmware
+ *  clears the endpoint, and the IN packets it writes are collected up to wLength. The data stage ends on a short
+ *  packet or once wLength bytes have moved, and the reply frame is sent when the firmware completes the status
+ *  stage. A transfer the firmware does not complete within VIRTUAL_USB_TRANSFER_TIMEOUT_MS is answered as timed
+ *  out, as the host controller would give up on it.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <LUFA/Drivers/USB/USB.h>
+
+#include "VirtualHardware.h"
+#include "../flip_socket.h"
+#include "Descriptors.h"
+
+/** Time the host is given to have a control transfer completed */
+#define VIRTUAL_USB_TRANSFER_TIMEOUT_MS 2000
+
+/** Type bits of bmRequestType, the bootloader only serves class requests */
+#define VIRTUAL_USB_REQTYPE_MASK  0x60
+#define VIRTUAL_USB_REQTYPE_CLASS 0x20
+
+/** bmRequestType of GET_DESCRIPTOR */
+#define VIRTUAL_USB_GET_DESCRIPTOR (REQDIR_DEVICETOHOST | REQTYPE_STANDARD | REQREC_DEVICE)
+
+/** Tasks the firmware has running, see atmel-usbdfu.c. The endpoint only blocks on the socket while there are
+ *  none, as the firmware then has nothing to do until the next request.
+ */
+extern uint8_t runningTasks;
+
+USB_Request_Header_t USB_ControlRequest;
+
+static int usbSocket;
+
+/** Transfer in progress */
+static bool     usbActive;
+static bool     usbSetupCleared;
+static bool     usbDataDone;     // The data stage has ended
+static bool     usbInBankFull;   // An IN packet written after the data stage, which the host never takes
+static uint64_t usbDeadline;
+
+/** Data stage of the transfer, as received for OUT requests or as collected for IN requests */
+static uint8_t  usbData[UINT16_MAX];
+static uint16_t usbDataLength;   // Bytes received or collected
+static uint16_t usbPacketStart;  // Start of the OUT packet in the endpoint
+static uint16_t usbPacketEnd;    // End of the OUT packet in the endpoint
+static uint16_t usbReadPosition; // Next byte of the OUT packet to be read
+
+static uint8_t  usbPacket[FIXED_CONTROL_ENDPOINT_SIZE];
+static uint8_t  usbPacketLength; // Bytes written to the IN packet
+
+static uint64_t VirtualUSB_Milliseconds(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000L;
+}
+
+/** Hands the endpoint the connected socket of the host. */
+void VirtualUSB_Attach(int socket)
+{
+  usbSocket = socket;
+}
+
+static bool VirtualUSB_IsDeviceToHost(void)
+{
+  return (USB_ControlRequest.bmRequestType & REQDIR_DEVICETOHOST) != 0;
+}
+
+/** Reads exactly the given number of bytes from the host, ending the run of the device once it has gone. */
+static void VirtualUSB_Receive(void* buffer, size_t length)
+{
+  while(length){
+    ssize_t got = read(usbSocket, buffer, length);
+
+    if(got < 0 && errno == EINTR)
+      continue;
+    if(got <= 0)
+      exit(VIRTUAL_EXIT_UNPLUGGED);
+
+    buffer  = (uint8_t*)buffer + got;
+    length -= got;
+  }
+}
+
+/** Sends the reply frame of the transfer and makes the endpoint idle again. */
+static void VirtualUSB_Reply(uint8_t result)
+{
+  uint8_t  header[FLIP_SOCKET_REPLY_SIZE];
+  uint16_t actual = 0;
+  size_t   sent   = 0;
+
+  if(result == FLIP_SOCKET_OK)
+    actual = VirtualUSB_IsDeviceToHost() ? usbDataLength : USB_ControlRequest.wLength;
+
+  header[0] = result;
+  header[1] = 0;
+  header[2] = actual & 0xFF;
+  header[3] = actual >> 8;
+
+  while(sent < sizeof(header)){
+    ssize_t written = send(usbSocket, header + sent, sizeof(header) - sent, MSG_NOSIGNAL);
+
+    if(written < 0 && errno == EINTR)
+      continue;
+    if(written <= 0)
+      exit(VIRTUAL_EXIT_UNPLUGGED);
+    sent += written;
+  }
+
+  for(sent=0;VirtualUSB_IsDeviceToHost() && sent < actual;){
+    ssize_t written = send(usbSocket, usbData + sent, actual - sent, MSG_NOSIGNAL);
+
+    if(written < 0 && errno == EINTR)
+      continue;
+    if(written <= 0)
+      exit(VIRTUAL_EXIT_UNPLUGGED);
+    sent += written;
+  }
+
+  usbActive = false;
+}
+
+/** Releases the next OUT packet of the data stage, or ends the data stage once every packet has been taken. */
+static void VirtualUSB_NextPacket(void)
+{
+  usbPacketStart  = usbPacketEnd;
+  usbReadPosition = usbPacketStart;
+
+  if(usbPacketStart >= usbDataLength){
+    usbDataDone = true;
+    return;
+  }
+
+  usbPacketEnd = usbPacketStart + FIXED_CONTROL_ENDPOINT_SIZE;
+  if(usbPacketEnd > usbDataLength || usbPacketEnd < usbPacketStart)
+    usbPacketEnd = usbDataLength;
+}
+
+/** Answers GET_DESCRIPTOR with the descriptor the firmware hands out, cut to wLength, or stalls it when there is
+ *  no such descriptor.
+ */
+static void VirtualUSB_GetDescriptor(void)
+{
+  const void* address = NULL;
+  uint16_t    size    = CALLBACK_USB_GetDescriptor(USB_ControlRequest.wValue, USB_ControlRequest.wIndex, &address);
+
+  if(size == NO_DESCRIPTOR || !address){
+    VirtualUSB_Reply(FLIP_SOCKET_STALL);
+    return;
+  }
+
+  usbDataLength = MIN(size, USB_ControlRequest.wLength);
+  memcpy(usbData, address, usbDataLength);
+  VirtualUSB_Reply(FLIP_SOCKET_OK);
+}
+
+/** Takes the next request frame from the host and offers its setup packet to the firmware. */
+static void VirtualUSB_ReceiveRequest(void)
+{
+  uint8_t setup[FLIP_SOCKET_SETUP_SIZE];
+
+  VirtualUSB_Receive(setup, sizeof(setup));
+
+  USB_ControlRequest.bmRequestType = setup[0];
+  USB_ControlRequest.bRequest      = setup[1];
+  USB_ControlRequest.wValue        = setup[2] | ((uint16_t)setup[3] << 8);
+  USB_ControlRequest.wIndex        = setup[4] | ((uint16_t)setup[5] << 8);
+  USB_ControlRequest.wLength       = setup[6] | ((uint16_t)setup[7] << 8);
+
+  usbActive       = true;
+  usbSetupCleared = false;
+  usbDataDone     = false;
+  usbInBankFull   = false;
+  usbDataLength   = 0;
+  usbPacketStart  = 0;
+  usbPacketEnd    = 0;
+  usbReadPosition = 0;
+  usbPacketLength = 0;
+  usbDeadline     = VirtualUSB_Milliseconds() + VIRTUAL_USB_TRANSFER_TIMEOUT_MS;
+
+  if(!VirtualUSB_IsDeviceToHost()){
+    usbDataLength = USB_ControlRequest.wLength;
+    VirtualUSB_Receive(usbData, usbDataLength);
+    VirtualUSB_NextPacket();
+  }
+  else if(!USB_ControlRequest.wLength){
+    usbDataDone = true;
+  }
+
+  if(USB_ControlRequest.bmRequestType == VIRTUAL_USB_GET_DESCRIPTOR &&
+     USB_ControlRequest.bRequest == REQ_GetDescriptor){
+    VirtualUSB_GetDescriptor();
+    return;
+  }
+
+  if((USB_ControlRequest.bmRequestType & VIRTUAL_USB_REQTYPE_MASK) == VIRTUAL_USB_REQTYPE_CLASS)
+    EVENT_USB_Device_UnhandledControlRequest();
+
+  if(!usbSetupCleared)
+    VirtualUSB_Reply(FLIP_SOCKET_STALL);
+}
+
+void USB_Init(void)
+{
+  usbActive = false;
+}
+
+void USB_ShutDown(void)
+{
+}
+
+/** Runs the virtual device from the main loop of the firmware: resets it once the watchdog expires, gives up on
+ *  an overdue transfer and takes the next request once the endpoint is idle.
+ */
+void USB_USBTask(void)
+{
+  int watchdog = VirtualWatchdog_MillisecondsLeft();
+
+  if(watchdog == 0)
+    exit(VIRTUAL_EXIT_WATCHDOG);
+
+  if(usbActive){
+    if(VirtualUSB_Milliseconds() >= usbDeadline)
+      VirtualUSB_Reply(FLIP_SOCKET_TIMEOUT);
+    return;
+  }
+
+  struct pollfd fds = {usbSocket, POLLIN, 0};
+
+  /* Sleep until the next request while the firmware is idle, waking for the watchdog */
+  if(poll(&fds, 1, runningTasks ? 0 : watchdog) > 0)
+    VirtualUSB_ReceiveRequest();
+}
+
+void Endpoint_ClearSETUP(void)
+{
+  usbSetupCleared = true;
+}
+
+bool Endpoint_IsOUTReceived(void)
+{
+  if(!usbActive || !usbSetupCleared)
+    return false;
+
+  /* The status stage of an IN request is a zero length OUT packet */
+  if(VirtualUSB_IsDeviceToHost())
+    return usbDataDone;
+
+  return !usbDataDone;
+}
+
+bool Endpoint_IsINReady(void)
+{
+  if(!usbActive || !usbSetupCleared)
+    return false;
+
+  /* The status stage of an OUT request is a zero length IN packet */
+  if(!VirtualUSB_IsDeviceToHost())
+    return usbDataDone;
+
+  return !usbInBankFull;
+}
+
+uint16_t Endpoint_BytesInEndpoint(void)
+{
+  if(VirtualUSB_IsDeviceToHost())
+    return usbPacketLength;
+
+  return usbPacketEnd - usbReadPosition;
+}
+
+uint8_t Endpoint_Read_Byte(void)
+{
+  if(!usbActive || VirtualUSB_IsDeviceToHost() || usbReadPosition >= usbPacketEnd)
+    return 0;
+
+  return usbData[usbReadPosition++];
+}
+
+void Endpoint_Write_Byte(uint8_t data)
+{
+  if(usbPacketLength < FIXED_CONTROL_ENDPOINT_SIZE)
+    usbPacket[usbPacketLength++] = data;
+}
+
+void Endpoint_ClearOUT(void)
+{
+  if(!Endpoint_IsOUTReceived())
+    return;
+
+  if(VirtualUSB_IsDeviceToHost())
+    VirtualUSB_Reply(FLIP_SOCKET_OK);
+  else
+    VirtualUSB_NextPacket();
+}
+
+void Endpoint_ClearIN(void)
+{
+  if(!Endpoint_IsINReady()){
+    usbPacketLength = 0;
+    return;
+  }
+
+  if(!VirtualUSB_IsDeviceToHost()){
+    VirtualUSB_Reply(FLIP_SOCKET_OK);
+  }
+  else if(usbDataDone){
+    usbInBankFull = true;
+  }
+  else{
+    uint16_t room = USB_ControlRequest.wLength - usbDataLength;
+    uint16_t take = (usbPacketLength < room) ? usbPacketLength : room;
+
+    for(uint16_t i=0;i<take;i++)
+      usbData[usbDataLength++] = usbPacket[i];
+
+    if(usbPacketLength < FIXED_CONTROL_ENDPOINT_SIZE || usbDataLength == USB_ControlRequest.wLength)
+      usbDataDone = true;
+  }
+
+  usbPacketLength = 0;
+}
@@ -0,0 +1,34 @@
+/** \file
+ *
+ *  Common definitions of LUFA needed by the host build of the bootloader.
+ */
+
+#ifndef _VIRTUAL_LUFA_COMMON_H_
+#define _VIRTUAL_LUFA_COMMON_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/boot.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+
+#define ATTR_NO_RETURN             __attribute__((noreturn))
+#define ATTR_ALWAYS_INLINE         __attribute__((always_inline))
+#define ATTR_WARN_UNUSED_RESULT    __attribute__((warn_unused_result))
+#define ATTR_NON_NULL_PTR_ARG(...) __attribute__((nonnull(__VA_ARGS__)))
+#define ATTR_NO_INIT
+#define ATTR_INIT_SECTION(x)
+#define ATTR_PACKED                __attribute__((packed))
+
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+
+static inline uint16_t SwapEndian_16(const uint16_t Word)
+{
+  return (Word >> 8) | (Word << 8);
+}
+
+#endif
@@ -0,0 +1,31 @@
+/** \file
+ *
+ *  Board Dataflash driver of LUFA for the host build of the bootloader, the board's own driver over the SPI shim.
+ */
+
+#ifndef _VIRTUAL_LUFA_DATAFLASH_H_
+#define _VIRTUAL_LUFA_DATAFLASH_H_
+
+#include <LUFA/Common/Common.h>
+#include <LUFA/Drivers/Peripheral/SPI.h>
+
+#define __INCLUDE_FROM_DATAFLASH_H
+
+static inline uint8_t Dataflash_TransferByte(const uint8_t Byte)
+{
+  return SPI_TransferByte(Byte);
+}
+
+static inline void Dataflash_SendByte(const uint8_t Byte)
+{
+  SPI_SendByte(Byte);
+}
+
+static inline uint8_t Dataflash_ReceiveByte(void)
+{
+  return SPI_ReceiveByte();
+}
+
+#include <Board/Dataflash.h>
+
+#endif
@@ -0,0 +1,15 @@
+/** \file
+ *
+ *  Board button driver of LUFA for the host build of the bootloader, the board's own driver.
+ */
+
+#ifndef _VIRTUAL_LUFA_HWB_H_
+#define _VIRTUAL_LUFA_HWB_H_
+
+#include <LUFA/Common/Common.h>
+
+#define __INCLUDE_FROM_HWB_H
+
+#include <Board/HWB.h>
+
+#endif
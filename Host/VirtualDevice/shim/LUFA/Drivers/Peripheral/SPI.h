@@ -0,0 +1,43 @@
+/** \file
+ *
+ *  SPI driver of LUFA for the host build of the bootloader, each byte goes to the virtual Dataflash.
+ */
+
+#ifndef _VIRTUAL_LUFA_SPI_H_
+#define _VIRTUAL_LUFA_SPI_H_
+
+#include <LUFA/Common/Common.h>
+
+#define SPI_SPEED_FCPU_DIV_2 0
+#define SPI_ORDER_MSB_FIRST  0
+#define SPI_SCK_LEAD_FALLING 0
+#define SPI_SAMPLE_TRAILING  0
+#define SPI_MODE_MASTER      0
+
+uint8_t VirtualSPI_TransferByte(uint8_t data);
+
+static inline void SPI_Init(const uint8_t options)
+{
+  (void)options;
+}
+
+static inline void SPI_ShutDown(void)
+{
+}
+
+static inline uint8_t SPI_TransferByte(const uint8_t data)
+{
+  return VirtualSPI_TransferByte(data);
+}
+
+static inline void SPI_SendByte(const uint8_t data)
+{
+  VirtualSPI_TransferByte(data);
+}
+
+static inline uint8_t SPI_ReceiveByte(void)
+{
+  return VirtualSPI_TransferByte(0x00);
+}
+
+#endif
@@ -0,0 +1,79 @@
+/** \file
+ *
+ *  The part of the LUFA device stack used by the bootloader, served by VirtualUSB.c over the virtual device's
+ *  socket instead of the USB controller. Only the control endpoint exists, and of the standard requests only
+ *  GET_DESCRIPTOR is served.
+ */
+
+#ifndef _VIRTUAL_LUFA_USB_H_
+#define _VIRTUAL_LUFA_USB_H_
+
+#include <LUFA/Common/Common.h>
+
+#define REQDIR_DEVICETOHOST (1 << 7)
+#define REQTYPE_STANDARD    (0 << 5)
+#define REQREC_DEVICE       (0 << 0)
+
+#define REQ_GetDescriptor   6
+
+/** Standard descriptor definitions used by Descriptors.c */
+#define NO_DESCRIPTOR              0
+#define DTYPE_Device               0x01
+#define DTYPE_Configuration        0x02
+#define DTYPE_String               0x03
+#define LANGUAGE_ID_ENG            0x0409
+#define USB_CONFIG_ATTR_BUSPOWERED 0x80
+#define USB_CONFIG_POWER_MA(mA)    ((mA) >> 1)
+#define USB_STRING_LEN(str)        (sizeof(USB_Descriptor_Header_t) + ((str) << 1))
+
+typedef struct
+{
+  uint8_t Size;
+  uint8_t Type;
+} USB_Descriptor_Header_t;
+
+typedef struct
+{
+  USB_Descriptor_Header_t Header;
+  uint16_t                UnicodeString[];
+} USB_Descriptor_String_t;
+
+typedef struct
+{
+  uint8_t  bmRequestType;
+  uint8_t  bRequest;
+  uint16_t wValue;
+  uint16_t wIndex;
+  uint16_t wLength;
+} USB_Request_Header_t;
+
+extern USB_Request_Header_t USB_ControlRequest;
+
+void EVENT_USB_Device_UnhandledControlRequest(void);
+
+void USB_Init(void);
+void USB_ShutDown(void);
+void USB_USBTask(void);
+
+bool     Endpoint_IsOUTReceived(void);
+bool     Endpoint_IsINReady(void);
+void     Endpoint_ClearSETUP(void);
+void     Endpoint_ClearOUT(void);
+void     Endpoint_ClearIN(void);
+uint16_t Endpoint_BytesInEndpoint(void);
+uint8_t  Endpoint_Read_Byte(void);
+void     Endpoint_Write_Byte(uint8_t data);
+
+static inline uint16_t Endpoint_Read_Word_LE(void)
+{
+  uint16_t data = Endpoint_Read_Byte();
+  return data | ((uint16_t)Endpoint_Read_Byte() << 8);
+}
+
+static inline void Endpoint_Write_Word_LE(uint16_t data)
+{
+  Endpoint_Write_Byte(data & 0xFF);
+  Endpoint_Write_Byte(data >> 8);
+}
+
+#endif
@@ -0,0 +1,22 @@
+/** \file
+ *
+ *  Self programming of the host build of the bootloader, against the virtual flash. Pages program at once.
+ */
+
+#ifndef _VIRTUAL_AVR_BOOT_H_
+#define _VIRTUAL_AVR_BOOT_H_
+
+#include <avr/io.h>
+
+void VirtualFlash_PageErase(uint32_t addr);
+void VirtualFlash_PageFill(uint32_t addr, uint16_t data);
+void VirtualFlash_PageWrite(uint32_t addr);
+
+#define boot_page_erase(addr)      VirtualFlash_PageErase(addr)
+#define boot_page_fill(addr, data) VirtualFlash_PageFill((addr), (data))
+#define boot_page_write(addr)      VirtualFlash_PageWrite(addr)
+#define boot_spm_busy()            false
+#define boot_spm_busy_wait()
+#define boot_rww_enable()
+
+#endif
@@ -0,0 +1,22 @@
+/** \file
+ *
+ *  EEPROM access of the host build of the bootloader, against the virtual EEPROM. Writes complete at once.
+ */
+
+#ifndef _VIRTUAL_AVR_EEPROM_H_
+#define _VIRTUAL_AVR_EEPROM_H_
+
+#include <avr/io.h>
+
+uint8_t VirtualEEPROM_ReadByte(uint16_t addr);
+void    VirtualEEPROM_WriteByte(uint16_t addr, uint8_t value);
+void    VirtualEEPROM_ReadBlock(void* dest, uint16_t addr, size_t length);
+
+#define eeprom_read_byte(addr)                 VirtualEEPROM_ReadByte((uint16_t)(uintptr_t)(addr))
+#define eeprom_write_byte(addr, value)         VirtualEEPROM_WriteByte((uint16_t)(uintptr_t)(addr), (value))
+#define eeprom_update_byte(addr, value)        VirtualEEPROM_WriteByte((uint16_t)(uintptr_t)(addr), (value))
+#define eeprom_read_block(dest, addr, length)  VirtualEEPROM_ReadBlock((dest), (uint16_t)(uintptr_t)(addr), (length))
+#define eeprom_is_ready()                      true
+#define eeprom_busy_wait()
+
+#endif
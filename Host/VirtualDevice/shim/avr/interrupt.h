@@ -0,0 +1,14 @@
+/** \file
+ *
+ *  Interrupts of the host build of the bootloader, which runs without any.
+ */
+
+#ifndef _VIRTUAL_AVR_INTERRUPT_H_
+#define _VIRTUAL_AVR_INTERRUPT_H_
+
+#include <avr/io.h>
+
+#define sei()
+#define cli()
+
+#endif
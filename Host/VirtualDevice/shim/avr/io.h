@@ -0,0 +1,81 @@
+/** \file
+ *
+ *  ATmega32U2 registers for the host build of the bootloader. Most registers are plain variables. The few the
+ *  firmware polls or strobes go through an accessor, so that the virtual hardware sees each access: the Dataflash
+ *  chip selects on PORTB/DDRB, the SPI data and status registers, and the Timer 0 compare flag.
+ */
+
+#ifndef _VIRTUAL_AVR_IO_H_
+#define _VIRTUAL_AVR_IO_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+extern volatile uint8_t VirtualIO_Registers[64];
+extern volatile uint8_t VirtualSRAM_Top[2];
+
+volatile uint8_t* VirtualIO_PortB(void);
+volatile uint8_t* VirtualIO_DdrB(void);
+volatile uint8_t* VirtualIO_SpiData(void);
+volatile uint8_t* VirtualIO_SpiStatus(void);
+volatile uint8_t* VirtualIO_TimerFlags(void);
+
+#define _SFR(x)  (VirtualIO_Registers[x])
+
+#define PORTB    (*VirtualIO_PortB())
+#define DDRB     (*VirtualIO_DdrB())
+#define SPDR     (*VirtualIO_SpiData())
+#define SPSR     (*VirtualIO_SpiStatus())
+#define TIFR0    (*VirtualIO_TimerFlags())
+
+#define MCUSR    _SFR(1)
+#define MCUCR    _SFR(2)
+#define PORTD    _SFR(5)
+#define DDRD     _SFR(6)
+#define PIND     _SFR(7)
+#define SPCR     _SFR(10)
+#define UDR1     _SFR(11)
+#define UCSR1A   _SFR(12)
+#define UCSR1B   _SFR(13)
+#define UCSR1C   _SFR(14)
+#define UBRR1    _SFR(16)
+#define TCCR0A   _SFR(20)
+#define TCCR0B   _SFR(21)
+#define OCR0A    _SFR(22)
+#define TIMSK0   _SFR(23)
+#define TCNT0    _SFR(25)
+#define SREG     _SFR(60)
+
+#define PORF     0
+#define EXTRF    1
+#define BORF     2
+#define WDRF     3
+#define IVCE     0
+#define IVSEL    1
+#define SPIF     7
+#define SPIE     7
+#define SPE      6
+#define MSTR     4
+#define RXC1     7
+#define TXC1     6
+#define UDRE1    5
+#define RXEN1    4
+#define TXEN1    3
+#define UMSEL11  7
+#define UMSEL10  6
+#define WGM01    1
+#define CS01     1
+#define CS00     0
+#define OCF0A    1
+
+#define SPM_PAGESIZE 128
+#define FLASHEND     0x7FFF
+#define E2END        0x3FF
+
+/** The top SRAM word, where an application leaves the magic boot key, is a host variable rather than address 0x4FE */
+#define RAMEND       ((uintptr_t)&VirtualSRAM_Top[1])
+
+#define _BV(bit) (1 << (bit))
+
+#endif
@@ -0,0 +1,22 @@
+/** \file
+ *
+ *  Program memory access of the host build of the bootloader. Numeric addresses read the virtual flash, while
+ *  PROGMEM tables are ordinary host data.
+ */
+
+#ifndef _VIRTUAL_AVR_PGMSPACE_H_
+#define _VIRTUAL_AVR_PGMSPACE_H_
+
+#include <string.h>
+#include <avr/io.h>
+
+#define PROGMEM
+
+uint8_t  VirtualFlash_ReadByte(uint16_t addr);
+uint16_t VirtualFlash_ReadWord(uint16_t addr);
+
+#define pgm_read_byte(addr)      VirtualFlash_ReadByte((uint16_t)(uintptr_t)(addr))
+#define pgm_read_word(addr)      VirtualFlash_ReadWord((uint16_t)(uintptr_t)(addr))
+#define memcpy_P(dest, src, len) memcpy((dest), (src), (len))
+
+#endif
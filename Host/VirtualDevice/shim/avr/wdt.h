@@ -0,0 +1,20 @@
+/** \file
+ *
+ *  Watchdog of the host build of the bootloader. An expired watchdog resets the virtual device.
+ */
+
+#ifndef _VIRTUAL_AVR_WDT_H_
+#define _VIRTUAL_AVR_WDT_H_
+
+#include <avr/io.h>
+
+#define WDTO_15MS  0
+#define WDTO_250MS 4
+
+void VirtualWatchdog_Enable(uint8_t timeout);
+void VirtualWatchdog_Disable(void);
+
+#define wdt_enable(timeout) VirtualWatchdog_Enable(timeout)
+#define wdt_disable()       VirtualWatchdog_Disable()
+
+#endif
@@ -0,0 +1,20 @@
+/** \file
+ *
+ *  CRC-16 of avr-libc, in the portable form its documentation gives.
+ */
+
+#ifndef _VIRTUAL_UTIL_CRC16_H_
+#define _VIRTUAL_UTIL_CRC16_H_
+
+#include <stdint.h>
+
+static inline uint16_t _crc16_update(uint16_t crc, uint8_t a)
+{
+  crc ^= a;
+  for(uint8_t i=0;i<8;i++)
+    crc = (crc & 1) ? ((crc >> 1) ^ 0xA001) : (crc >> 1);
+
+  return crc;
+}
+
+#endif
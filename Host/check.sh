@@ -0,0 +1,66 @@
+#!/bin/sh
+#
+#  Runs the host tools against virtual devices: flip-check for the library, see flip_check.c, and flip-station
+#  writing several boards at once, one of which has gone away. Called by 'make check' once the tools and the virtual
+#  device have been built, exits non-zero if any check fails.
+#
+
+DEVICE=VirtualDevice/virtual-device
+WORK=`mktemp -d`
+PIDS=
+
+cleanup()
+{
+  [ -n "$PIDS" ] && kill $PIDS 2>/dev/null
+  rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+# Starts a virtual device listening on $WORK/$1.sock, with a small Dataflash busy time
+start_device()
+{
+  $DEVICE -s "$WORK/$1.sock" -b 2 2>"$WORK/$1.log" &
+  PIDS="$PIDS $!"
+
+  for i in 1 2 3 4 5 6 7 8 9 10; do
+    [ -S "$WORK/$1.sock" ] && return 0
+    sleep 0.1
+  done
+  echo "FAIL virtual device $1 did not start"
+  exit 1
+}
+
+start_device library
+./flip-check "$WORK/library.sock" || exit 1
+
+# Reports a station check, from its exit status and the report's lines
+station_check()
+{
+  if [ $? -eq "$2" ] && grep -q "$3" "$WORK/station.out"; then
+    echo "PASS $1"
+  else
+    echo "FAIL $1"
+    cat "$WORK/station.out"
+    exit 1
+  fi
+}
+
+BOARDS=
+for board in board0 board1 board2; do
+  start_device $board
+  BOARDS="$BOARDS -s $WORK/$board.sock"
+done
+dd if=/dev/urandom of="$WORK/image.bin" bs=1000 count=9 2>/dev/null
+
+./flip-station -e -v $BOARDS "$WORK/image.bin" >"$WORK/station.out" 2>&1
+station_check "station writes every board" 0 "^station: 3 boards, 0 failed"
+
+# Kill the last board, leaving its socket behind without a device listening on it
+LAST=${PIDS##* }
+kill -9 $LAST
+wait $LAST 2>/dev/null
+
+./flip-station -e -v $BOARDS "$WORK/image.bin" >"$WORK/station.out" 2>&1
+station_check "station reports the failed board" 1 "^station: 3 boards, 1 failed"
+[ `grep -c "^$WORK/board[01].sock  *success " "$WORK/station.out"` -eq 2 ]
+station_check "station writes the other boards" 0 "^$WORK/board2.sock  *transport failure "
@@ -0,0 +1,930 @@
+
+/** \file
+ *
+ *  Host side client library for the FLIP dialect spoken by the rram-usbdfu bootloader, see flip.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "flip.h"
+
+/** bmRequestType of the DFU class requests, to the interface in either direction */
+#define FLIP_REQUEST_OUT 0x21
+#define FLIP_REQUEST_IN  0xA1
+
+/** Size of the reply of DFU_GETSTATUS */
+#define FLIP_STATUS_LENGTH 6
+
+/** Most bytes moved by a single DFU_DNLOAD or DFU_UPLOAD issued by flip_read() and flip_write() */
+#define FLIP_MAX_TRANSFER 0x1000
+
+/** Most downloads and verifies flip_plan_run() keeps queued on the transport */
+#define FLIP_MAX_DEPTH 16
+
+/** Rounds a data stage length up to whole control endpoint packets */
+#define FLIP_PACKETS(length) ((((length) + FLIP_PACKET_SIZE - 1) / FLIP_PACKET_SIZE) * FLIP_PACKET_SIZE)
+
+const char* flip_strerror(int result)
+{
+  switch(result){
+    case FLIP_OK:            return "success";
+    case FLIP_ERR_TRANSPORT: return "transport failure";
+    case FLIP_ERR_STALL:     return "request stalled by the device";
+    case FLIP_ERR_TIMEOUT:   return "transfer timed out";
+    case FLIP_ERR_DEVICE:    return "device reported an error";
+    case FLIP_ERR_NOT_BLANK: return "memory is not blank";
+    case FLIP_ERR_VERIFY:    return "verification failed";
+    case FLIP_ERR_ARGUMENT:  return "invalid argument";
+    case FLIP_ERR_MEMORY:    return "out of memory";
+    case FLIP_ERR_CANCELLED: return "transfer cancelled";
+  }
+
+  return "unknown error";
+}
+
+/** Starts a session on an opened transport. The session owns the transport from here on and closes it in
+ *  flip_close(). Erases, blank checks and selects are switched to run in the background, so that a long erase
+ *  does not hold up the control transfer past its timeout.
+ */
+int flip_open(flip_session_t* session, flip_transport_t* transport)
+{
+  memset(session, 0, sizeof(*session));
+  session->transport  = transport;
+  session->timeout_ms = FLIP_DEFAULT_TIMEOUT_MS;
+  session->page       = -1;
+
+  if(!transport || !transport->submit || !transport->wait)
+    return FLIP_ERR_ARGUMENT;
+
+  return flip_set_background(session, true);
+}
+
+void flip_close(flip_session_t* session)
+{
+  if(session->transport && session->transport->close)
+    session->transport->close(session->transport);
+
+  session->transport = NULL;
+}
+
+/** Fills in a transfer for the given DFU class request, whose direction follows from the request. */
+static void flip_setup(flip_transfer_t* transfer, uint8_t request, uint8_t* data, uint16_t length)
+{
+  memset(transfer, 0, sizeof(*transfer));
+
+  if(request == FLIP_DFU_UPLOAD || request == FLIP_DFU_GETSTATUS || request == FLIP_DFU_GETSTATE)
+    transfer->request_type = FLIP_REQUEST_IN;
+  else
+    transfer->request_type = FLIP_REQUEST_OUT;
+
+  transfer->request = request;
+  transfer->length  = length;
+  transfer->data    = data;
+}
+
+static int flip_submit(flip_session_t* session, flip_transfer_t* transfer)
+{
+  int result = session->transport->submit(session->transport, transfer);
+
+  if(result != FLIP_OK){
+    transfer->complete = true;
+    transfer->result   = result;
+  }
+
+  return result;
+}
+
+static int flip_finish(flip_session_t* session, flip_transfer_t* transfer)
+{
+  if(transfer->complete)
+    return transfer->result;
+
+  return session->transport->wait(session->transport, transfer, session->timeout_ms);
+}
+
+/** Cancels a queued transfer and waits for the transport to give it back. */
+static void flip_drop(flip_session_t* session, flip_transfer_t* transfer)
+{
+  if(transfer->complete)
+    return;
+
+  if(session->transport->cancel)
+    session->transport->cancel(session->transport, transfer);
+
+  flip_finish(session, transfer);
+}
+
+/** Issues one DFU class request and waits for it to complete. */
+int flip_control(flip_session_t* session, uint8_t request, uint8_t* data, uint16_t length, uint16_t* actual)
+{
+  flip_transfer_t transfer;
+
+  flip_setup(&transfer, request, data, length);
+
+  int result = flip_submit(session, &transfer);
+  if(result == FLIP_OK)
+    result = flip_finish(session, &transfer);
+
+  if(actual)
+    *actual = transfer.actual;
+
+  return result;
+}
+
+/** Decodes the reply of DFU_GETSTATUS into the session's last_status. */
+static int flip_parse_status(flip_session_t* session, const uint8_t* reply, uint16_t actual)
+{
+  if(actual < FLIP_STATUS_LENGTH)
+    return FLIP_ERR_TRANSPORT;
+
+  session->last_status.status          = reply[0];
+  session->last_status.poll_timeout_ms = reply[1] | ((uint32_t)reply[2] << 8) | ((uint32_t)reply[3] << 16);
+  session->last_status.state           = reply[4];
+
+  return FLIP_OK;
+}
+
+int flip_get_status(flip_session_t* session, flip_dfu_status_t* status)
+{
+  uint8_t  reply[FLIP_STATUS_LENGTH];
+  uint16_t actual;
+
+  int result = flip_control(session, FLIP_DFU_GETSTATUS, reply, sizeof(reply), &actual);
+  if(result == FLIP_OK)
+    result = flip_parse_status(session, reply, actual);
+
+  if(result == FLIP_OK && status)
+    *status = session->last_status;
+
+  return result;
+}
+
+int flip_get_state(flip_session_t* session, uint8_t* state)
+{
+  uint16_t actual;
+
+  int result = flip_control(session, FLIP_DFU_GETSTATE, state, 1, &actual);
+  if(result == FLIP_OK && actual != 1)
+    result = FLIP_ERR_TRANSPORT;
+
+  return result;
+}
+
+int flip_clear_status(flip_session_t* session)
+{
+  return flip_control(session, FLIP_DFU_CLRSTATUS, NULL, 0, NULL);
+}
+
+int flip_abort(flip_session_t* session)
+{
+  return flip_control(session, FLIP_DFU_ABORT, NULL, 0, NULL);
+}
+
+static void flip_sleep(uint32_t ms)
+{
+  struct timespec delay;
+
+  delay.tv_sec  = ms / 1000;
+  delay.tv_nsec = (long)(ms % 1000) * 1000000L;
+  nanosleep(&delay, NULL);
+}
+
+/** Polls DFU_GETSTATUS for as long as a command runs in the background, sleeping for the poll timeout the device
+ *  asks for in between. Returns FLIP_ERR_DEVICE if the command has left the device in dfuERROR.
+ */
+int flip_wait_idle(flip_session_t* session)
+{
+  for(;;){
+    int result = flip_get_status(session, NULL);
+    if(result != FLIP_OK)
+      return result;
+
+    if(session->last_status.state == FLIP_STATE_ERROR)
+      return FLIP_ERR_DEVICE;
+
+    if(session->last_status.state != FLIP_STATE_DNBUSY)
+      return FLIP_OK;
+
+    flip_sleep(session->last_status.poll_timeout_ms);
+  }
+}
+
+flip_command_t flip_range_command(uint8_t group, uint8_t code, uint16_t start, uint16_t end)
+{
+  flip_command_t command;
+
+  command.group   = group;
+  command.data[0] = code;
+  command.data[1] = start >> 8;
+  command.data[2] = start & 0xFF;
+  command.data[3] = end >> 8;
+  command.data[4] = end & 0xFF;
+
+  return command;
+}
+
+flip_command_t flip_short_command(uint8_t group, uint8_t d0, uint8_t d1, uint8_t d2)
+{
+  flip_command_t command;
+
+  memset(&command, 0, sizeof(command));
+  command.group   = group;
+  command.data[0] = d0;
+  command.data[1] = d1;
+  command.data[2] = d2;
+
+  return command;
+}
+
+/** Looks up the first command byte addressing the given memory. The download group gives the program command,
+ *  the upload group the read command and the exec group the erase command. Adding 1 to a read command gives the
+ *  matching blank check, adding 4 the page hash command of flash and Dataflash.
+ */
+int flip_memory_command(uint8_t memory, uint8_t group, uint8_t* code)
+{
+  static const uint8_t download[] = {0x00, 0x01, 0x10};
+  static const uint8_t upload[]   = {0x00, 0x02, 0x10};
+
+  if(memory > FLIP_MEMORY_DATAFLASH)
+    return FLIP_ERR_ARGUMENT;
+
+  switch(group){
+    case FLIP_GROUP_DOWNLOAD:
+    case FLIP_GROUP_EXEC:
+      *code = download[memory];
+      return FLIP_OK;
+    case FLIP_GROUP_UPLOAD:
+      *code = upload[memory];
+      return FLIP_OK;
+  }
+
+  return FLIP_ERR_ARGUMENT;
+}
+
+/** Copies a command into the head of a DFU_DNLOAD data stage. */
+static void flip_put_command(uint8_t* buffer, const flip_command_t* command)
+{
+  buffer[0] = command->group;
+  memcpy(&buffer[1], command->data, sizeof(command->data));
+}
+
+/** Sends a command with no data stage of its own, and waits for it to finish if it runs in the background. */
+static int flip_command(flip_session_t* session, const flip_command_t* command, bool background)
+{
+  uint8_t buffer[6];
+
+  flip_put_command(buffer, command);
+
+  int result = flip_control(session, FLIP_DFU_DNLOAD, buffer, sizeof(buffer), NULL);
+  if(result == FLIP_OK && background)
+    result = flip_wait_idle(session);
+
+  return result;
+}
+
+int flip_select_page(flip_session_t* session, uint8_t page)
+{
+  flip_command_t command = flip_short_command(FLIP_GROUP_SELECT, 0x03, 0x00, page);
+
+  int result = flip_command(session, &command, true);
+
+  session->page = (result == FLIP_OK) ? page : -1;
+  return result;
+}
+
+/** Turns the background commands of the device on or off. While they are off, as for stock FLIP hosts, a command
+ *  without a data stage has finished by the time its DFU_DNLOAD completes.
+ */
+int flip_set_background(flip_session_t* session, bool enable)
+{
+  flip_command_t command = flip_short_command(FLIP_GROUP_SELECT, 0x04, enable, 0);
+
+  return flip_command(session, &command, false);
+}
+
+/** Checks that a command range lies in one 64KB page and selects that page if it is not the current one. */
+static int flip_enter_page(flip_session_t* session, uint32_t addr, uint32_t length)
+{
+  if(!length || ((addr >> 16) != ((addr + length - 1) >> 16)))
+    return FLIP_ERR_ARGUMENT;
+
+  if(session->page == (int)(addr >> 16))
+    return FLIP_OK;
+
+  return flip_select_page(session, addr >> 16);
+}
+
+int flip_read_info(flip_session_t* session, uint16_t info, uint8_t* value)
+{
+  flip_command_t command = flip_short_command(FLIP_GROUP_READ, info >> 8, info & 0xFF, 0);
+  uint16_t       actual;
+
+  int result = flip_command(session, &command, false);
+  if(result == FLIP_OK)
+    result = flip_control(session, FLIP_DFU_UPLOAD, value, 1, &actual);
+  if(result == FLIP_OK && actual != 1)
+    result = FLIP_ERR_TRANSPORT;
+
+  return result;
+}
+
+int flip_erase(flip_session_t* session, uint8_t memory)
+{
+  uint8_t code;
+
+  int result = flip_memory_command(memory, FLIP_GROUP_EXEC, &code);
+  if(result != FLIP_OK)
+    return result;
+
+  flip_command_t command = flip_short_command(FLIP_GROUP_EXEC, code, 0xFF, 0);
+  return flip_command(session, &command, true);
+}
+
+/** Checks that length bytes from addr are erased. On FLIP_ERR_NOT_BLANK the first programmed address is stored
+ *  in non_blank and the device has been returned to dfuIDLE. The blank check end address is exclusive, so the
+ *  range may not reach the last byte of a 64KB page.
+ */
+int flip_blank_check(flip_session_t* session, uint8_t memory, uint32_t addr, uint32_t length, uint32_t* non_blank)
+{
+  uint8_t code;
+
+  int result = flip_memory_command(memory, FLIP_GROUP_UPLOAD, &code);
+  if(result != FLIP_OK)
+    return result;
+
+  if(((addr + length) & 0xFFFF) == 0)
+    return FLIP_ERR_ARGUMENT;
+
+  result = flip_enter_page(session, addr, length);
+  if(result != FLIP_OK)
+    return result;
+
+  flip_command_t command = flip_range_command(FLIP_GROUP_UPLOAD, code + 1, addr, addr + length);
+
+  result = flip_command(session, &command, true);
+  if(result != FLIP_ERR_DEVICE || session->last_status.status != FLIP_STATUS_ERR_CHECK_ERASED)
+    return result;
+
+  /* Read back where the check stopped */
+  uint8_t  reply[2];
+  uint16_t actual;
+
+  result = flip_control(session, FLIP_DFU_UPLOAD, reply, sizeof(reply), &actual);
+  if(result == FLIP_OK && actual != sizeof(reply))
+    result = FLIP_ERR_TRANSPORT;
+  if(result == FLIP_OK && non_blank)
+    *non_blank = (addr & 0xFFFF0000UL) | reply[0] | ((uint32_t)reply[1] << 8);
+  if(result == FLIP_OK)
+    result = flip_clear_status(session);
+
+  return (result == FLIP_OK) ? FLIP_ERR_NOT_BLANK : result;
+}
+
+/** Reads length bytes from addr in at most FLIP_MAX_TRANSFER bytes per DFU_UPLOAD. The device sends whole
+ *  packets, which also covers the last byte of a 64KB page that the exclusive end address cannot name.
+ */
+int flip_read(flip_session_t* session, uint8_t memory, uint32_t addr, uint8_t* buffer, uint32_t length)
+{
+  uint8_t  code;
+  uint8_t* packets;
+
+  int result = flip_memory_command(memory, FLIP_GROUP_UPLOAD, &code);
+  if(result != FLIP_OK)
+    return result;
+
+  if(!(packets = malloc(FLIP_MAX_TRANSFER)))
+    return FLIP_ERR_MEMORY;
+
+  while(length && result == FLIP_OK){
+    uint32_t run = FLIP_MAX_TRANSFER;
+    if(run > length)
+      run = length;
+    if(run > 0x10000UL - (addr & 0xFFFF))
+      run = 0x10000UL - (addr & 0xFFFF);
+
+    if((result = flip_enter_page(session, addr, run)) != FLIP_OK)
+      break;
+
+    /* An end at the page boundary is named as its last byte, the packet holding it is sent all the same */
+    uint16_t end = ((addr + run) & 0xFFFF) ? (uint16_t)(addr + run) : 0xFFFF;
+
+    flip_command_t command = flip_range_command(FLIP_GROUP_UPLOAD, code, addr, end);
+    uint16_t       actual;
+
+    result = flip_command(session, &command, false);
+    if(result == FLIP_OK)
+      result = flip_control(session, FLIP_DFU_UPLOAD, packets, FLIP_PACKETS(run), &actual);
+    if(result == FLIP_OK && actual < run)
+      result = FLIP_ERR_TRANSPORT;
+
+    if(result == FLIP_OK){
+      memcpy(buffer, packets, run);
+      buffer += run;
+      addr   += run;
+      length -= run;
+    }
+  }
+
+  free(packets);
+  return result;
+}
+
+/** Builds the data stage of a download: the command in the first packet, then the data padded out to whole
+ *  packets with 0xFF.
+ */
+static uint8_t* flip_build_download(uint8_t memory, uint32_t addr, const uint8_t* data, uint32_t length,
+                                    uint16_t* total)
+{
+  uint8_t code;
+
+  if(flip_memory_command(memory, FLIP_GROUP_DOWNLOAD, &code) != FLIP_OK)
+    return NULL;
+
+  *total = FLIP_PACKET_SIZE + FLIP_PACKETS(length);
+
+  uint8_t* buffer = malloc(*total);
+  if(!buffer)
+    return NULL;
+
+  memset(buffer, 0, FLIP_PACKET_SIZE);
+  memset(buffer + FLIP_PACKET_SIZE, 0xFF, *total - FLIP_PACKET_SIZE);
+
+  flip_command_t command = flip_range_command(FLIP_GROUP_DOWNLOAD, code, addr, addr + length - 1);
+  flip_put_command(buffer, &command);
+  memcpy(buffer + FLIP_PACKET_SIZE, data, length);
+
+  return buffer;
+}
+
+/** Writes length bytes to addr in a single DFU_DNLOAD. The device programs flash and Dataflash in whole pages, so
+ *  for those the range has to end on a page boundary.
+ */
+int flip_write(flip_session_t* session, uint8_t memory, uint32_t addr, const uint8_t* data, uint32_t length)
+{
+  uint16_t total;
+
+  if(memory > FLIP_MEMORY_DATAFLASH || length > 0xFFFF - 2 * FLIP_PACKET_SIZE)
+    return FLIP_ERR_ARGUMENT;
+  if(memory == FLIP_MEMORY_FLASH && ((addr + length) % FLIP_FLASH_PAGE_SIZE))
+    return FLIP_ERR_ARGUMENT;
+
+  int result = flip_enter_page(session, addr, length);
+  if(result != FLIP_OK)
+    return result;
+
+  uint8_t* buffer = flip_build_download(memory, addr, data, length, &total);
+  if(!buffer)
+    return FLIP_ERR_MEMORY;
+
+  result = flip_control(session, FLIP_DFU_DNLOAD, buffer, total, NULL);
+  free(buffer);
+
+  /* The status returns the device from dfuMANIFEST_SYNC to dfuIDLE */
+  if(result == FLIP_OK)
+    result = flip_get_status(session, NULL);
+  if(result == FLIP_OK && session->last_status.state == FLIP_STATE_ERROR)
+    result = FLIP_ERR_DEVICE;
+
+  return result;
+}
+
+/** Reads the CRC-16 of every page holding a byte of length bytes from addr, see flip_crc16(). */
+int flip_page_hashes(flip_session_t* session, uint8_t memory, uint32_t page_size, uint32_t addr, uint32_t length,
+                     uint16_t* hashes)
+{
+  uint8_t code;
+
+  if(memory == FLIP_MEMORY_EEPROM || !page_size || flip_memory_command(memory, FLIP_GROUP_UPLOAD, &code) != FLIP_OK)
+    return FLIP_ERR_ARGUMENT;
+
+  uint32_t count = (addr + length - 1) / page_size - addr / page_size + 1;
+  if(count * 2 > 0xFFFF)
+    return FLIP_ERR_ARGUMENT;
+
+  int result = flip_enter_page(session, addr, length);
+  if(result != FLIP_OK)
+    return result;
+
+  uint8_t* reply = malloc(count * 2);
+  if(!reply)
+    return FLIP_ERR_MEMORY;
+
+  flip_command_t command = flip_range_command(FLIP_GROUP_UPLOAD, code + 4, addr, addr + length - 1);
+  uint16_t       actual;
+
+  result = flip_command(session, &command, false);
+  if(result == FLIP_OK)
+    result = flip_control(session, FLIP_DFU_UPLOAD, reply, count * 2, &actual);
+  if(result == FLIP_OK && actual != count * 2)
+    result = FLIP_ERR_TRANSPORT;
+
+  for(uint32_t i=0;result == FLIP_OK && i<count;i++)
+    hashes[i] = reply[2 * i] | (reply[2 * i + 1] << 8);
+
+  free(reply);
+  return result;
+}
+
+/** Runs up to FLIP_SCRIPT_MAX_COMMANDS blank checks, erases and selects in one request. On a failure the index of
+ *  the failing command and the first programmed address of a failed blank check are stored in failed and
+ *  non_blank, and the device is left in dfuERROR for the caller to inspect. Bootloaders built with
+ *  NO_COMMAND_SCRIPTS, as the firmware makefile does by default, refuse scripts with FLIP_STATUS_ERR_UNKNOWN.
+ */
+int flip_script(flip_session_t* session, const flip_command_t* commands, uint8_t count, uint8_t* failed,
+                uint32_t* non_blank)
+{
+  uint8_t buffer[6 * (FLIP_SCRIPT_MAX_COMMANDS + 1)];
+
+  if(!count || count > FLIP_SCRIPT_MAX_COMMANDS)
+    return FLIP_ERR_ARGUMENT;
+
+  flip_command_t header = flip_short_command(FLIP_GROUP_SCRIPT, count, 0, 0);
+  flip_put_command(buffer, &header);
+  for(uint8_t i=0;i<count;i++)
+    flip_put_command(&buffer[6 * (i + 1)], &commands[i]);
+
+  /* Select commands in the script leave the current page unknown */
+  session->page = -1;
+
+  if(failed)
+    *failed = FLIP_SCRIPT_NO_FAILURE;
+
+  int result = flip_control(session, FLIP_DFU_DNLOAD, buffer, 6 * (count + 1), NULL);
+  if(result == FLIP_OK)
+    result = flip_wait_idle(session);
+  if(result != FLIP_ERR_DEVICE)
+    return result;
+
+  uint8_t  reply[3];
+  uint16_t actual;
+
+  int upload = flip_control(session, FLIP_DFU_UPLOAD, reply, sizeof(reply), &actual);
+  if(upload == FLIP_OK && actual != sizeof(reply))
+    upload = FLIP_ERR_TRANSPORT;
+  if(upload != FLIP_OK)
+    return upload;
+
+  if(failed)
+    *failed = reply[0];
+  if(non_blank)
+    *non_blank = reply[1] | ((uint32_t)reply[2] << 8);
+
+  return (session->last_status.status == FLIP_STATUS_ERR_CHECK_ERASED) ? FLIP_ERR_NOT_BLANK : FLIP_ERR_DEVICE;
+}
+
+/** Leaves the bootloader, either through a watchdog reset or by jumping to addr. The device drops off the bus, so
+ *  the final request may well fail.
+ */
+int flip_start_application(flip_session_t* session, bool reset, uint16_t addr)
+{
+  flip_command_t command = flip_range_command(FLIP_GROUP_EXEC, 0x03, reset ? 0x0000 : 0x0100, addr);
+
+  int result = flip_command(session, &command, true);
+  if(result != FLIP_OK)
+    return result;
+
+  flip_control(session, FLIP_DFU_DNLOAD, NULL, 0, NULL);
+  return FLIP_OK;
+}
+
+/** CRC-16 of a page as computed by the page hash commands, _crc16_update() from 0xFFFF. */
+uint16_t flip_crc16(const uint8_t* data, uint32_t length)
+{
+  uint16_t crc = 0xFFFF;
+
+  while(length--){
+    crc ^= *data++;
+    for(uint8_t i=0;i<8;i++)
+      crc = (crc & 1) ? ((crc >> 1) ^ 0xA001) : (crc >> 1);
+  }
+
+  return crc;
+}
+
+static int flip_plan_add(flip_plan_t* plan, flip_op_kind_t kind, uint8_t memory, uint32_t addr, uint32_t length,
+                         const uint8_t* data)
+{
+  if(plan->count == plan->capacity){
+    size_t     capacity = plan->capacity ? 2 * plan->capacity : 16;
+    flip_op_t* ops      = realloc(plan->ops, capacity * sizeof(flip_op_t));
+
+    if(!ops)
+      return FLIP_ERR_MEMORY;
+
+    plan->ops      = ops;
+    plan->capacity = capacity;
+  }
+
+  flip_op_t* op = &plan->ops[plan->count++];
+  op->kind   = kind;
+  op->memory = memory;
+  op->addr   = addr;
+  op->length = length;
+  op->data   = data;
+
+  return FLIP_OK;
+}
+
+static bool flip_is_blank(const uint8_t* data, uint32_t length)
+{
+  while(length--){
+    if(*data++ != 0xFF)
+      return false;
+  }
+
+  return true;
+}
+
+/** Adds one op of the given kind per chunk of the padded image, with a page select ahead of the first chunk and
+ *  of every chunk in a new 64KB page. Chunks never cross a 64KB boundary, and skipped pages split them.
+ */
+static int flip_plan_chunks(flip_plan_t* plan, flip_op_kind_t kind, uint8_t memory, uint32_t start, uint32_t end,
+                            uint32_t page_size, uint32_t chunk_size, bool skip_blank)
+{
+  int32_t  page   = -1;
+  uint32_t first  = start;
+  uint32_t addr   = start;
+  int      result = FLIP_OK;
+
+  while(first < end && result == FLIP_OK){
+    /* Leave out erased pages ahead of the chunk */
+    if(skip_blank && flip_is_blank(&plan->padded[first - start], page_size)){
+      first += page_size;
+      continue;
+    }
+
+    /* Grow the chunk up to its size, the next 64KB page, the end or a skipped page */
+    for(addr=first;addr<end && addr - first < chunk_size && (addr >> 16) == (first >> 16);addr+=page_size){
+      if(skip_blank && flip_is_blank(&plan->padded[addr - start], page_size))
+        break;
+    }
+
+    if((int32_t)(first >> 16) != page)
+      result = flip_plan_add(plan, FLIP_OP_SELECT_PAGE, memory, first, 0, NULL);
+    page = first >> 16;
+
+    if(result == FLIP_OK)
+      result = flip_plan_add(plan, kind, memory, first, addr - first, &plan->padded[first - start]);
+
+    first = addr;
+  }
+
+  return result;
+}
+
+/** Plans the writing of length bytes of image to addr. The image is padded with 0xFF out to whole pages of the
+ *  memory, the plan keeping its own copy, and split into downloads of at most chunk_size bytes. The Dataflash page
+ *  size differs between parts, so it has no default and must be given.
+ */
+int flip_plan_image(flip_plan_t* plan, const uint8_t* image, uint32_t addr, uint32_t length,
+                    const flip_plan_options_t* options)
+{
+  static const uint32_t page_sizes[] = {FLIP_FLASH_PAGE_SIZE, 1, 0};
+
+  memset(plan, 0, sizeof(*plan));
+
+  if(options->memory > FLIP_MEMORY_DATAFLASH || !length)
+    return FLIP_ERR_ARGUMENT;
+
+  uint32_t page_size  = options->page_size ? options->page_size : page_sizes[options->memory];
+  uint32_t chunk_size = options->chunk_size ? options->chunk_size : 2048;
+
+  if(!page_size)
+    return FLIP_ERR_ARGUMENT;
+
+  /* Every chunk is made of whole pages and fits a single download */
+  if(chunk_size > 0xFFFF - 2 * FLIP_PACKET_SIZE)
+    chunk_size = 0xFFFF - 2 * FLIP_PACKET_SIZE;
+  chunk_size -= chunk_size % page_size;
+  if(!chunk_size || (0x10000UL % page_size))
+    return FLIP_ERR_ARGUMENT;
+
+  uint32_t start = addr - (addr % page_size);
+  uint32_t end   = addr + length + page_size - 1;
+  end -= end % page_size;
+
+  plan->page_size = page_size;
+  if(!(plan->padded = malloc(end - start)))
+    return FLIP_ERR_MEMORY;
+
+  memset(plan->padded, 0xFF, end - start);
+  memcpy(plan->padded + (addr - start), image, length);
+
+  int result = FLIP_OK;
+
+  if(options->erase)
+    result = flip_plan_add(plan, FLIP_OP_ERASE, options->memory, 0, 0, NULL);
+
+  if(result == FLIP_OK)
+    result = flip_plan_chunks(plan, FLIP_OP_DOWNLOAD, options->memory, start, end, page_size, chunk_size,
+                              options->skip_blank);
+
+  /* Page hashes are checked per page, EEPROM is read back instead */
+  if(result == FLIP_OK && options->verify)
+    result = flip_plan_chunks(plan, FLIP_OP_VERIFY, options->memory, start, end, page_size, chunk_size,
+                              options->skip_blank);
+
+  if(result != FLIP_OK)
+    flip_plan_free(plan);
+
+  return result;
+}
+
+void flip_plan_free(flip_plan_t* plan)
+{
+  free(plan->ops);
+  free(plan->padded);
+  memset(plan, 0, sizeof(*plan));
+}
+
+/** Transfers of one download or verify queued by flip_plan_run() */
+typedef struct
+{
+  const flip_op_t* op;
+  flip_transfer_t  transfers[3];
+  uint8_t          count;
+  uint8_t*         out;                        // Data stage of the DFU_DNLOAD
+  uint8_t*         in;                         // Hashes or data read back by a verify
+  uint8_t          status[FLIP_STATUS_LENGTH]; // Reply of the closing DFU_GETSTATUS
+} flip_slot_t;
+
+/** Queues the transfers of a download or verify op. A download is its DFU_DNLOAD and a DFU_GETSTATUS to return the
+ *  device to dfuIDLE, a verify the command, the DFU_UPLOAD of the page hashes (EEPROM: of the data) and a
+ *  DFU_GETSTATUS to check on the device.
+ */
+static int flip_slot_submit(flip_session_t* session, const flip_plan_t* plan, flip_slot_t* slot,
+                            const flip_op_t* op)
+{
+  uint16_t total;
+  uint8_t  code = 0;
+
+  memset(slot, 0, sizeof(*slot));
+  slot->op = op;
+
+  if(op->kind == FLIP_OP_DOWNLOAD){
+    if(!(slot->out = flip_build_download(op->memory, op->addr, op->data, op->length, &total)))
+      return FLIP_ERR_MEMORY;
+
+    flip_setup(&slot->transfers[slot->count++], FLIP_DFU_DNLOAD, slot->out, total);
+  }
+  else{
+    uint16_t reply;
+
+    flip_memory_command(op->memory, FLIP_GROUP_UPLOAD, &code);
+
+    if(op->memory == FLIP_MEMORY_EEPROM){
+      reply = FLIP_PACKETS(op->length);
+      total = op->addr + op->length;
+    }
+    else{
+      code += 4;
+      reply = 2 * (op->length / plan->page_size);
+      total = op->addr + op->length - 1;
+    }
+
+    if(!(slot->out = malloc(6)) || !(slot->in = malloc(reply)))
+      return FLIP_ERR_MEMORY;
+
+    flip_command_t command = flip_range_command(FLIP_GROUP_UPLOAD, code, op->addr, total);
+    flip_put_command(slot->out, &command);
+
+    flip_setup(&slot->transfers[slot->count++], FLIP_DFU_DNLOAD, slot->out, 6);
+    flip_setup(&slot->transfers[slot->count++], FLIP_DFU_UPLOAD, slot->in, reply);
+  }
+
+  flip_setup(&slot->transfers[slot->count++], FLIP_DFU_GETSTATUS, slot->status, sizeof(slot->status));
+
+  for(uint8_t i=0;i<slot->count;i++){
+    int result = flip_submit(session, &slot->transfers[i]);
+    if(result != FLIP_OK)
+      return result;
+  }
+
+  return FLIP_OK;
+}
+
+/** Waits for the transfers of a queued op and checks its outcome. */
+static int flip_slot_finish(flip_session_t* session, const flip_plan_t* plan, flip_slot_t* slot)
+{
+  const flip_op_t* op = slot->op;
+  int              result = FLIP_OK;
+
+  for(uint8_t i=0;i<slot->count && result == FLIP_OK;i++)
+    result = flip_finish(session, &slot->transfers[i]);
+
+  if(result == FLIP_OK)
+    result = flip_parse_status(session, slot->status, slot->transfers[slot->count - 1].actual);
+  if(result == FLIP_OK && session->last_status.state == FLIP_STATE_ERROR)
+    result = FLIP_ERR_DEVICE;
+
+  if(result == FLIP_OK && op->kind == FLIP_OP_VERIFY){
+    const flip_transfer_t* upload = &slot->transfers[1];
+
+    if(upload->actual != upload->length)
+      result = FLIP_ERR_TRANSPORT;
+    else if(op->memory == FLIP_MEMORY_EEPROM)
+      result = memcmp(slot->in, op->data, op->length) ? FLIP_ERR_VERIFY : FLIP_OK;
+    else{
+      uint32_t page_size = plan->page_size;
+
+      for(uint32_t i=0;result == FLIP_OK && i<op->length / page_size;i++){
+        uint16_t hash = slot->in[2 * i] | (slot->in[2 * i + 1] << 8);
+        if(hash != flip_crc16(&op->data[i * page_size], page_size))
+          result = FLIP_ERR_VERIFY;
+      }
+    }
+  }
+
+  return result;
+}
+
+/** Cancels what is left of a queued op and releases its buffers. */
+static void flip_slot_release(flip_session_t* session, flip_slot_t* slot)
+{
+  for(uint8_t i=slot->count;i--;)
+    flip_drop(session, &slot->transfers[i]);
+
+  free(slot->out);
+  free(slot->in);
+  slot->out = slot->in = NULL;
+}
+
+/** Runs the ops of a plan. Downloads and verifies are queued up to depth ops ahead, so that the transport hands
+ *  the device the next request as soon as the last one completes. Page selects, erases and blank checks run in
+ *  the background on the device, and the whole queue is drained before each of them. On the first failure the
+ *  queued transfers are cancelled and the failure is returned, after a FLIP_ERR_DEVICE the device is left in
+ *  dfuERROR for the caller to inspect and clear.
+ */
+int flip_plan_run(flip_session_t* session, const flip_plan_t* plan, unsigned depth, flip_progress_t progress,
+                  void* context)
+{
+  flip_slot_t slots[FLIP_MAX_DEPTH];
+  size_t      head   = 0; // Next op to queue
+  size_t      tail   = 0; // Oldest op still queued
+  uint32_t    bytes  = 0;
+  int         result = FLIP_OK;
+
+  if(!depth)
+    depth = 1;
+  if(depth > FLIP_MAX_DEPTH)
+    depth = FLIP_MAX_DEPTH;
+
+  while(tail < plan->count && result == FLIP_OK){
+    const flip_op_t* op = &plan->ops[head < plan->count ? head : tail];
+    bool pipelined = (op->kind == FLIP_OP_DOWNLOAD || op->kind == FLIP_OP_VERIFY);
+
+    /* Queue the next op while there is room and no barrier ahead of it */
+    if(head < plan->count && pipelined && head - tail < depth){
+      result = flip_slot_submit(session, plan, &slots[head % depth], op);
+      head++;
+      continue;
+    }
+
+    /* Otherwise retire the oldest queued op */
+    if(tail < head){
+      result = flip_slot_finish(session, plan, &slots[tail % depth]);
+      flip_slot_release(session, &slots[tail % depth]);
+
+      if(result == FLIP_OK){
+        bytes += plan->ops[tail].length;
+        tail++;
+        if(progress)
+          progress(context, tail, plan->count, bytes);
+      }
+      continue;
+    }
+
+    /* The queue is empty, run the barrier */
+    switch(op->kind){
+      case FLIP_OP_SELECT_PAGE:
+        if(session->page != (int)(op->addr >> 16))
+          result = flip_select_page(session, op->addr >> 16);
+        break;
+      case FLIP_OP_ERASE:
+        result = flip_erase(session, op->memory);
+        break;
+      case FLIP_OP_BLANK_CHECK:
+        result = flip_blank_check(session, op->memory, op->addr, op->length, NULL);
+        break;
+      default:
+        result = FLIP_ERR_ARGUMENT;
+        break;
+    }
+
+    if(result == FLIP_OK){
+      head = ++tail;
+      if(progress)
+        progress(context, tail, plan->count, bytes);
+    }
+  }
+
+  /* Cancel whatever is still queued after a failure */
+  for(;tail < head;tail++){
+    if(result != FLIP_OK)
+      flip_slot_release(session, &slots[tail % depth]);
+  }
+
+  return result;
+}
@@ -0,0 +1,274 @@
+
+/** \file
+ *
+ *  Host side client library for the FLIP dialect spoken by the rram-usbdfu bootloader.
+ *
+ *  A session issues DFU class control requests through a flip_transport_t, either the libusb transport of
+ *  flip_usb.c or the socket transport of flip_socket.c, which reaches the bootloader firmware built for the host in
+ *  VirtualDevice/ and runs without a board attached. Besides one call per
+ *  bootloader command, the library plans the transfers for a whole image up front (flip_plan_image()) and runs the
+ *  plan with several downloads queued on the transport at once (flip_plan_run()), so that the device never waits
+ *  for the host between two of them.
+ *
+ *  Addresses are full byte addresses. The 64KB page select command is issued by the library whenever a command
+ *  addresses another 64KB page than the last one, and a single command may not cross a 64KB boundary.
+ */
+
+#ifndef _FLIP_H_
+#define _FLIP_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** USB identifiers of the bootloader */
+#define FLIP_VENDOR_ID   0x03EB
+#define FLIP_PRODUCT_ID  0x2FF0
+
+/** Size of the bootloader's control endpoint, FIXED_CONTROL_ENDPOINT_SIZE in the firmware. A download carries its
+ *  command in the first packet of the data stage and the data from the second packet on.
+ */
+#define FLIP_PACKET_SIZE 32
+
+/** Page size of the application flash, and the end of the application section */
+#define FLIP_FLASH_PAGE_SIZE 128
+#define FLIP_FLASH_SIZE      0x7000
+
+/** Default timeout of a control transfer */
+#define FLIP_DEFAULT_TIMEOUT_MS 5000
+
+/** DFU class requests */
+enum flip_dfu_request
+{
+  FLIP_DFU_DETACH    = 0,
+  FLIP_DFU_DNLOAD    = 1,
+  FLIP_DFU_UPLOAD    = 2,
+  FLIP_DFU_GETSTATUS = 3,
+  FLIP_DFU_CLRSTATUS = 4,
+  FLIP_DFU_GETSTATE  = 5,
+  FLIP_DFU_ABORT     = 6
+};
+
+/** DFU states, as reported by DFU_GETSTATUS and DFU_GETSTATE */
+enum flip_dfu_state
+{
+  FLIP_STATE_APP_IDLE               = 0,
+  FLIP_STATE_APP_DETACH             = 1,
+  FLIP_STATE_IDLE                   = 2,
+  FLIP_STATE_DNLOAD_SYNC            = 3,
+  FLIP_STATE_DNBUSY                 = 4,
+  FLIP_STATE_DNLOAD_IDLE            = 5,
+  FLIP_STATE_MANIFEST_SYNC          = 6,
+  FLIP_STATE_MANIFEST               = 7,
+  FLIP_STATE_MANIFEST_WAIT_RESET    = 8,
+  FLIP_STATE_UPLOAD_IDLE            = 9,
+  FLIP_STATE_ERROR                  = 10
+};
+
+/** DFU status codes, as reported by DFU_GETSTATUS */
+enum flip_dfu_status
+{
+  FLIP_STATUS_OK              = 0,
+  FLIP_STATUS_ERR_TARGET      = 1,
+  FLIP_STATUS_ERR_FILE        = 2,
+  FLIP_STATUS_ERR_WRITE       = 3,
+  FLIP_STATUS_ERR_ERASE       = 4,
+  FLIP_STATUS_ERR_CHECK_ERASED = 5,
+  FLIP_STATUS_ERR_PROG        = 6,
+  FLIP_STATUS_ERR_VERIFY      = 7,
+  FLIP_STATUS_ERR_ADDRESS     = 8,
+  FLIP_STATUS_ERR_NOTDONE     = 9,
+  FLIP_STATUS_ERR_FIRMWARE    = 10,
+  FLIP_STATUS_ERR_VENDOR      = 11,
+  FLIP_STATUS_ERR_USBR        = 12,
+  FLIP_STATUS_ERR_POR         = 13,
+  FLIP_STATUS_ERR_UNKNOWN     = 14,
+  FLIP_STATUS_ERR_STALLEDPKT  = 15
+};
+
+/** FLIP command groups, CMD_GROUP_* in the firmware */
+enum flip_group
+{
+  FLIP_GROUP_DOWNLOAD = 1,
+  FLIP_GROUP_UPLOAD   = 3,
+  FLIP_GROUP_EXEC     = 4,
+  FLIP_GROUP_READ     = 5,
+  FLIP_GROUP_SELECT   = 6,
+  FLIP_GROUP_SCRIPT   = 7
+};
+
+/** Most commands a command script may carry, SCRIPT_MAX_COMMANDS in the firmware */
+#define FLIP_SCRIPT_MAX_COMMANDS ((FLIP_PACKET_SIZE / 6) - 1)
+
+/** Failing command index reported when every command of a script has succeeded */
+#define FLIP_SCRIPT_NO_FAILURE   0xFF
+
+/** Memories of the board */
+enum flip_memory
+{
+  FLIP_MEMORY_FLASH     = 0,
+  FLIP_MEMORY_EEPROM    = 1,
+  FLIP_MEMORY_DATAFLASH = 2
+};
+
+/** Bootloader and device information bytes read by flip_read_info(), as (data[0] << 8) | data[1] of the command */
+enum flip_info
+{
+  FLIP_INFO_BOOTLOADER_VERSION = 0x0000,
+  FLIP_INFO_BOOTLOADER_ID1     = 0x0001,
+  FLIP_INFO_BOOTLOADER_ID2     = 0x0002,
+  FLIP_INFO_MANUFACTURER       = 0x0130,
+  FLIP_INFO_FAMILY             = 0x0131,
+  FLIP_INFO_PRODUCT_NAME       = 0x0160,
+  FLIP_INFO_PRODUCT_REVISION   = 0x0161
+};
+
+/** Results of the library calls. FLIP_ERR_DEVICE leaves the state and status reported by the device in the
+ *  session's last_status.
+ */
+enum flip_result
+{
+  FLIP_OK            =  0,
+  FLIP_ERR_TRANSPORT = -1, // The transport failed to move the transfer
+  FLIP_ERR_STALL     = -2, // The device stalled the request
+  FLIP_ERR_TIMEOUT   = -3, // The transfer did not complete in time
+  FLIP_ERR_DEVICE    = -4, // The device reported dfuERROR
+  FLIP_ERR_NOT_BLANK = -5, // A blank check found a programmed byte
+  FLIP_ERR_VERIFY    = -6, // A page hash read back differs from the image
+  FLIP_ERR_ARGUMENT  = -7, // Invalid memory, range or option
+  FLIP_ERR_MEMORY    = -8, // Out of host memory
+  FLIP_ERR_CANCELLED = -9  // The transfer was cancelled after an earlier one failed
+};
+
+/** FLIP command, as sent in the first bytes of a DFU_DNLOAD */
+typedef struct
+{
+  uint8_t group;
+  uint8_t data[5];
+} flip_command_t;
+
+/** A control transfer queued on a transport. The transport fills in result, actual and complete. */
+typedef struct flip_transfer
+{
+  uint8_t   request_type;
+  uint8_t   request;
+  uint16_t  value;
+  uint16_t  index;
+  uint16_t  length;
+  uint8_t*  data;         // Data stage buffer of length bytes, read from or written to depending on request_type
+  int       result;       // FLIP_OK or a FLIP_ERR_* value once complete
+  uint16_t  actual;       // Bytes moved in the data stage
+  bool      complete;
+  void*     transport_data;
+  struct flip_transfer* next;
+} flip_transfer_t;
+
+/** Channel to one bootloader. Transfers complete in the order they were submitted, several may be queued at once. */
+typedef struct flip_transport
+{
+  int  (*submit)(struct flip_transport* transport, flip_transfer_t* transfer);
+  int  (*wait)(struct flip_transport* transport, flip_transfer_t* transfer, unsigned timeout_ms);
+  void (*cancel)(struct flip_transport* transport, flip_transfer_t* transfer);
+  void (*close)(struct flip_transport* transport);
+  void* context;
+} flip_transport_t;
+
+/** Reply of DFU_GETSTATUS */
+typedef struct
+{
+  uint8_t  status;
+  uint32_t poll_timeout_ms;
+  uint8_t  state;
+} flip_dfu_status_t;
+
+/** Session with one bootloader */
+typedef struct
+{
+  flip_transport_t* transport;
+  unsigned          timeout_ms;  // Timeout of each control transfer
+  int               page;        // 64KB page last selected, -1 until the first select
+  flip_dfu_status_t last_status; // Reply of the last DFU_GETSTATUS
+} flip_session_t;
+
+/** Kinds of plan operations */
+typedef enum
+{
+  FLIP_OP_SELECT_PAGE, // Select the 64KB page of addr
+  FLIP_OP_ERASE,       // Erase the whole memory
+  FLIP_OP_DOWNLOAD,    // Download length bytes of data to addr
+  FLIP_OP_VERIFY,      // Compare the page hashes of length bytes at addr against data
+  FLIP_OP_BLANK_CHECK  // Check that length bytes at addr are erased
+} flip_op_kind_t;
+
+/** One operation of a plan, data points into the planned image or into padding owned by the plan */
+typedef struct
+{
+  flip_op_kind_t kind;
+  uint8_t        memory;
+  uint32_t       addr;
+  uint32_t       length;
+  const uint8_t* data;
+} flip_op_t;
+
+/** Operations writing one image, in the order they run */
+typedef struct
+{
+  flip_op_t* ops;
+  size_t     count;
+  size_t     capacity;
+  uint8_t*   padded;    // Copy of the image padded out to whole pages
+  uint32_t   page_size; // Page size the image was planned with, which verifies hash by
+} flip_plan_t;
+
+/** How flip_plan_image() lays out an image */
+typedef struct
+{
+  uint8_t  memory;
+  uint32_t page_size;   // Page size of the memory, 0 for the default (128 for flash, 1 for EEPROM). Required for
+                        // Dataflash, where it depends on the part: 512 for an AT45DB321E, 256 for an AT45DB641E
+  uint32_t chunk_size;  // Most bytes per DFU_DNLOAD, 0 for 2048, rounded down to whole pages
+  bool     erase;       // Erase the whole memory first
+  bool     skip_blank;  // Leave out the pages which are all 0xFF, only sensible together with erase
+  bool     verify;      // Compare page hashes once written (flash and Dataflash)
+} flip_plan_options_t;
+
+/** Progress callback of flip_plan_run(), called once per completed operation */
+typedef void (*flip_progress_t)(void* context, size_t done, size_t total, uint32_t bytes);
+
+const char* flip_strerror(int result);
+
+int flip_open(flip_session_t* session, flip_transport_t* transport);
+void flip_close(flip_session_t* session);
+
+int flip_control(flip_session_t* session, uint8_t request, uint8_t* data, uint16_t length, uint16_t* actual);
+int flip_get_status(flip_session_t* session, flip_dfu_status_t* status);
+int flip_get_state(flip_session_t* session, uint8_t* state);
+int flip_clear_status(flip_session_t* session);
+int flip_abort(flip_session_t* session);
+int flip_wait_idle(flip_session_t* session);
+
+int flip_select_page(flip_session_t* session, uint8_t page);
+int flip_set_background(flip_session_t* session, bool enable);
+int flip_read_info(flip_session_t* session, uint16_t info, uint8_t* value);
+int flip_erase(flip_session_t* session, uint8_t memory);
+int flip_blank_check(flip_session_t* session, uint8_t memory, uint32_t addr, uint32_t length, uint32_t* non_blank);
+int flip_read(flip_session_t* session, uint8_t memory, uint32_t addr, uint8_t* buffer, uint32_t length);
+int flip_write(flip_session_t* session, uint8_t memory, uint32_t addr, const uint8_t* data, uint32_t length);
+int flip_page_hashes(flip_session_t* session, uint8_t memory, uint32_t page_size, uint32_t addr, uint32_t length,
+                     uint16_t* hashes);
+int flip_script(flip_session_t* session, const flip_command_t* commands, uint8_t count, uint8_t* failed,
+                uint32_t* non_blank);
+int flip_start_application(flip_session_t* session, bool reset, uint16_t addr);
+
+uint16_t flip_crc16(const uint8_t* data, uint32_t length);
+flip_command_t flip_range_command(uint8_t group, uint8_t code, uint16_t start, uint16_t end);
+flip_command_t flip_short_command(uint8_t group, uint8_t d0, uint8_t d1, uint8_t d2);
+int flip_memory_command(uint8_t memory, uint8_t group, uint8_t* code);
+
+int flip_plan_image(flip_plan_t* plan, const uint8_t* image, uint32_t addr, uint32_t length,
+                    const flip_plan_options_t* options);
+void flip_plan_free(flip_plan_t* plan);
+int flip_plan_run(flip_session_t* session, const flip_plan_t* plan, unsigned depth, flip_progress_t progress,
+                  void* context);
+
+#endif /* _FLIP_H_ */
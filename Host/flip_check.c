@@ -0,0 +1,225 @@
+
+/** \file
+ *
+ *  Checks the client library end to end against the virtual device of VirtualDevice/, which runs the bootloader
+ *  firmware itself, see check.sh. Each check prints one line, and the program exits non-zero if any of them fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flip.h"
+#include "flip_socket.h"
+
+/** Dataflash page size of the AT45DB321E the virtual device emulates */
+#define FLIP_CHECK_DATAFLASH_PAGE_SIZE 512
+
+/** First byte of the Dataflash page bitmap the bootloader keeps at the top of the virtual device's Dataflash: 8192
+ *  pages, less 56 pages staging a copy of the 28KB application and the 2 pages of the bitmap itself
+ */
+#define FLIP_CHECK_DATAFLASH_RESERVED  ((8192UL - 56 - 2) * FLIP_CHECK_DATAFLASH_PAGE_SIZE)
+
+/** EEPROM bytes the host may use, and the top of the EEPROM, which holds the bootloader's records */
+#define FLIP_CHECK_EEPROM_USER         0x300
+#define FLIP_CHECK_EEPROM_TOP          0x3F0
+
+static flip_session_t session;
+static int            failures;
+
+/** Reports the outcome of one check */
+static void flip_check_report(const char* name, int result, int expected, const char* detail)
+{
+  if(result == expected && !detail){
+    printf("PASS %s\n", name);
+    return;
+  }
+
+  failures++;
+  if(detail)
+    printf("FAIL %s: %s\n", name, detail);
+  else
+    printf("FAIL %s: %s (status %u), expected %s\n", name, flip_strerror(result), session.last_status.status,
+           flip_strerror(expected));
+}
+
+/** Fills a buffer with a pattern which differs from one check to the next and is never all 0xFF */
+static void flip_check_pattern(uint8_t* buffer, uint32_t length, uint8_t seed)
+{
+  for(uint32_t i=0;i<length;i++)
+    buffer[i] = (uint8_t)((i * 7) ^ (i >> 8) ^ seed);
+}
+
+/** Reads a range back and compares it against what was written, returning a detail on a mismatch */
+static const char* flip_check_read_back(uint8_t memory, uint32_t addr, const uint8_t* data, uint32_t length,
+                                        int* result)
+{
+  static char detail[96];
+  uint8_t*    buffer = malloc(length);
+
+  if(!buffer)
+    return "out of memory";
+
+  *result = flip_read(&session, memory, addr, buffer, length);
+  if(*result != FLIP_OK){
+    free(buffer);
+    return NULL;
+  }
+
+  for(uint32_t i=0;i<length;i++){
+    if(buffer[i] != data[i]){
+      snprintf(detail, sizeof(detail), "0x%06lx read back 0x%02x instead of 0x%02x", (unsigned long)(addr + i),
+               buffer[i], data[i]);
+      free(buffer);
+      return detail;
+    }
+  }
+
+  free(buffer);
+  return NULL;
+}
+
+/** Plans an image and runs the plan with several transfers queued */
+static int flip_check_run_image(const uint8_t* image, uint32_t addr, uint32_t length,
+                                const flip_plan_options_t* options)
+{
+  flip_plan_t plan;
+
+  int result = flip_plan_image(&plan, image, addr, length, options);
+  if(result != FLIP_OK)
+    return result;
+
+  result = flip_plan_run(&session, &plan, 8, NULL, NULL);
+  flip_plan_free(&plan);
+
+  return result;
+}
+
+/** An erased flash passes the blank check, and one programmed byte is reported at its address */
+static void flip_check_blank(void)
+{
+  uint8_t  page[FLIP_FLASH_PAGE_SIZE];
+  uint32_t nonBlank = 0;
+
+  flip_check_report("flash erase", flip_erase(&session, FLIP_MEMORY_FLASH), FLIP_OK, NULL);
+  flip_check_report("flash blank check", flip_blank_check(&session, FLIP_MEMORY_FLASH, 0, FLIP_FLASH_SIZE, NULL),
+                    FLIP_OK, NULL);
+
+  memset(page, 0xFF, sizeof(page));
+  page[0x25] = 0x00;
+  flip_check_report("flash write", flip_write(&session, FLIP_MEMORY_FLASH, 0x1200, page, sizeof(page)), FLIP_OK,
+                    NULL);
+
+  int result = flip_blank_check(&session, FLIP_MEMORY_FLASH, 0, FLIP_FLASH_SIZE, &nonBlank);
+  flip_check_report("flash blank check finds a programmed byte", result, FLIP_ERR_NOT_BLANK,
+                    (result == FLIP_ERR_NOT_BLANK && nonBlank != 0x1225) ? "wrong non-blank address" : NULL);
+}
+
+/** A flash image written through a pipelined plan, erased first and verified by page hashes, reads back */
+static void flip_check_flash_image(void)
+{
+  flip_plan_options_t options = {.memory = FLIP_MEMORY_FLASH, .erase = true, .verify = true};
+  static uint8_t      image[20000];
+  int                 result;
+
+  flip_check_pattern(image, sizeof(image), 0x31);
+  flip_check_report("flash image", flip_check_run_image(image, 0, sizeof(image), &options), FLIP_OK, NULL);
+
+  const char* detail = flip_check_read_back(FLIP_MEMORY_FLASH, 0, image, sizeof(image), &result);
+  flip_check_report("flash image read back", result, FLIP_OK, detail);
+}
+
+/** Dataflash data written and verified across the first 64KB page boundary, and a single page written directly,
+ *  read back
+ */
+static void flip_check_dataflash(void)
+{
+  flip_plan_options_t options = {.memory = FLIP_MEMORY_DATAFLASH, .page_size = FLIP_CHECK_DATAFLASH_PAGE_SIZE,
+                                 .verify = true};
+  static uint8_t      image[4 * FLIP_CHECK_DATAFLASH_PAGE_SIZE];
+  uint8_t             page[FLIP_CHECK_DATAFLASH_PAGE_SIZE];
+  int                 result;
+
+  flip_check_pattern(image, sizeof(image), 0x52);
+  flip_check_report("dataflash across a 64KB page", flip_check_run_image(image, 0x10000 - sizeof(image) / 2,
+                    sizeof(image), &options), FLIP_OK, NULL);
+
+  const char* detail = flip_check_read_back(FLIP_MEMORY_DATAFLASH, 0x10000 - sizeof(image) / 2, image,
+                                            sizeof(image), &result);
+  flip_check_report("dataflash across a 64KB page read back", result, FLIP_OK, detail);
+
+  flip_check_pattern(page, sizeof(page), 0x6B);
+  flip_check_report("dataflash write", flip_write(&session, FLIP_MEMORY_DATAFLASH, 0x20400, page, sizeof(page)),
+                    FLIP_OK, NULL);
+
+  detail = flip_check_read_back(FLIP_MEMORY_DATAFLASH, 0x20400, page, sizeof(page), &result);
+  flip_check_report("dataflash read back", result, FLIP_OK, detail);
+}
+
+/** The EEPROM takes the host's data below the bootloader's records and refuses a write reaching them */
+static void flip_check_eeprom(void)
+{
+  uint8_t data[FLIP_CHECK_EEPROM_USER];
+  int     result;
+
+  flip_check_pattern(data, sizeof(data), 0x0E);
+  flip_check_report("eeprom write", flip_write(&session, FLIP_MEMORY_EEPROM, 0, data, sizeof(data)), FLIP_OK, NULL);
+
+  const char* detail = flip_check_read_back(FLIP_MEMORY_EEPROM, 0, data, sizeof(data), &result);
+  flip_check_report("eeprom read back", result, FLIP_OK, detail);
+
+  result = flip_write(&session, FLIP_MEMORY_EEPROM, FLIP_CHECK_EEPROM_TOP, data, 16);
+  flip_check_report("eeprom reserved area refused", result, FLIP_ERR_DEVICE,
+                    (result == FLIP_ERR_DEVICE && session.last_status.status != FLIP_STATUS_ERR_ADDRESS) ?
+                    "refused with the wrong status" : NULL);
+  flip_clear_status(&session);
+}
+
+/** A plan failing part way, with the downloads after the failing one already queued, stops at the failure, and
+ *  the session carries on once the error has been cleared
+ */
+static void flip_check_cancel(void)
+{
+  flip_plan_options_t options = {.memory = FLIP_MEMORY_DATAFLASH, .page_size = FLIP_CHECK_DATAFLASH_PAGE_SIZE,
+                                 .chunk_size = FLIP_CHECK_DATAFLASH_PAGE_SIZE};
+  static uint8_t      image[8 * FLIP_CHECK_DATAFLASH_PAGE_SIZE];
+  uint32_t            addr = FLIP_CHECK_DATAFLASH_RESERVED - 2 * FLIP_CHECK_DATAFLASH_PAGE_SIZE;
+  int                 result;
+
+  flip_check_pattern(image, sizeof(image), 0x77);
+  result = flip_check_run_image(image, addr, sizeof(image), &options);
+  flip_check_report("plan into the reserved dataflash stops", result, FLIP_ERR_DEVICE,
+                    (result == FLIP_ERR_DEVICE && session.last_status.status != FLIP_STATUS_ERR_ADDRESS) ?
+                    "stopped with the wrong status" : NULL);
+
+  flip_check_report("clear status after the failure", flip_clear_status(&session), FLIP_OK, NULL);
+
+  const char* detail = flip_check_read_back(FLIP_MEMORY_DATAFLASH, addr, image, 2 * FLIP_CHECK_DATAFLASH_PAGE_SIZE,
+                                            &result);
+  flip_check_report("pages before the failure read back", result, FLIP_OK, detail);
+}
+
+int main(int argc, char** argv)
+{
+  if(argc != 2){
+    fprintf(stderr, "Usage: %s SOCKET\n", argv[0]);
+    return 2;
+  }
+
+  int result = flip_open(&session, flip_socket_open(argv[1]));
+  if(result != FLIP_OK){
+    fprintf(stderr, "%s: %s\n", argv[1], flip_strerror(result));
+    return 1;
+  }
+
+  flip_check_blank();
+  flip_check_flash_image();
+  flip_check_dataflash();
+  flip_check_eeprom();
+  flip_check_cancel();
+
+  flip_close(&session);
+
+  printf("%d checks failed\n", failures);
+  return failures ? 1 : 0;
+}
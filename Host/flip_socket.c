@@ -0,0 +1,319 @@
+
+/** \file
+ *
+ *  Unix socket transport for the FLIP client library, see flip_socket.h. Request frames are written as soon as a
+ *  transfer is submitted, so that several requests are queued in the socket at once and reach the device back to
+ *  back, and reply frames are read in order as the host waits for them. A transfer which times out leaves the
+ *  stream out of step with the queue, so the transport is then broken and fails every later transfer.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "flip_socket.h"
+
+/** Reply frame expected from the device, one per submitted transfer. A cancelled transfer leaves its owner behind,
+ *  and the data stage of its reply is read and discarded.
+ */
+typedef struct flip_socket_pending
+{
+  flip_transfer_t*            owner;
+  bool                        in;
+  struct flip_socket_pending* next;
+} flip_socket_pending_t;
+
+/** State of a connection to the virtual device */
+typedef struct
+{
+  flip_transport_t       transport;
+  int                    fd;
+  bool                   broken;
+  flip_socket_pending_t* head;
+  flip_socket_pending_t* tail;
+  uint8_t                reply[FLIP_SOCKET_REPLY_SIZE]; // Header of the reply frame being read
+  size_t                 reply_read;                    // Bytes of the reply frame read so far, header included
+} flip_socket_t;
+
+static flip_socket_t* flip_socket_get(flip_transport_t* transport)
+{
+  return (flip_socket_t*)transport->context;
+}
+
+static uint64_t flip_socket_now_ms(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000L;
+}
+
+/** Completes the transfer at the head of the queue and drops its pending reply. */
+static void flip_socket_complete(flip_socket_t* sock, int result)
+{
+  flip_socket_pending_t* pending = sock->head;
+
+  if(pending->owner){
+    pending->owner->result         = result;
+    pending->owner->transport_data = NULL;
+    pending->owner->complete       = true;
+  }
+
+  if(!(sock->head = pending->next))
+    sock->tail = NULL;
+  sock->reply_read = 0;
+  free(pending);
+}
+
+/** Marks the transport broken and fails every transfer still waiting for its reply. */
+static void flip_socket_break(flip_socket_t* sock, int result)
+{
+  sock->broken = true;
+  while(sock->head)
+    flip_socket_complete(sock, result);
+}
+
+static int flip_socket_result(uint8_t result)
+{
+  switch(result){
+    case FLIP_SOCKET_OK:      return FLIP_OK;
+    case FLIP_SOCKET_STALL:   return FLIP_ERR_STALL;
+    case FLIP_SOCKET_TIMEOUT: return FLIP_ERR_TIMEOUT;
+    default:                  return FLIP_ERR_TRANSPORT;
+  }
+}
+
+/** Reads whatever part of the reply frames is already waiting in the socket, without blocking, completing the
+ *  transfers whose replies are whole.
+ */
+static void flip_socket_receive(flip_socket_t* sock)
+{
+  uint8_t scratch[256];
+
+  while(sock->head && !sock->broken){
+    flip_socket_pending_t* pending = sock->head;
+    flip_transfer_t*       owner   = pending->owner;
+    uint8_t*               buffer;
+    size_t                 wanted;
+    ssize_t                got;
+
+    if(sock->reply_read < FLIP_SOCKET_REPLY_SIZE){
+      buffer = sock->reply + sock->reply_read;
+      wanted = FLIP_SOCKET_REPLY_SIZE - sock->reply_read;
+    }
+    else{
+      size_t offset = sock->reply_read - FLIP_SOCKET_REPLY_SIZE;
+      size_t actual = sock->reply[2] | ((size_t)sock->reply[3] << 8);
+
+      if(offset == actual || !pending->in){
+        flip_socket_complete(sock, flip_socket_result(sock->reply[0]));
+        continue;
+      }
+
+      if(owner){
+        buffer = owner->data + offset;
+        wanted = actual - offset;
+      }
+      else{
+        buffer = scratch;
+        wanted = (actual - offset < sizeof(scratch)) ? actual - offset : sizeof(scratch);
+      }
+    }
+
+    got = recv(sock->fd, buffer, wanted, MSG_DONTWAIT);
+    if(got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      return;
+    if(got <= 0){
+      flip_socket_break(sock, FLIP_ERR_TRANSPORT);
+      return;
+    }
+
+    sock->reply_read += got;
+
+    /* A reply claiming more data than the request asked for cannot be placed */
+    if(sock->reply_read == FLIP_SOCKET_REPLY_SIZE){
+      size_t actual = sock->reply[2] | ((size_t)sock->reply[3] << 8);
+
+      if(owner)
+        owner->actual = actual;
+      if(owner && actual > owner->length){
+        flip_socket_break(sock, FLIP_ERR_TRANSPORT);
+        return;
+      }
+    }
+  }
+}
+
+static int flip_socket_submit(flip_transport_t* transport, flip_transfer_t* transfer)
+{
+  flip_socket_t*         sock = flip_socket_get(transport);
+  flip_socket_pending_t* pending;
+  uint8_t*               frame;
+  size_t                 length = FLIP_SOCKET_SETUP_SIZE;
+  size_t                 sent   = 0;
+  bool                   in     = (transfer->request_type & 0x80) != 0;
+
+  if(sock->broken)
+    return FLIP_ERR_TRANSPORT;
+
+  if(!in)
+    length += transfer->length;
+
+  if(!(frame = malloc(length)))
+    return FLIP_ERR_MEMORY;
+  if(!(pending = malloc(sizeof(flip_socket_pending_t)))){
+    free(frame);
+    return FLIP_ERR_MEMORY;
+  }
+
+  frame[0] = transfer->request_type;
+  frame[1] = transfer->request;
+  frame[2] = transfer->value & 0xFF;
+  frame[3] = transfer->value >> 8;
+  frame[4] = transfer->index & 0xFF;
+  frame[5] = transfer->index >> 8;
+  frame[6] = transfer->length & 0xFF;
+  frame[7] = transfer->length >> 8;
+  if(!in && transfer->length)
+    memcpy(frame + FLIP_SOCKET_SETUP_SIZE, transfer->data, transfer->length);
+
+  transfer->complete       = false;
+  transfer->actual         = 0;
+  transfer->transport_data = pending;
+
+  pending->owner = transfer;
+  pending->in    = in;
+  pending->next  = NULL;
+  if(sock->tail)
+    sock->tail->next = pending;
+  else
+    sock->head = pending;
+  sock->tail = pending;
+
+  /* Keep reading replies while the frame goes out, the device stops taking requests once its replies back up */
+  while(sent < length && !sock->broken){
+    struct pollfd fds = {sock->fd, POLLIN | POLLOUT, 0};
+
+    if(poll(&fds, 1, -1) < 0){
+      if(errno == EINTR)
+        continue;
+      flip_socket_break(sock, FLIP_ERR_TRANSPORT);
+      break;
+    }
+
+    if(fds.revents & POLLIN)
+      flip_socket_receive(sock);
+
+    if(!sock->broken && (fds.revents & (POLLOUT | POLLERR | POLLHUP))){
+      ssize_t written = send(sock->fd, frame + sent, length - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+      if(written > 0)
+        sent += written;
+      else if(written < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        flip_socket_break(sock, FLIP_ERR_TRANSPORT);
+    }
+  }
+
+  free(frame);
+  return sock->broken ? FLIP_ERR_TRANSPORT : FLIP_OK;
+}
+
+/** Leaves the transfer to have its reply read and thrown away, and completes it as cancelled. */
+static void flip_socket_cancel(flip_transport_t* transport, flip_transfer_t* transfer)
+{
+  flip_socket_pending_t* pending = transfer->transport_data;
+
+  (void)transport;
+
+  if(!pending || transfer->complete)
+    return;
+
+  pending->owner           = NULL;
+  transfer->transport_data = NULL;
+  transfer->result         = FLIP_ERR_CANCELLED;
+  transfer->complete       = true;
+}
+
+/** Reads reply frames until the transfer completes. A transfer still pending once timeout_ms has passed breaks
+ *  the transport and is reported as timed out.
+ */
+static int flip_socket_wait(flip_transport_t* transport, flip_transfer_t* transfer, unsigned timeout_ms)
+{
+  flip_socket_t* sock     = flip_socket_get(transport);
+  uint64_t       deadline = flip_socket_now_ms() + timeout_ms;
+
+  while(!transfer->complete){
+    struct pollfd fds = {sock->fd, POLLIN, 0};
+    uint64_t      now = flip_socket_now_ms();
+
+    if(now >= deadline){
+      flip_socket_break(sock, FLIP_ERR_TIMEOUT);
+      break;
+    }
+
+    if(poll(&fds, 1, (int)(deadline - now)) < 0 && errno != EINTR){
+      flip_socket_break(sock, FLIP_ERR_TRANSPORT);
+      break;
+    }
+
+    if(fds.revents)
+      flip_socket_receive(sock);
+  }
+
+  return transfer->result;
+}
+
+static void flip_socket_close(flip_transport_t* transport)
+{
+  flip_socket_t* sock = flip_socket_get(transport);
+
+  while(sock->head){
+    flip_socket_pending_t* pending = sock->head;
+
+    sock->head = pending->next;
+    free(pending);
+  }
+
+  close(sock->fd);
+  free(sock);
+}
+
+/** Connects to the virtual device listening on the given socket, FLIP_SOCKET_DEFAULT_PATH when NULL. */
+flip_transport_t* flip_socket_open(const char* path)
+{
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  flip_socket_t*     sock;
+
+  if(!path)
+    path = FLIP_SOCKET_DEFAULT_PATH;
+  if(strlen(path) >= sizeof(address.sun_path))
+    return NULL;
+  strcpy(address.sun_path, path);
+
+  if(!(sock = calloc(1, sizeof(flip_socket_t))))
+    return NULL;
+
+  if((sock->fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0){
+    free(sock);
+    return NULL;
+  }
+
+  if(connect(sock->fd, (struct sockaddr*)&address, sizeof(address)) < 0){
+    close(sock->fd);
+    free(sock);
+    return NULL;
+  }
+
+  sock->transport.submit  = flip_socket_submit;
+  sock->transport.wait    = flip_socket_wait;
+  sock->transport.cancel  = flip_socket_cancel;
+  sock->transport.close   = flip_socket_close;
+  sock->transport.context = sock;
+
+  return &sock->transport;
+}
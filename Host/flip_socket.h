@@ -0,0 +1,34 @@
+
+/** \file
+ *
+ *  Unix socket transport for the FLIP client library, talking to the virtual device of VirtualDevice/, see flip.h.
+ *
+ *  Each control transfer is one request frame from the host and one reply frame from the device, in the order the
+ *  requests were sent. A request frame is the 8 byte setup packet, little endian as on the bus, followed by the
+ *  wLength bytes of the data stage for host to device requests. A reply frame is a result byte, a reserved byte and
+ *  the little endian count of bytes moved in the data stage, followed by those bytes for device to host requests.
+ */
+
+#ifndef _FLIP_SOCKET_H_
+#define _FLIP_SOCKET_H_
+
+#include "flip.h"
+
+/** Socket the virtual device listens on unless told otherwise */
+#define FLIP_SOCKET_DEFAULT_PATH "/tmp/flip-virtual.sock"
+
+/** Sizes of the frame headers */
+#define FLIP_SOCKET_SETUP_SIZE 8
+#define FLIP_SOCKET_REPLY_SIZE 4
+
+/** Result byte of a reply frame */
+enum flip_socket_result
+{
+  FLIP_SOCKET_OK      = 0,
+  FLIP_SOCKET_STALL   = 1, // The device stalled the request
+  FLIP_SOCKET_TIMEOUT = 2  // The device did not complete the request in time
+};
+
+flip_transport_t* flip_socket_open(const char* path);
+
+#endif /* _FLIP_SOCKET_H_ */
@@ -0,0 +1,355 @@
+
+/** \file
+ *
+ *  Programming station: writes one image to every attached bootloader at once, with a worker thread per board.
+ *
+ *  The image file is mapped once and planned once, and every worker runs the same read-only plan on its own
+ *  transport, so that the boards share nothing but the host controller. Boards are found on USB by their
+ *  identifiers, and virtual devices (--socket), the bootloader firmware built for the host, can stand in for them or
+ *  join them. Each board's result and throughput is reported once all have finished, along with the throughput of
+ *  the station.
+ */
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "flip.h"
+#include "flip_socket.h"
+#if !defined(FLIP_NO_LIBUSB)
+  #include "flip_usb.h"
+#endif
+
+/** Most boards a station drives */
+#define FLIP_STATION_MAX_DEVICES 64
+
+/** Where a board is reached */
+typedef enum
+{
+  FLIP_STATION_USB,
+  FLIP_STATION_SOCKET
+} flip_station_kind_t;
+
+/** One board and the outcome of writing it */
+typedef struct
+{
+  flip_station_kind_t kind;
+  int                 index;  // Index among the USB devices
+  const char*         path;   // Socket of a virtual device
+  char                name[48];
+  pthread_t           thread;
+
+  int                 result;
+  flip_dfu_status_t   status; // Last status reported by the device, telling a FLIP_ERR_DEVICE apart
+  uint32_t            bytes;  // Image bytes written
+  double              seconds;
+} flip_station_device_t;
+
+/** What every worker does */
+typedef struct
+{
+  const flip_plan_t* plan;
+  unsigned           depth;
+  unsigned           timeout_ms;
+  bool               start;   // Start the application once written
+} flip_station_job_t;
+
+static flip_station_job_t    job;
+static flip_station_device_t devices[FLIP_STATION_MAX_DEVICES];
+static int                   deviceCount;
+
+static const struct option stationOptions[] =
+{
+  {"memory",     required_argument, NULL, 'm'},
+  {"address",    required_argument, NULL, 'a'},
+  {"page-size",  required_argument, NULL, 'p'},
+  {"erase",      no_argument,       NULL, 'e'},
+  {"skip-blank", no_argument,       NULL, 'b'},
+  {"verify",     no_argument,       NULL, 'v'},
+  {"depth",      required_argument, NULL, 'q'},
+  {"timeout",    required_argument, NULL, 't'},
+  {"start",      no_argument,       NULL, 'r'},
+  {"usb",        no_argument,       NULL, 'u'},
+  {"socket",     required_argument, NULL, 's'},
+  {"help",       no_argument,       NULL, 'h'},
+  {NULL,         0,                 NULL, 0}
+};
+
+static void flip_station_usage(const char* name)
+{
+  fprintf(stderr,
+          "Usage: %s [options] IMAGE\n"
+          "Writes the raw binary IMAGE to every board at once.\n"
+          "  -m, --memory NAME   flash (default), eeprom or dataflash\n"
+          "  -a, --address ADDR  address the image starts at, 0 by default\n"
+          "  -p, --page-size N   page size of the memory, required for dataflash (512 on an AT45DB321E)\n"
+          "  -e, --erase         erase the memory first\n"
+          "  -b, --skip-blank    leave out blank pages, together with --erase\n"
+          "  -v, --verify        check the page hashes once written\n"
+          "  -q, --depth N       transfers queued on each board, 8 by default\n"
+          "  -t, --timeout MS    timeout of each transfer\n"
+          "  -r, --start         start the application once written\n"
+          "  -u, --usb           write every attached board, the default without --socket\n"
+          "  -s, --socket PATH   write the virtual device listening on PATH, may be repeated\n",
+          name);
+}
+
+static double flip_station_now(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static flip_station_device_t* flip_station_add(flip_station_kind_t kind, int index, const char* path)
+{
+  flip_station_device_t* device;
+
+  if(deviceCount == FLIP_STATION_MAX_DEVICES){
+    fprintf(stderr, "more than %d boards\n", FLIP_STATION_MAX_DEVICES);
+    return NULL;
+  }
+
+  device        = &devices[deviceCount++];
+  device->kind  = kind;
+  device->index = index;
+  device->path  = path;
+
+  switch(kind){
+    case FLIP_STATION_USB:    snprintf(device->name, sizeof(device->name), "usb:%d", index); break;
+    case FLIP_STATION_SOCKET: snprintf(device->name, sizeof(device->name), "%s", path); break;
+  }
+
+  return device;
+}
+
+static flip_transport_t* flip_station_open(flip_station_device_t* device)
+{
+  switch(device->kind){
+    case FLIP_STATION_SOCKET:
+      return flip_socket_open(device->path);
+    default:
+#if !defined(FLIP_NO_LIBUSB)
+      return flip_usb_open(FLIP_VENDOR_ID, FLIP_PRODUCT_ID, device->index);
+#else
+      return NULL;
+#endif
+  }
+}
+
+/** Progress of a worker, counting the image bytes written so far so that a failure still reports the throughput */
+static void flip_station_progress(void* context, size_t done, size_t total, uint32_t bytes)
+{
+  flip_station_device_t* device = context;
+  const flip_op_t*       op     = &job.plan->ops[done - 1];
+
+  (void)total;
+  (void)bytes;
+  if(op->kind == FLIP_OP_DOWNLOAD)
+    device->bytes += op->length;
+}
+
+/** Worker writing the image to one board. */
+static void* flip_station_worker(void* context)
+{
+  flip_station_device_t* device = context;
+  flip_session_t         session;
+  double                 start = flip_station_now();
+
+  /* A board which cannot be opened fails as a transport failure */
+  if(flip_open(&session, flip_station_open(device)) != FLIP_OK){
+    device->result = FLIP_ERR_TRANSPORT;
+    return NULL;
+  }
+  if(job.timeout_ms)
+    session.timeout_ms = job.timeout_ms;
+
+  device->result = flip_plan_run(&session, job.plan, job.depth, flip_station_progress, device);
+  if(device->result == FLIP_OK && job.start)
+    device->result = flip_start_application(&session, true, 0);
+
+  device->seconds = flip_station_now() - start;
+  device->status  = session.last_status;
+  flip_close(&session);
+
+  return NULL;
+}
+
+/** Maps the image file read-only, shared by every worker. */
+static const uint8_t* flip_station_map(const char* path, uint32_t* length)
+{
+  struct stat info;
+  void*       image;
+  int         fd;
+
+  if((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &info) < 0){
+    perror(path);
+    return NULL;
+  }
+
+  if(!info.st_size || info.st_size > UINT32_MAX){
+    fprintf(stderr, "%s: empty or too large\n", path);
+    close(fd);
+    return NULL;
+  }
+
+  image = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if(image == MAP_FAILED){
+    perror(path);
+    return NULL;
+  }
+
+  *length = info.st_size;
+  return image;
+}
+
+static void flip_station_report(double seconds)
+{
+  uint64_t total  = 0;
+  int      failed = 0;
+
+  printf("%-24s %-32s %10s %9s %11s\n", "board", "result", "bytes", "seconds", "KB/s");
+
+  for(int i=0;i<deviceCount;i++){
+    flip_station_device_t* device = &devices[i];
+    char                   result[64];
+
+    if(device->result == FLIP_ERR_DEVICE)
+      snprintf(result, sizeof(result), "%s (status %u)", flip_strerror(device->result), device->status.status);
+    else
+      snprintf(result, sizeof(result), "%s", flip_strerror(device->result));
+
+    printf("%-24s %-32s %10u %9.3f %11.1f\n", device->name, result, device->bytes, device->seconds,
+           device->seconds ? device->bytes / 1024.0 / device->seconds : 0.0);
+
+    total += device->bytes;
+    if(device->result != FLIP_OK)
+      failed++;
+  }
+
+  printf("station: %d boards, %d failed, %llu bytes in %.3f s, %.1f KB/s\n", deviceCount, failed,
+         (unsigned long long)total, seconds, seconds ? total / 1024.0 / seconds : 0.0);
+}
+
+int main(int argc, char** argv)
+{
+  flip_plan_options_t options = {.memory = FLIP_MEMORY_FLASH};
+  flip_plan_t         plan;
+  const uint8_t*      image;
+  uint32_t            length;
+  uint32_t            address = 0;
+  bool                useUSB  = false;
+  int                 option;
+  int                 result;
+
+  job.depth = 8;
+
+  while((option = getopt_long(argc, argv, "m:a:p:ebvq:t:rus:h", stationOptions, NULL)) != -1){
+    switch(option){
+      case 'm':
+        if(!strcmp(optarg, "flash"))
+          options.memory = FLIP_MEMORY_FLASH;
+        else if(!strcmp(optarg, "eeprom"))
+          options.memory = FLIP_MEMORY_EEPROM;
+        else if(!strcmp(optarg, "dataflash"))
+          options.memory = FLIP_MEMORY_DATAFLASH;
+        else{
+          fprintf(stderr, "%s: unknown memory\n", optarg);
+          return 2;
+        }
+        break;
+      case 'a': address            = strtoul(optarg, NULL, 0); break;
+      case 'p': options.page_size  = strtoul(optarg, NULL, 0); break;
+      case 'e': options.erase      = true; break;
+      case 'b': options.skip_blank = true; break;
+      case 'v': options.verify     = true; break;
+      case 'q': job.depth          = strtoul(optarg, NULL, 0); break;
+      case 't': job.timeout_ms     = strtoul(optarg, NULL, 0); break;
+      case 'r': job.start          = true; break;
+      case 'u': useUSB             = true; break;
+      case 's':
+        if(!flip_station_add(FLIP_STATION_SOCKET, 0, optarg))
+          return 2;
+        break;
+      default:
+        flip_station_usage(argv[0]);
+        return (option == 'h') ? 0 : 2;
+    }
+  }
+
+  if(optind != argc - 1){
+    flip_station_usage(argv[0]);
+    return 2;
+  }
+
+  /* Discover the boards attached over USB */
+  if(useUSB || !deviceCount){
+#if !defined(FLIP_NO_LIBUSB)
+    int count = flip_usb_count(FLIP_VENDOR_ID, FLIP_PRODUCT_ID);
+
+    for(int i=0;i<count;i++){
+      if(!flip_station_add(FLIP_STATION_USB, i, NULL))
+        return 2;
+    }
+#else
+    fprintf(stderr, "built without libusb, only --socket boards can be written\n");
+    return 2;
+#endif
+  }
+
+  if(!deviceCount){
+    fprintf(stderr, "no boards found\n");
+    return 1;
+  }
+
+  if(!(image = flip_station_map(argv[optind], &length)))
+    return 1;
+
+  if(options.memory == FLIP_MEMORY_DATAFLASH && !options.page_size){
+    fprintf(stderr, "the dataflash page size must be given with --page-size\n");
+    return 2;
+  }
+
+  /* Every board runs the same plan */
+  if((result = flip_plan_image(&plan, image, address, length, &options)) != FLIP_OK){
+    fprintf(stderr, "%s: %s\n", argv[optind], flip_strerror(result));
+    return 1;
+  }
+  job.plan = &plan;
+
+  double start = flip_station_now();
+
+  for(int i=0;i<deviceCount;i++){
+    if(pthread_create(&devices[i].thread, NULL, flip_station_worker, &devices[i])){
+      devices[i].result = FLIP_ERR_MEMORY;
+      devices[i].thread = pthread_self();
+    }
+  }
+
+  for(int i=0;i<deviceCount;i++){
+    if(!pthread_equal(devices[i].thread, pthread_self()))
+      pthread_join(devices[i].thread, NULL);
+  }
+
+  flip_station_report(flip_station_now() - start);
+
+  flip_plan_free(&plan);
+  munmap((void*)image, length);
+
+  for(int i=0;i<deviceCount;i++){
+    if(devices[i].result != FLIP_OK)
+      return 1;
+  }
+
+  return 0;
+}
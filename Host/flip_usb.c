@@ -0,0 +1,254 @@
+
+/** \file
+ *
+ *  libusb-1.0 transport for the FLIP client library. Each transfer is submitted as an asynchronous control
+ *  transfer, so that several requests are queued on the host controller at once and reach the device back to back.
+ *  Every transport has a libusb context of its own, which lets separate threads drive separate boards.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <libusb.h>
+
+#include "flip_usb.h"
+
+/** Interface the bootloader's DFU requests are addressed to */
+#define FLIP_USB_INTERFACE 0
+
+/** State of an opened bootloader */
+typedef struct
+{
+  flip_transport_t      transport;
+  libusb_context*       context;
+  libusb_device_handle* handle;
+} flip_usb_t;
+
+/** libusb transfer of a queued flip_transfer_t, with room for the setup packet ahead of the data stage */
+typedef struct
+{
+  struct libusb_transfer* transfer;
+  flip_transfer_t*        owner;
+  unsigned char           buffer[];
+} flip_usb_transfer_t;
+
+static flip_usb_t* flip_usb_get(flip_transport_t* transport)
+{
+  return (flip_usb_t*)transport->context;
+}
+
+static int flip_usb_result(enum libusb_transfer_status status)
+{
+  switch(status){
+    case LIBUSB_TRANSFER_COMPLETED: return FLIP_OK;
+    case LIBUSB_TRANSFER_STALL:     return FLIP_ERR_STALL;
+    case LIBUSB_TRANSFER_TIMED_OUT: return FLIP_ERR_TIMEOUT;
+    case LIBUSB_TRANSFER_CANCELLED: return FLIP_ERR_CANCELLED;
+    default:                        return FLIP_ERR_TRANSPORT;
+  }
+}
+
+/** Completion callback, copies the data read back, releases the libusb transfer and marks the transfer complete.
+ *  Transfers ahead of the one waited for complete from within that wait, so nothing is left for them to release.
+ */
+static void LIBUSB_CALL flip_usb_callback(struct libusb_transfer* transfer)
+{
+  flip_usb_transfer_t* queued = transfer->user_data;
+  flip_transfer_t*     owner  = queued->owner;
+
+  owner->result = flip_usb_result(transfer->status);
+  owner->actual = transfer->actual_length;
+
+  if((owner->request_type & LIBUSB_ENDPOINT_IN) && owner->actual)
+    memcpy(owner->data, libusb_control_transfer_get_data(transfer), owner->actual);
+
+  libusb_free_transfer(transfer);
+  free(queued);
+
+  owner->transport_data = NULL;
+  owner->complete       = true;
+}
+
+static int flip_usb_submit(flip_transport_t* transport, flip_transfer_t* transfer)
+{
+  flip_usb_t*          usb    = flip_usb_get(transport);
+  flip_usb_transfer_t* queued = malloc(sizeof(flip_usb_transfer_t) + LIBUSB_CONTROL_SETUP_SIZE + transfer->length);
+
+  if(!queued)
+    return FLIP_ERR_MEMORY;
+
+  if(!(queued->transfer = libusb_alloc_transfer(0))){
+    free(queued);
+    return FLIP_ERR_MEMORY;
+  }
+
+  transfer->complete       = false;
+  transfer->actual         = 0;
+  transfer->transport_data = queued;
+  queued->owner            = transfer;
+
+  libusb_fill_control_setup(queued->buffer, transfer->request_type, transfer->request, transfer->value,
+                            FLIP_USB_INTERFACE, transfer->length);
+  if(!(transfer->request_type & LIBUSB_ENDPOINT_IN) && transfer->length)
+    memcpy(queued->buffer + LIBUSB_CONTROL_SETUP_SIZE, transfer->data, transfer->length);
+
+  /* No libusb timeout, a queued request only starts once those ahead of it have completed: flip_usb_wait()
+     times the transfer from when the host starts waiting for it */
+  libusb_fill_control_transfer(queued->transfer, usb->handle, queued->buffer, flip_usb_callback, queued, 0);
+
+  if(libusb_submit_transfer(queued->transfer) != LIBUSB_SUCCESS){
+    libusb_free_transfer(queued->transfer);
+    free(queued);
+    transfer->transport_data = NULL;
+    return FLIP_ERR_TRANSPORT;
+  }
+
+  return FLIP_OK;
+}
+
+static uint64_t flip_usb_now_ms(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000L;
+}
+
+static void flip_usb_cancel(flip_transport_t* transport, flip_transfer_t* transfer)
+{
+  flip_usb_transfer_t* queued = transfer->transport_data;
+
+  (void)transport;
+
+  if(queued && !transfer->complete)
+    libusb_cancel_transfer(queued->transfer);
+}
+
+/** Handles libusb events until the transfer completes. A transfer still pending once timeout_ms has passed is
+ *  cancelled and reported as timed out.
+ */
+static int flip_usb_wait(flip_transport_t* transport, flip_transfer_t* transfer, unsigned timeout_ms)
+{
+  flip_usb_t* usb = flip_usb_get(transport);
+  int         completed;
+
+  uint64_t deadline  = flip_usb_now_ms() + timeout_ms;
+  bool     timed_out = false;
+
+  while(!transfer->complete){
+    struct timeval poll = {0, 100000};
+
+    completed = transfer->complete;
+    libusb_handle_events_timeout_completed(usb->context, &poll, &completed);
+
+    if(!transfer->complete && !timed_out && flip_usb_now_ms() >= deadline){
+      /* Give up on the transfer and wait for libusb to hand it back */
+      timed_out = true;
+      flip_usb_cancel(transport, transfer);
+    }
+  }
+
+  if(timed_out && transfer->result == FLIP_ERR_CANCELLED)
+    transfer->result = FLIP_ERR_TIMEOUT;
+
+  return transfer->result;
+}
+
+static void flip_usb_close(flip_transport_t* transport)
+{
+  flip_usb_t* usb = flip_usb_get(transport);
+
+  libusb_release_interface(usb->handle, FLIP_USB_INTERFACE);
+  libusb_close(usb->handle);
+  libusb_exit(usb->context);
+  free(usb);
+}
+
+/** Looks up the index-th device with the given identifiers, returning it referenced. */
+static libusb_device* flip_usb_find(libusb_context* context, uint16_t vendor_id, uint16_t product_id, int index,
+                                    int* count)
+{
+  libusb_device** list;
+  libusb_device*  found = NULL;
+  ssize_t         total = libusb_get_device_list(context, &list);
+
+  *count = 0;
+  if(total < 0)
+    return NULL;
+
+  for(ssize_t i=0;i<total;i++){
+    struct libusb_device_descriptor descriptor;
+
+    if(libusb_get_device_descriptor(list[i], &descriptor) != LIBUSB_SUCCESS)
+      continue;
+    if(descriptor.idVendor != vendor_id || descriptor.idProduct != product_id)
+      continue;
+
+    if(*count == index)
+      found = libusb_ref_device(list[i]);
+    (*count)++;
+  }
+
+  libusb_free_device_list(list, 1);
+  return found;
+}
+
+/** Counts the attached devices with the given identifiers. */
+int flip_usb_count(uint16_t vendor_id, uint16_t product_id)
+{
+  libusb_context* context;
+  int             count;
+
+  if(libusb_init(&context) != LIBUSB_SUCCESS)
+    return FLIP_ERR_TRANSPORT;
+
+  libusb_device* device = flip_usb_find(context, vendor_id, product_id, -1, &count);
+  if(device)
+    libusb_unref_device(device);
+
+  libusb_exit(context);
+  return count;
+}
+
+/** Opens the index-th attached device with the given identifiers and claims its DFU interface. */
+flip_transport_t* flip_usb_open(uint16_t vendor_id, uint16_t product_id, int index)
+{
+  flip_usb_t* usb = calloc(1, sizeof(flip_usb_t));
+  int         count;
+
+  if(!usb)
+    return NULL;
+
+  if(libusb_init(&usb->context) != LIBUSB_SUCCESS){
+    free(usb);
+    return NULL;
+  }
+
+  libusb_device* device = flip_usb_find(usb->context, vendor_id, product_id, index, &count);
+  if(device){
+    if(libusb_open(device, &usb->handle) != LIBUSB_SUCCESS)
+      usb->handle = NULL;
+    libusb_unref_device(device);
+  }
+
+  if(usb->handle && libusb_claim_interface(usb->handle, FLIP_USB_INTERFACE) != LIBUSB_SUCCESS){
+    libusb_close(usb->handle);
+    usb->handle = NULL;
+  }
+
+  if(!usb->handle){
+    libusb_exit(usb->context);
+    free(usb);
+    return NULL;
+  }
+
+  usb->transport.submit  = flip_usb_submit;
+  usb->transport.wait    = flip_usb_wait;
+  usb->transport.cancel  = flip_usb_cancel;
+  usb->transport.close   = flip_usb_close;
+  usb->transport.context = usb;
+
+  return &usb->transport;
+}
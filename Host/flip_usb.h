@@ -0,0 +1,15 @@
+
+/** \file
+ *
+ *  libusb-1.0 transport for the FLIP client library, see flip.h.
+ */
+
+#ifndef _FLIP_USB_H_
+#define _FLIP_USB_H_
+
+#include "flip.h"
+
+int flip_usb_count(uint16_t vendor_id, uint16_t product_id);
+flip_transport_t* flip_usb_open(uint16_t vendor_id, uint16_t product_id, int index);
+
+#endif /* _FLIP_USB_H_ */
@@ -0,0 +1,49 @@
+
+/* \file
+ *
+ * Interrupt driven SPI block transfer engine. A block staged in SRAM is clocked out to the selected Dataflash by
+ * the SPI transfer complete interrupt, one byte per interrupt, while the main code carries on servicing USB. Only
+ * downloads go through it, uploads keep the polled pump, which overlaps each byte with the endpoint write.
+ */
+
+#include "SPIEngine.h"
+
+#if defined(DATAFLASH_USE_SPI_ENGINE)
+
+/** Next byte of the block being sent and bytes still to send */
+static const uint8_t* volatile engineData;
+static volatile uint8_t        engineLeft;
+
+/** Starts sending a block from SRAM to the selected SPI slave in the background, discarding the bytes clocked back.
+ *  The SPI must be idle, the slave selected and the buffer left untouched until SPIEngine_IsBusy() returns false.
+ */
+void SPIEngine_Start(const uint8_t* buffer, uint8_t length)
+{
+  if(!length)
+    return;
+
+  engineData = buffer;
+  engineLeft = length;
+
+  /* Reading SPSR then writing SPDR clears any stale transfer complete flag left by polled transfers */
+  (void)SPSR;
+  SPDR  = *buffer;
+  SPCR |= _BV(SPIE);
+}
+
+/** SPI transfer complete interrupt, starts sending the next byte. */
+ISR(SPI_STC_vect)
+{
+  const uint8_t* data = engineData + 1;
+
+  if(--engineLeft){
+    SPDR = *data;
+    engineData = data;
+  }
+  else{
+    /* Block finished, stop taking interrupts */
+    SPCR &= ~_BV(SPIE);
+  }
+}
+
+#endif
@@ -0,0 +1,27 @@
+/** \file
+ *
+ *  Header file for SPIEngine.c.
+ */
+
+#ifndef _SPI_ENGINE_H_
+#define _SPI_ENGINE_H_
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stdbool.h>
+
+void SPIEngine_Start(const uint8_t* buffer, uint8_t length);
+
+/** Indicates whether a block transfer started by SPIEngine_Start() is still running. */
+static inline bool SPIEngine_IsBusy(void)
+{
+  return (SPCR & _BV(SPIE));
+}
+
+/** Waits for the running block transfer, if any, to finish. */
+static inline void SPIEngine_Wait(void)
+{
+  while(SPIEngine_IsBusy()){};
+}
+
+#endif /* _SPI_ENGINE_H_ */
@@ -0,0 +1,46 @@
+
+/** \file
+ *
+ *  Protothread style cooperative tasks for the bootloader.
+ *
+ *  A task is a function which the main loop calls over and over. Each call resumes the task where it last had to
+ *  wait and returns TASK_WAITING as soon as it has to wait again, so that the USB stack and the other tasks keep
+ *  running. The resume point is kept in a Task_t, which must be zero before the first call and is zeroed again when
+ *  the task finishes. Locals are lost at every wait, so anything a task needs across a wait must be static, and
+ *  a wait must never be placed inside a switch statement of the task itself.
+ */
+
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+#include <stdint.h>
+
+/** Resume point of a task, the source line of the wait it is blocked on or zero when it is not running. */
+typedef uint16_t Task_t;
+
+/** Values returned by a task to the loop running it */
+enum Task_Result_t
+{
+  TASK_WAITING = 0,
+  TASK_DONE    = 1
+};
+
+/** Opens the body of a task, jumping to where it last had to wait */
+#define TASK_BEGIN(task)            switch(task){ case 0:
+
+/** Returns from the task until cond holds, the condition is evaluated again each time the task is resumed */
+#define TASK_WAIT_UNTIL(task, cond) do{ (task) = __LINE__; case __LINE__: if(!(cond)) return TASK_WAITING; }while(0)
+
+/** Gives the other tasks a turn before carrying on */
+#define TASK_YIELD(task)            do{ (task) = __LINE__; return TASK_WAITING; case __LINE__:; }while(0)
+
+/** Runs a child task to completion, resuming it each time this task is resumed */
+#define TASK_SPAWN(task, child)     TASK_WAIT_UNTIL(task, (child) == TASK_DONE)
+
+/** Finishes the task early */
+#define TASK_EXIT(task)             do{ (task) = 0; return TASK_DONE; }while(0)
+
+/** Closes the body of a task */
+#define TASK_END(task)              } (task) = 0; return TASK_DONE
+
+#endif /* _SCHEDULER_H_ */
@@ -0,0 +1,65 @@
+/** \file
+ *
+ *  Transfer deadlines for the bootloader tasks, counted on Timer 0 without an interrupt.
+ *
+ *  Timer 0 runs in CTC mode with a 1ms period and the main loop counts the compare matches while a deadline is
+ *  armed. A tick missed because the loop was busy for longer than 1ms only makes the deadline a little later.
+ */
+
+#ifndef _TIMEOUT_H_
+#define _TIMEOUT_H_
+
+#include <avr/io.h>
+#include <stdbool.h>
+
+/** Milliseconds an endpoint may be waited on before the control transfer is abandoned */
+#if !defined(TRANSFER_TIMEOUT_MS)
+  #define TRANSFER_TIMEOUT_MS 1000
+#endif
+
+/** Milliseconds left before the armed deadline expires, zero while no deadline is armed */
+extern uint16_t Timeout_MillisecondsLeft;
+
+/** Starts Timer 0 ticking once per millisecond. */
+static inline void Timeout_Init(void)
+{
+  OCR0A  = (F_CPU / 64 / 1000) - 1;
+  TCCR0A = _BV(WGM01);
+  TCCR0B = _BV(CS01) | _BV(CS00); // F_CPU/64
+}
+
+/** Stops Timer 0 and returns it to its reset state for the application. */
+static inline void Timeout_ShutDown(void)
+{
+  TCCR0B = 0;
+  TCCR0A = 0;
+  OCR0A  = 0;
+  TIFR0  = _BV(OCF0A);
+}
+
+/** Arms the deadline to expire in the given number of milliseconds. */
+static inline void Timeout_Arm(const uint16_t milliseconds)
+{
+  Timeout_MillisecondsLeft = milliseconds;
+}
+
+/** Disarms the deadline. */
+static inline void Timeout_Disarm(void)
+{
+  Timeout_MillisecondsLeft = 0;
+}
+
+/** Counts the ticks elapsed since the last call, must be called from the main loop.
+ *
+ *  \return Boolean true once, when the armed deadline expires
+ */
+static inline bool Timeout_HasExpired(void)
+{
+  if(!Timeout_MillisecondsLeft || !(TIFR0 & _BV(OCF0A)))
+    return false;
+
+  TIFR0 = _BV(OCF0A);
+  return !(--Timeout_MillisecondsLeft);
+}
+
+#endif /* _TIMEOUT_H_ */
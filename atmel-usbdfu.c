@@ -6,6 +6,11 @@
 
 #include "atmel-usbdfu.h"
 
+/** Copy of the magic key word found at the top of SRAM at reset. It is taken in .init3, as the call to main()
+ *  pushes its return address over that word, and lives in .noinit so that the startup code leaves it alone.
+ */
+uint16_t MagicBootKey ATTR_NO_INIT;
+
 /** Flag to indicate if the bootloader should be running, or should exit and allow the application code to run
  *  via a soft reset. When cleared, the bootloader will abort, the USB interface will shut down and the application
  *  jumped to via an indirect jump to location 0x0000 (or other location specified by the host).
@@ -26,18 +31,245 @@ AppPtr_t AppStartPtr = (AppPtr_t)0x0000;
  */
 uint8_t curFlash64KBPageNumber = 0;
 
-/** Main program entry point. This routine configures the hardware required by the bootloader, then continuously 
+/** Geometry of the fitted Dataflash ICs, identified at startup by Dataflash_DetectGeometry(). */
+Dataflash_Geometry_t Dataflash_Geometry = {DATAFLASH_DEFAULT_PAGE_SHIFT, DATAFLASH_DEFAULT_OFFSET_ADDR_WIDTH, DATAFLASH_DEFAULT_PAGES};
+
+/** Mask of the tasks the main loop keeps running, made of Task_ID_t bits. */
+uint8_t runningTasks;
+
+/** Resume points of the bootloader tasks, see Scheduler.h. */
+Task_State_t TaskState;
+
+/** Back-ends of the memories moved by the download and upload engines, in Memory_ID_t order. */
+const Memory_Backend_t MemoryBackends[] PROGMEM =
+{
+  { // MEMORY_FLASH
+    .PageShift    = FLASH_PAGE_SHIFT,
+    .WholePages   = true,
+    .PrepareWrite = Flash_PrepareWrite,
+    .Write        = Flash_Write,
+    .EndPage      = Flash_EndPage,
+    .Read         = Flash_Read,
+    .FindNonBlank = Flash_FindNonBlank,
+    .IsPageErased = IsFlashPageErased
+  },
+  { // MEMORY_EEPROM
+    .PageShift    = EEPROM_CHECK_CHUNK_SHIFT,
+    .PrepareWrite = EEPROM_PrepareWrite,
+    .Write        = EEPROM_Write,
+    .Read         = EEPROM_Read,
+    .FindNonBlank = EEPROM_FindNonBlank
+  },
+  { // MEMORY_DATAFLASH
+    .WholePages   = true,
+    .PrepareWrite = Dataflash_PrepareWrite,
+    .BeginPage    = Dataflash_BeginPage,
+    .Write        = Dataflash_Write,
+    .EndPage      = Dataflash_EndPage,
+    .FinishWrite  = Dataflash_FinishWrite,
+    .Seek         = Dataflash_Seek,
+    .Read         = Dataflash_Read,
+    .FindNonBlank = Dataflash_FindNonBlank,
+    .IsPageErased = IsDataflashPageErased
+  }
+};
+
+/** Back-end of the memory moved by the current command, copied out of MemoryBackends by SelectMemory(). */
+Memory_Backend_t memory;
+
+/** Copy of the request served by ControlTask(), as the USB stack reuses USB_ControlRequest for standard requests. */
+USB_Request_Header_t controlRequest;
+
+/** Bytes of the DFU_DNLOAD data stage which have not been acknowledged yet, see ClearDataStageOUT(). */
+uint16_t dataStageLeft;
+
+/** State the bootloader returns to once a command running in the background has finished. */
+uint8_t commandResumeState;
+
+/** Set once the host has asked for commands without a data stage to run in the background, see ProcessSelect().
+ *  Stock FLIP hosts read the status straight after such a command and do not poll through dfuDNBUSY.
+ */
+bool backgroundCommands;
+
+#if !defined(NO_COMMAND_SCRIPTS)
+/** Commands of the last command script, how many were received, and the index of the one which failed. */
+USB_FLIP_Command_t scriptCommands[SCRIPT_MAX_COMMANDS];
+uint8_t scriptLength;
+uint8_t scriptFailedCommand;
+#endif
+
+#if defined(PAGE_BUFFER_DOWNLOADS)
+/** Flash page assembled in SRAM by the delta and scatter downloads, and the address of the page it holds. */
+uint8_t  pageBuffer[SPM_PAGESIZE];
+uint16_t pageBufferAddr;
+#endif
+
+/** Set once a flash image has arrived completely, until RecordApplication() has recorded it or the flash changes. */
+bool recordPending;
+
+/** Milliseconds left before the endpoint wait in progress is given up, see Timeout.h. */
+uint16_t Timeout_MillisecondsLeft;
+
+/** Main program entry point. This routine configures the hardware required by the bootloader, then continuously
  *  runs the bootloader processing routine until instructed to soft-exit, or hard-reset via the watchdog to start
  *  the loaded application code.
  */
 int main(void)
 {
+  /* Start a valid application straight from reset, before any USB or SPI setup, unless the bootloader is wanted */
+  if(!IsBootloaderRequested())
+    AppStartPtr();
+
   /* Configure hardware required by the bootloader */
   SetupHardware();
-  
+
   /* Run the USB management task while the bootloader is supposed to be running */
-  while (1)
+  while (1){
     USB_USBTask();
+
+    /* Abandon a control transfer the host has stopped taking part in */
+    if((runningTasks & TASK_CONTROL) && Timeout_HasExpired())
+      AbortControlTask();
+
+    /* Give each running task a turn, a task returns as soon as it would have to wait */
+    if((runningTasks & TASK_CONTROL) && ControlTask() == TASK_DONE)
+      runningTasks &= ~TASK_CONTROL;
+    if((runningTasks & TASK_COMMAND) && CommandTask() == TASK_DONE)
+      runningTasks &= ~TASK_COMMAND;
+  }
+}
+
+/** Takes the magic key out of the top of SRAM before anything is pushed there, clearing it so that the watchdog
+ *  reset the bootloader later leaves through does not find it again.
+ */
+void CaptureMagicBootKey(void)
+{
+  MagicBootKey = *(volatile uint16_t*)MAGIC_BOOT_KEY_ADDR;
+  *(volatile uint16_t*)MAGIC_BOOT_KEY_ADDR = 0;
+}
+
+/** Decides at reset whether the bootloader should run. It runs when the application asked for it with the magic
+ *  key, after an external reset, while the HWB button is held, and whenever the application fails
+ *  IsApplicationIntact(). Power-on, brown-out and watchdog resets (the last being how the bootloader itself starts
+ *  the application) otherwise go straight to the application.
+ */
+bool IsBootloaderRequested(void)
+{
+  bool requested;
+
+  /* The reset flags add up until cleared, so the external reset flag is consumed here; otherwise the watchdog reset
+     used to leave the bootloader would find it still set and come back */
+  requested = (MCUSR & _BV(EXTRF)) != 0;
+  MCUSR &= ~_BV(EXTRF);
+
+  /* An application handing over to the bootloader skips the other checks, the full CRC check among them */
+  if((MCUSR & _BV(WDRF)) && MagicBootKey == MAGIC_BOOT_KEY)
+    return true;
+
+  /* The watchdog stays enabled after a watchdog reset, at its shortest timeout, which the full CRC check would
+     overrun. It is stopped here, and the application starts with it stopped too */
+  MCUSR &= ~_BV(WDRF);
+  wdt_disable();
+
+  HWB_Init();
+
+  /* Checking the application also gives the pull-up time to raise the HWB pin */
+  if(!IsApplicationIntact())
+    requested = true;
+  if(HWB_GetStatus())
+    requested = true;
+
+  HWB_ShutDown();
+  return requested;
+}
+
+/** Checks the application section against the record of the last complete download, as far as APP_CHECK asks
+ *  for. The valid marker is always required, as it is only set once the record has been written.
+ */
+bool IsApplicationIntact(void)
+{
+  App_Record_t record;
+
+  if(eeprom_read_byte((uint8_t*)APP_VALID_EEPROM_ADDR) != APP_VALID_MARKER)
+    return false;
+
+  eeprom_read_block(&record, (void*)APP_RECORD_EEPROM_ADDR, sizeof(App_Record_t));
+  if(!record.Length || record.Length > BOOT_START_ADDR)
+    return false;
+
+#if (APP_CHECK == APP_CHECK_FULL)
+  return ~Flash_Crc32(0, record.Length, 0xFFFFFFFF) == record.Crc;
+#elif (APP_CHECK == APP_CHECK_QUICK)
+  return pgm_read_word(0) == record.Header && pgm_read_word(record.Length - 2) == record.Trailer;
+#else
+  return true;
+#endif
+}
+
+/** Sets or clears the EEPROM marker telling IsBootloaderRequested() that the application section can be started. */
+void SetApplicationValid(bool valid)
+{
+  eeprom_update_byte((uint8_t*)APP_VALID_EEPROM_ADDR, valid ? APP_VALID_MARKER : 0xFF);
+}
+
+/** Finds the end of the application image, skipping the pages the bitmap knows to be erased and then any trailing
+ *  blank words.
+ *
+ *  \return Address following the last programmed word, zero for a blank application section
+ */
+uint16_t FindApplicationEnd(void)
+{
+  uint16_t endAddr;
+
+  for(endAddr=BOOT_START_ADDR;endAddr && IsFlashPageErased((endAddr / SPM_PAGESIZE) - 1);endAddr-=SPM_PAGESIZE);
+  while(endAddr && pgm_read_word(endAddr - 2) == 0xFFFF)
+    endAddr -= 2;
+
+  return endAddr;
+}
+
+/** Writes the record of the flash image downloaded last, then sets the application valid marker. It runs once as
+ *  the bootloader is left, as the CRC covers the whole image. The image ends where FindApplicationEnd() says, and
+ *  its CRC is computed one page per turn. A blank image is not recorded, so the bootloader keeps running.
+ */
+uint8_t RecordApplication(void)
+{
+  static App_Record_t record;
+  static uint16_t curAddr;
+
+  TASK_BEGIN(TaskState.Record);
+
+  curAddr = FindApplicationEnd();
+  if(!curAddr)
+    TASK_EXIT(TaskState.Record);
+
+  record.Length  = curAddr;
+  record.Header  = pgm_read_word(0);
+  record.Trailer = pgm_read_word(curAddr - 2);
+  record.Crc     = 0xFFFFFFFF;
+
+  for(curAddr=0;curAddr<record.Length;curAddr+=SPM_PAGESIZE){
+    uint16_t run = record.Length - curAddr;
+
+    if(run > SPM_PAGESIZE)
+      run = SPM_PAGESIZE;
+
+    record.Crc = Flash_Crc32(curAddr, run, record.Crc);
+    TASK_YIELD(TaskState.Record);
+  }
+  record.Crc = ~record.Crc;
+
+  /* Write the record a byte at a time, giving the other tasks a turn while each byte is programmed */
+  for(curAddr=0;curAddr<sizeof(App_Record_t);curAddr++){
+    TASK_WAIT_UNTIL(TaskState.Record, eeprom_is_ready());
+    eeprom_update_byte((uint8_t*)(APP_RECORD_EEPROM_ADDR + curAddr), ((uint8_t*)&record)[curAddr]);
+  }
+  TASK_WAIT_UNTIL(TaskState.Record, eeprom_is_ready());
+
+  SetApplicationValid(true);
+  recordPending = false;
+
+  TASK_END(TaskState.Record);
 }
 
 /** Configures all hardware required for the bootloader. */
@@ -55,11 +287,20 @@ void SetupHardware(void)
   MCUCR = _BV(IVSEL); // Move the Interrupt Vectors to the beginning of the Boot Loader section of the Flash
 
   /* Protocol initialization */
-  USB_Init();
-  SPI_Init(SPI_SPEED_FCPU_DIV_2 | SPI_ORDER_MSB_FIRST | SPI_SCK_LEAD_FALLING | SPI_SAMPLE_TRAILING | SPI_MODE_MASTER);
+  Dataflash_BusInit();
+  Timeout_Init();
 
-  /* Initialize the Dataflash */
+  /* Initialize the Dataflash and identify the fitted part */
   Dataflash_DeselectChip();
+  Dataflash_DetectGeometry();
+
+  /* Name the board after the unique ID of its Dataflash, read once here as the host may ask for it at any time */
+  uint8_t SerialNumber[SERIAL_NUMBER_BYTES];
+  Dataflash_ReadUniqueID(SerialNumber, sizeof(SerialNumber));
+  SetSerialNumberString(SerialNumber);
+
+  /* Attach to the bus only once the serial number is in place */
+  USB_Init();
 }
 
 /** Resets all configured hardware required for the bootloader back to their original states. */
@@ -71,404 +312,1457 @@ void ResetHardware(void)
 
   /* Shut down protocols */
   USB_ShutDown();
-  SPI_ShutDown();
+  Dataflash_BusShutDown();
+  Timeout_ShutDown();
+}
+
+/** Task serving the DFU class request recorded by EVENT_USB_Device_UnhandledControlRequest(), from its data stage
+ *  through to its status stage. FLIP commands run inside it, so that their outcome is known by the time the request
+ *  completes. Once the host has turned on background commands, those without a data stage are handed over to
+ *  CommandTask() instead and the request is acknowledged straight away.
+ */
+uint8_t ControlTask(void)
+{
+  TASK_BEGIN(TaskState.Control);
+
+  if(controlRequest.bRequest == DFU_DNLOAD){
+    dataStageLeft = controlRequest.wLength;
+
+    /* Check if there's a FLIP command */
+    if(controlRequest.wLength){
+      /* Wait for the packet */
+      TASK_WAIT_TRANSFER(TaskState.Control, Endpoint_IsOUTReceived());
+
+      /* Retrieve the FLIP command */
+      flipCommand.group   = Endpoint_Read_Byte();
+      for(uint8_t i=0;i<5 && i<(controlRequest.wLength-1);i++)
+        flipCommand.data[i] = Endpoint_Read_Byte();
+
+#if !defined(NO_COMMAND_SCRIPTS)
+      /* A command script carries its commands in the rest of the packet */
+      if(flipCommand.group == CMD_GROUP_SCRIPT){
+        for(scriptLength=0;scriptLength<flipCommand.data[0] && scriptLength<SCRIPT_MAX_COMMANDS &&
+                           Endpoint_BytesInEndpoint()>=sizeof(USB_FLIP_Command_t);scriptLength++){
+          for(uint8_t i=0;i<sizeof(USB_FLIP_Command_t);i++)
+            ((uint8_t*)&scriptCommands[scriptLength])[i] = Endpoint_Read_Byte();
+        }
+      }
+#endif
+      ClearDataStageOUT();
+
+      /* If wLength is not 6 then it's a downlaod command, we discard the paddings and process it */
+      if(
+          (flipCommand.group == CMD_GROUP_DOWNLOAD) ||
+          IsBlankCheckCommand() ||
+          (flipCommand.group == CMD_GROUP_EXEC) ||
+          (flipCommand.group == CMD_GROUP_SELECT) ||
+          (flipCommand.group == CMD_GROUP_SCRIPT)
+        )
+        waitForSecondRequest = false;
+      else
+        waitForSecondRequest = true;
+
+      /* Process the command if not waiting for the second request */
+      if(!waitForSecondRequest){
+        if(flipCommand.group == CMD_GROUP_DOWNLOAD || !backgroundCommands){
+          /* The data follows in this request, or the host reads the outcome straight after it */
+          TASK_SPAWN(TaskState.Control, ProcessFlipCommand());
+
+          /* A download refused part way leaves packets behind, which the host must still be able to send */
+          TASK_SPAWN(TaskState.Control, DiscardDataStage());
+        }
+        else{
+          /* Run the command in the background, the host sees dfuDNBUSY until it has finished */
+          commandResumeState = DFU_State;
+          DFU_State = dfuDNBUSY;
+          runningTasks |= TASK_COMMAND;
+        }
+      }
+    }
+    /* DFU_DNLOAD with no data means it's a terminating signal */
+    else {
+      if(recordPending)
+        TASK_SPAWN(TaskState.Control, RecordApplication());
+
+      ResetHardware();
+      /* Start the user application */
+      AppStartPtr();
+    }
+  }
+  /* Blank checking is performed in the DFU_DNLOAD request - if we get here we've told the host
+     that the memory isn't blank, and the host is requesting the first non-blank address */
+  else if(controlRequest.bRequest == DFU_UPLOAD && IsBlankCheckCommand()){
+    /* Wait for the IN Ready */
+    TASK_WAIT_TRANSFER(TaskState.Control, Endpoint_IsINReady());
+
+    /* Write the first non-blank address */
+    Endpoint_Write_Word_LE((uint16_t)nonBlankAddr);
+
+    /* Finished this packet, ack the host */
+    Endpoint_ClearIN();
+  }
+#if !defined(NO_COMMAND_SCRIPTS)
+  /* After a command script the host reads back the index of the failing command, and the first non-blank address
+     in case it was a blank check */
+  else if(controlRequest.bRequest == DFU_UPLOAD && flipCommand.group == CMD_GROUP_SCRIPT){
+    /* Wait for the IN Ready */
+    TASK_WAIT_TRANSFER(TaskState.Control, Endpoint_IsINReady());
+
+    Endpoint_Write_Byte(scriptFailedCommand);
+    Endpoint_Write_Word_LE((uint16_t)nonBlankAddr);
+
+    /* Finished this packet, ack the host */
+    Endpoint_ClearIN();
+  }
+#endif
+  else if(controlRequest.bRequest == DFU_UPLOAD || controlRequest.bRequest == DFU_GETSTATUS){
+    /* We have received the command through the last DFU_DNLOAD, process it directly */
+    if(controlRequest.bRequest == DFU_UPLOAD)
+      TASK_SPAWN(TaskState.Control, ProcessFlipCommand());
+
+    /* Update the state */
+    UpdateState();
+    /* Wait for the IN Ready */
+    TASK_WAIT_TRANSFER(TaskState.Control, Endpoint_IsINReady());
+    /* 1 byte status value */
+    Endpoint_Write_Byte(DFU_Status);
+    /* 3 byte poll timeout value, only non zero while a command runs in the background */
+    Endpoint_Write_Byte((DFU_State == dfuDNBUSY) ? DFU_POLL_TIMEOUT_MS : 0);
+    Endpoint_Write_Byte(0);
+    Endpoint_Write_Byte(0);
+    /* 1 byte status value */
+    Endpoint_Write_Byte(DFU_State);
+    /* 1 byte state string ID number */
+    Endpoint_Write_Byte(0);
+    Endpoint_ClearIN();
+  }
+  else if(controlRequest.bRequest == DFU_CLRSTATUS || controlRequest.bRequest == DFU_ABORT){
+    DFU_State = dfuIDLE;
+    DFU_Status = OK;
+  }
+  else if(controlRequest.bRequest == DFU_GETSTATE){
+    /* Wait for the IN Ready */
+    TASK_WAIT_TRANSFER(TaskState.Control, Endpoint_IsINReady());
+    Endpoint_Write_Byte(DFU_State);
+    Endpoint_ClearIN();
+  }
+
+  /* Complete the status stage, in the opposite direction to the data stage */
+  if(controlRequest.bmRequestType & REQDIR_DEVICETOHOST){
+    TASK_WAIT_TRANSFER(TaskState.Control, Endpoint_IsOUTReceived());
+    Endpoint_ClearOUT();
+  }
+  else{
+    TASK_WAIT_TRANSFER(TaskState.Control, Endpoint_IsINReady());
+    Endpoint_ClearIN();
+  }
+
+  TASK_END(TaskState.Control);
+}
+
+/** Acknowledges the OUT packet of a DFU_DNLOAD data stage, if one has been received, and counts its bytes off
+ *  dataStageLeft. The last packet of the data stage may be a short one.
+ */
+void ClearDataStageOUT(void)
+{
+  if(!Endpoint_IsOUTReceived())
+    return;
+
+  dataStageLeft -= (dataStageLeft < FIXED_CONTROL_ENDPOINT_SIZE) ? dataStageLeft : FIXED_CONTROL_ENDPOINT_SIZE;
+  Endpoint_ClearOUT();
+}
+
+/** Task dropping the packets left in the DFU_DNLOAD data stage once the command has finished with it. A command
+ *  refused before, or part way through, its data leaves the rest unread, and the host would otherwise time out on
+ *  the request instead of reading the error through DFU_GETSTATUS.
+ */
+uint8_t DiscardDataStage(void)
+{
+  TASK_BEGIN(TaskState.Discard);
+
+  while(dataStageLeft){
+    TASK_WAIT_TRANSFER(TaskState.Discard, Endpoint_IsOUTReceived());
+    ClearDataStageOUT();
+  }
+
+  TASK_END(TaskState.Discard);
+}
+
+/** Task running a FLIP command which has no data stage, once its DFU_DNLOAD request has been acknowledged. Long
+ *  erases and blank checks no longer hold up the control endpoint, the host polls DFU_GETSTATUS meanwhile.
+ */
+uint8_t CommandTask(void)
+{
+  TASK_BEGIN(TaskState.Command);
+
+  TASK_SPAWN(TaskState.Command, ProcessFlipCommand());
+
+  /* Leave dfuDNBUSY unless the command has reported an error */
+  if(DFU_State == dfuDNBUSY)
+    DFU_State = commandResumeState;
+
+  TASK_END(TaskState.Command);
+}
+
+/** Abandons the control transfer ControlTask() is serving, either because the host has moved on to a new request
+ *  or because an endpoint wait has run past its deadline. The tasks serving it start from the top again, and a
+ *  FLIP command cut short returns the bootloader to dfuIDLE with errSTALLEDPKT for the host to read.
+ */
+void AbortControlTask(void)
+{
+  Timeout_Disarm();
+
+  if(!(runningTasks & TASK_CONTROL))
+    return;
+
+  runningTasks &= ~TASK_CONTROL;
+
+  /* Drop the OUT packet of the abandoned transfer, if any */
+  if(Endpoint_IsOUTReceived())
+    Endpoint_ClearOUT();
+
+  /* A command running in the background keeps its own resume points */
+  if(runningTasks & TASK_COMMAND){
+    TaskState.Control = 0;
+    return;
+  }
+
+  if(TaskState.Flip){
+    DFU_State  = dfuIDLE;
+    DFU_Status = errSTALLEDPKT;
+  }
+
+  /* Leave the Dataflash idle and deselected */
+  Dataflash_PumpFlush();
+  Dataflash_DeselectChip();
+
+  memset(&TaskState, 0, sizeof(TaskState));
+}
+
+/** Tells whether the last FLIP command is a blank check, whose first non-blank address is read by a DFU_UPLOAD. */
+bool IsBlankCheckCommand(void)
+{
+  return (flipCommand.group == CMD_GROUP_UPLOAD) &&
+         (flipCommand.data[0] == 0x01 ||  // Flash blank check
+          flipCommand.data[0] == 0x03 ||  // EEPROM blank check
+          flipCommand.data[0] == 0x11);   // Dataflash blank check
+}
+
+/** Tells whether the last FLIP command moves, checks or erases Dataflash data, which needs an identified part. */
+bool IsDataflashCommand(void)
+{
+  return (flipCommand.group == CMD_GROUP_DOWNLOAD || flipCommand.group == CMD_GROUP_UPLOAD ||
+          flipCommand.group == CMD_GROUP_EXEC) && (flipCommand.data[0] & 0x10);
+}
+
+/** Routine to process an issued command from the host, via a DFU_DNLOAD request wrapper. This routine ensures
+ *  that the command is allowed based on the current secure mode flag value, and passes the command off to the
+ *  appropriate handler task.
+ */
+uint8_t ProcessFlipCommand(void)
+{
+  TASK_BEGIN(TaskState.Flip);
+
+  if(IsDataflashCommand() && !DATAFLASH_IDENTIFIED){
+    DFU_State  = dfuERROR;
+    DFU_Status = errTARGET;
+  }
+  else if(flipCommand.group == CMD_GROUP_DOWNLOAD)
+    TASK_SPAWN(TaskState.Flip, ProcessDownload());
+  else if(flipCommand.group == CMD_GROUP_UPLOAD)
+    TASK_SPAWN(TaskState.Flip, ProcessUpload());
+  else if(flipCommand.group == CMD_GROUP_EXEC)
+    TASK_SPAWN(TaskState.Flip, ProcessExec());
+  else if(flipCommand.group == CMD_GROUP_READ)
+    TASK_SPAWN(TaskState.Flip, ProcessRead());
+  else if(flipCommand.group == CMD_GROUP_SELECT)
+    ProcessSelect();
+#if !defined(NO_COMMAND_SCRIPTS)
+  else if(flipCommand.group == CMD_GROUP_SCRIPT)
+    TASK_SPAWN(TaskState.Flip, ProcessScript());
+#else
+  else if(flipCommand.group == CMD_GROUP_SCRIPT){
+    DFU_State  = dfuERROR;
+    DFU_Status = errUNKNOWN;
+  }
+#endif
+
+  TASK_END(TaskState.Flip);
+}
+
+#if !defined(NO_COMMAND_SCRIPTS)
+
+/** Handler for a command script. The scripted commands run in order and the script stops at the first one which
+ *  leaves the bootloader in dfuERROR, whose index is kept for the host to read back through a DFU_UPLOAD.
+ */
+uint8_t ProcessScript(void)
+{
+  static USB_FLIP_Command_t scriptHeader;
+  static uint8_t curCommand;
+
+  TASK_BEGIN(TaskState.Script);
+
+  scriptHeader = flipCommand;
+  scriptFailedCommand = SCRIPT_NO_FAILURE;
+
+  /* The script must hold as many commands as its header announces */
+  if(!scriptHeader.data[0] || scriptHeader.data[0] != scriptLength){
+    DFU_State  = dfuERROR;
+    DFU_Status = errFILE;
+    scriptFailedCommand = 0;
+    TASK_EXIT(TaskState.Script);
+  }
+
+  for(curCommand=0;curCommand<scriptLength;curCommand++){
+    flipCommand = scriptCommands[curCommand];
+
+    if(IsDataflashCommand() && !DATAFLASH_IDENTIFIED){
+      DFU_State  = dfuERROR;
+      DFU_Status = errTARGET;
+    }
+    else if(IsBlankCheckCommand())
+      TASK_SPAWN(TaskState.Script, ProcessUpload());
+    else if(flipCommand.group == CMD_GROUP_EXEC)
+      TASK_SPAWN(TaskState.Script, ProcessExec());
+    else if(flipCommand.group == CMD_GROUP_SELECT)
+      ProcessSelect();
+    else{ /* Commands which move data need a request of their own */
+      DFU_State  = dfuERROR;
+      DFU_Status = errFILE;
+    }
+
+    if(DFU_State == dfuERROR){
+      scriptFailedCommand = curCommand;
+      break;
+    }
+  }
+
+  /* Leave the script as the last command, so that a DFU_UPLOAD reports on it */
+  flipCommand = scriptHeader;
+
+  TASK_END(TaskState.Script);
+}
+#endif
+
+/** Copies the back-end of the given memory into memory, see Memory_Backend_t. */
+void SelectMemory(uint8_t memoryID)
+{
+  memcpy_P(&memory, &MemoryBackends[memoryID], sizeof(Memory_Backend_t));
+
+  /* The Dataflash page size is only known once the fitted part has been identified */
+  if(memoryID == MEMORY_DATAFLASH)
+    memory.PageShift = DATAFLASH_PAGE_SHIFT;
+}
+
+/** Decodes the start and end addresses of the current memory command, the upper address bits coming from the
+ *  selected 64KB page.
+ */
+void GetCommandRange(uint32_t* startAddr, uint32_t* endAddr)
+{
+  *startAddr = ((uint32_t)curFlash64KBPageNumber << 16) | ((uint16_t)flipCommand.data[1] << 8) | flipCommand.data[2];
+  *endAddr   = ((uint32_t)curFlash64KBPageNumber << 16) | ((uint16_t)flipCommand.data[3] << 8) | flipCommand.data[4];
+}
+
+/** Handler for a Memory Program command issued by the host. This routine handles the preparations needed
+ *  to write subsequent data from the host into the specified memory.
+ */
+uint8_t ProcessDownload(void)
+{
+  static uint32_t curAddr;
+  static uint32_t lastAddr;
+  static uint16_t pageLeft;
+  static uint8_t  packetLeft;
+  static uint8_t  run;
+
+  TASK_BEGIN(TaskState.Download);
+
+  if(flipCommand.data[0] == 0x00 || flipCommand.data[0] == 0x01 || flipCommand.data[0] == 0x10){ // Init FLASH, EEPROM or External Dataflash programming
+    /* Enter download mode if in dfuIDLE, if not in dfuDNLOAD_IDLE then enter dfuERROR */
+    if(DFU_State != dfuIDLE){
+      DFU_State = dfuERROR;
+      TASK_EXIT(TaskState.Download);
+    }
+
+    SelectMemory((flipCommand.data[0] & 0x10) ? MEMORY_DATAFLASH : flipCommand.data[0]);
+    GetCommandRange(&curAddr, &lastAddr);
+
+    /* Memories programmed a page at a time take whole pages from the host */
+    if(memory.WholePages)
+      lastAddr |= ((uint16_t)1 << memory.PageShift) - 1;
+
+    if(memory.PrepareWrite)
+      TASK_SPAWN(TaskState.Download, memory.PrepareWrite(curAddr, lastAddr));
+    if(DFU_State == dfuERROR)
+      TASK_EXIT(TaskState.Download);
+
+    /* Track the transfer as an address plus the bytes left in its page, so that runs never cross a page boundary */
+    pageLeft = ((uint16_t)1 << memory.PageShift) - ((uint16_t)curAddr & (((uint16_t)1 << memory.PageShift) - 1));
+    if(memory.BeginPage)
+      TASK_SPAWN(TaskState.Download, memory.BeginPage(curAddr));
+
+    /* Start downloading the data */
+    while(DFU_State != dfuMANIFEST_SYNC){
+
+      /* Wait for the OUT packet */
+      TASK_WAIT_TRANSFER(TaskState.Download, Endpoint_IsOUTReceived());
+
+      /* Packet received, start reading the payload */
+      DFU_State = dfuDNBUSY;
+
+      /* Write the payload in runs which end at the packet, the page or the range boundary */
+      for(packetLeft=FIXED_CONTROL_ENDPOINT_SIZE;packetLeft;packetLeft-=run){
+        run = (pageLeft < packetLeft) ? pageLeft : packetLeft;
+        if(run > lastAddr - curAddr + 1)
+          run = lastAddr - curAddr + 1;
+
+        TASK_SPAWN(TaskState.Download, memory.Write(curAddr, run));
+        curAddr  += run;
+        pageLeft -= run;
+
+        /* Commit a page once its last byte, or the last byte of the range, has been written */
+        if(memory.EndPage && (!pageLeft || curAddr > lastAddr))
+          TASK_SPAWN(TaskState.Download, memory.EndPage(curAddr - 1));
+
+        /* This packet has been fully downloaded, change the state */
+        if(curAddr > lastAddr){
+          if(memory.FinishWrite)
+            TASK_SPAWN(TaskState.Download, memory.FinishWrite());
+
+          DFU_State = dfuMANIFEST_SYNC;
+          break;
+        }
+
+        /* Open the next page */
+        if(!pageLeft){
+          pageLeft = (uint16_t)1 << memory.PageShift;
+          if(memory.BeginPage)
+            TASK_SPAWN(TaskState.Download, memory.BeginPage(curAddr));
+        }
+      }
+
+      /* Finished this packet, ack the host */
+      ClearDataStageOUT();
+
+      /* change the state and wait for the host to solicit the status via DFU_GETSTATUS. */
+      if(DFU_State == dfuDNBUSY)
+        DFU_State = dfuDNLOAD_SYNC;
+    }
+  }
+#if !defined(NO_SCATTER_DOWNLOAD)
+  else if(flipCommand.data[0] == 0x03){ // Scatter download to FLASH
+    /* Enter download mode if in dfuIDLE, if not in dfuDNLOAD_IDLE then enter dfuERROR */
+    if(DFU_State != dfuIDLE){
+      DFU_State = dfuERROR;
+      TASK_EXIT(TaskState.Download);
+    }
+
+    /* The second command byte gives the number of ranges described at the start of the data */
+    if(!flipCommand.data[1] || flipCommand.data[1] > SCATTER_MAX_RANGES){
+      DFU_State  = dfuERROR;
+      DFU_Status = errFILE;
+      TASK_EXIT(TaskState.Download);
+    }
+
+    SetApplicationValid(false);
+    recordPending = false;
+    TASK_SPAWN(TaskState.Download, ApplyScatter(flipCommand.data[1]));
+  }
+#endif
+#if !defined(NO_DELTA_DOWNLOAD)
+  else if(flipCommand.data[0] == 0x02 || flipCommand.data[0] == 0x12){ // Apply delta patch to FLASH (0x12: staged through Dataflash)
+    /* Enter download mode if in dfuIDLE, if not in dfuDNLOAD_IDLE then enter dfuERROR */
+    if(DFU_State != dfuIDLE){
+      DFU_State = dfuERROR;
+      TASK_EXIT(TaskState.Download);
+    }
+
+    GetCommandRange(&curAddr, &lastAddr);
+
+    /* The rebuilt image must stay within the application section */
+    if(lastAddr < curAddr || lastAddr >= BOOT_START_ADDR){
+      DFU_State  = dfuERROR;
+      DFU_Status = errADDRESS;
+      TASK_EXIT(TaskState.Download);
+    }
+
+    TASK_SPAWN(TaskState.Download, Flash_PrepareWrite(curAddr, lastAddr));
+
+    /* Snapshot the installed image first if the copy operations may refer to pages we are about to overwrite */
+    if(flipCommand.data[0] == 0x12)
+      TASK_SPAWN(TaskState.Download, StageInstalledImage());
+
+    TASK_SPAWN(TaskState.Download, ApplyDelta(curAddr, lastAddr, flipCommand.data[0] == 0x12));
+  }
+#endif
+  else{ // Download not known to this build
+    DFU_State  = dfuERROR;
+    DFU_Status = errUNKNOWN;
+  }
+
+  /* A flash image which arrived completely is recorded as the bootloader is left, so that it may be started
+     straight from reset */
+  if(DFU_State == dfuMANIFEST_SYNC && flipCommand.data[0] != 0x01 && flipCommand.data[0] != 0x10)
+    recordPending = true;
+
+  TASK_END(TaskState.Download);
+}
+
+#if !defined(NO_DELTA_DOWNLOAD)
+/** Copies the whole application section into the Dataflash staging area, so that a staged delta patch can
+ *  keep copying from the installed image after its flash pages have been rewritten.
+ */
+uint8_t StageInstalledImage(void)
+{
+  static uint16_t curAddr;
+  static uint16_t page;
+
+  TASK_BEGIN(TaskState.Stage);
+
+  for(curAddr=0;curAddr<BOOT_START_ADDR;curAddr+=DATAFLASH_PAGE_SIZE){
+    page = DELTA_STAGING_PAGE + (curAddr >> DATAFLASH_PAGE_SHIFT);
+
+    /* Fill buffer 1 of the chip holding the staging page with the next page of the installed image */
+    Dataflash_SelectChipFromPage(page);
+    TASK_WAIT_UNTIL(TaskState.Stage, !Dataflash_IsBusy());
+    Dataflash_Configure_Write_Page_Offset(DF_CMD_BUFF1WRITE, page, 0);
+    for(uint16_t i=0;i<DATAFLASH_PAGE_SIZE;i++)
+      Dataflash_SendByte(pgm_read_byte(curAddr+i));
+
+    /* Write the Dataflash buffer contents back to the staging page, the chip programs it in the background */
+    Dataflash_ToggleSelectedChipCS();
+    Dataflash_Configure_Write_Page_Offset(DF_CMD_BUFF1TOMAINMEMWITHERASE, page, 0);
+    Dataflash_DeselectChip();
+  }
+
+  /* Wait for the last pages to be programmed */
+  TASK_WAIT_UNTIL(TaskState.Stage, !Dataflash_IsAnyBusy());
+
+  TASK_END(TaskState.Stage);
+}
+#endif
+
+#if defined(PAGE_BUFFER_DOWNLOADS)
+/** Tells whether the next byte of the current DFU_DNLOAD data stage can be read. Drained OUT packets are
+ *  acknowledged so that the host sends the next one, and the records of a delta stream may straddle packets.
+ */
+bool IsStreamByteReady(void)
+{
+  if(!Endpoint_IsOUTReceived())
+    return false;
+
+  if(Endpoint_BytesInEndpoint())
+    return true;
+
+  ClearDataStageOUT();
+  return false;
+}
+
+/** Loads the current contents of the flash page at pageAddr into the page buffer. */
+void LoadPageBuffer(uint16_t pageAddr)
+{
+  pageBufferAddr = pageAddr;
+
+  for(uint8_t i=0;i<SPM_PAGESIZE;i++)
+    pageBuffer[i] = pgm_read_byte(pageAddr + i);
+}
+
+/** Erases the flash page loaded by LoadPageBuffer(), refills it from the page buffer and commits it. */
+uint8_t CommitPageBuffer(void)
+{
+  TASK_BEGIN(TaskState.Commit);
+
+  boot_page_erase(pageBufferAddr);
+  TASK_WAIT_UNTIL(TaskState.Commit, !boot_spm_busy());
+  for(uint8_t i=0;i<SPM_PAGESIZE;i+=2)
+    boot_page_fill(pageBufferAddr+i, pageBuffer[i] | ((uint16_t)pageBuffer[i+1] << 8));
+  boot_page_write(pageBufferAddr);
+  TASK_WAIT_UNTIL(TaskState.Commit, !boot_spm_busy());
+
+  /* Re-enable the RWW section of flash as writing to the flash locks it out */
+  boot_rww_enable();
+
+  TASK_END(TaskState.Commit);
+}
+#endif
+
+#if !defined(NO_SCATTER_DOWNLOAD)
+/** Programs the flash ranges of a scatter download. The data stage opens with rangeCount descriptors, then carries
+ *  the data of every range back to back. Only the pages holding range data are rewritten, and the bytes of those
+ *  pages which fall in the gaps between ranges keep their current contents.
+ */
+uint8_t ApplyScatter(uint8_t rangeCount)
+{
+  static Scatter_Range_t ranges[SCATTER_MAX_RANGES];
+  static uint8_t  curRange;
+  static uint8_t  descLeft;
+  static uint16_t curAddr;
+  static uint16_t bytesLeft;
+  static bool     pageLoaded;
+
+  TASK_BEGIN(TaskState.Scatter);
+
+  pageLoaded = false;
+
+  /* Wait for the first OUT packet */
+  TASK_WAIT_TRANSFER(TaskState.Scatter, Endpoint_IsOUTReceived());
+
+  /* Packet received, start reading the descriptors */
+  DFU_State = dfuDNBUSY;
+
+  for(descLeft=rangeCount*sizeof(Scatter_Range_t);descLeft;descLeft--){
+    TASK_WAIT_TRANSFER(TaskState.Scatter, IsStreamByteReady());
+    ((uint8_t*)ranges)[rangeCount*sizeof(Scatter_Range_t) - descLeft] = Endpoint_Read_Byte();
+  }
+
+  /* The ranges arrive big endian and must be ascending, non-empty and within the application section */
+  for(uint8_t i=0;i<rangeCount;i++){
+    ranges[i].Start  = SwapEndian_16(ranges[i].Start);
+    ranges[i].Length = SwapEndian_16(ranges[i].Length);
+
+    if(!ranges[i].Length || ranges[i].Start >= BOOT_START_ADDR || ranges[i].Length > BOOT_START_ADDR - ranges[i].Start ||
+       (i && ranges[i].Start < ranges[i-1].Start + ranges[i-1].Length)){
+      DFU_State  = dfuERROR;
+      DFU_Status = errADDRESS;
+      rangeCount = 0;
+      break;
+    }
+  }
+
+  /* The pages about to be programmed are no longer known to be erased */
+  for(curRange=0;curRange<rangeCount;curRange++){
+    TASK_SPAWN(TaskState.Scatter, UpdateFlashBitmap(ranges[curRange].Start / SPM_PAGESIZE,
+                                                    (ranges[curRange].Start + ranges[curRange].Length - 1) / SPM_PAGESIZE, false));
+  }
+
+  for(curRange=0;curRange<rangeCount;curRange++){
+    curAddr   = ranges[curRange].Start;
+    bytesLeft = ranges[curRange].Length;
+
+    while(bytesLeft){
+      /* Commit the page being assembled once the range moves on past it, ranges sharing a page are merged */
+      if(!pageLoaded || (curAddr & ~(SPM_PAGESIZE-1)) != pageBufferAddr){
+        if(pageLoaded)
+          TASK_SPAWN(TaskState.Scatter, CommitPageBuffer());
+
+        LoadPageBuffer(curAddr & ~(SPM_PAGESIZE-1));
+        pageLoaded = true;
+      }
+
+      TASK_WAIT_TRANSFER(TaskState.Scatter, IsStreamByteReady());
+
+      /* Copy the bytes at hand, up to the end of the packet, the range or the page */
+      uint16_t run = SPM_PAGESIZE - (curAddr & (SPM_PAGESIZE-1));
+      if(run > bytesLeft)
+        run = bytesLeft;
+      if(run > Endpoint_BytesInEndpoint())
+        run = Endpoint_BytesInEndpoint();
+
+      bytesLeft -= run;
+      while(run--)
+        pageBuffer[curAddr++ & (SPM_PAGESIZE-1)] = Endpoint_Read_Byte();
+    }
+  }
+
+  /* Commit the last page */
+  if(pageLoaded)
+    TASK_SPAWN(TaskState.Scatter, CommitPageBuffer());
+
+  /* Finished the scatter stream, ack the host */
+  ClearDataStageOUT();
+
+  /* change the state and wait for the host to solicit the status via DFU_GETSTATUS. */
+  if(DFU_State == dfuDNBUSY)
+    DFU_State = dfuMANIFEST_SYNC;
+
+  TASK_END(TaskState.Scatter);
+}
+#endif
+
+#if !defined(NO_DELTA_DOWNLOAD)
+/** Rebuilds the flash range [startAddr, endAddr] from the installed image plus the delta stream sent by the host.
+ *  Each flash page is assembled in SRAM, starting from its current contents, and committed once it is complete.
+ *  When staged is set, copy operations read the installed image from the Dataflash staging area, otherwise they
+ *  read the flash directly and the host must not copy from pages which have already been rewritten.
+ */
+uint8_t ApplyDelta(uint16_t startAddr, uint16_t endAddr, bool staged)
+{
+  static uint16_t curAddr;
+  static uint16_t srcAddr;
+  static uint16_t length;
+  static uint8_t  opcode;
+
+  TASK_BEGIN(TaskState.Delta);
+
+  curAddr = startAddr;
+  srcAddr = 0;
+
+  /* Load the current contents of the first page */
+  LoadPageBuffer(curAddr & ~(SPM_PAGESIZE-1));
+
+  /* Wait for the first OUT packet */
+  TASK_WAIT_TRANSFER(TaskState.Delta, Endpoint_IsOUTReceived());
+
+  /* Packet received, start reading the delta records */
+  DFU_State = dfuDNBUSY;
+
+  while(curAddr <= endAddr){
+    TASK_WAIT_TRANSFER(TaskState.Delta, IsStreamByteReady());
+    opcode = Endpoint_Read_Byte();
+
+    if(opcode == DELTA_OP_COPY){
+      TASK_WAIT_TRANSFER(TaskState.Delta, IsStreamByteReady());
+      srcAddr  = (uint16_t)Endpoint_Read_Byte() << 8;
+      TASK_WAIT_TRANSFER(TaskState.Delta, IsStreamByteReady());
+      srcAddr |= Endpoint_Read_Byte();
+    }
+
+    TASK_WAIT_TRANSFER(TaskState.Delta, IsStreamByteReady());
+    length  = (uint16_t)Endpoint_Read_Byte() << 8;
+    TASK_WAIT_TRANSFER(TaskState.Delta, IsStreamByteReady());
+    length |= Endpoint_Read_Byte();
+
+    /* Reject unknown records and records running past the end of the image */
+    if((opcode != DELTA_OP_COPY && opcode != DELTA_OP_INSERT) || length > (endAddr - curAddr + 1) ||
+       (opcode == DELTA_OP_COPY && (srcAddr >= BOOT_START_ADDR || length > BOOT_START_ADDR - srcAddr))){
+      DFU_State  = dfuERROR;
+      DFU_Status = errFILE;
+      break;
+    }
+
+    /* Point the Dataflash at the staged copy of the source range */
+    if(opcode == DELTA_OP_COPY && staged){
+      Dataflash_SelectChipFromPage(DELTA_STAGING_PAGE + (srcAddr >> DATAFLASH_PAGE_SHIFT));
+      Dataflash_Configure_Read_Page_Offset(DF_CMD_CONTARRAYREAD_LF, DELTA_STAGING_PAGE + (srcAddr >> DATAFLASH_PAGE_SHIFT), srcAddr & DATAFLASH_PAGE_MASK);
+    }
+
+    for(;length;length--){
+      /* Fetch the next byte of the new image */
+      if(opcode == DELTA_OP_INSERT){
+        TASK_WAIT_TRANSFER(TaskState.Delta, IsStreamByteReady());
+        pageBuffer[curAddr & (SPM_PAGESIZE-1)] = Endpoint_Read_Byte();
+      }
+      else if(staged){
+        /* Restart the read on each new page unless the next used byte follows on in the same chip */
+        if(!DATAFLASH_PAGES_CONTIGUOUS && (srcAddr & DATAFLASH_PAGE_MASK)==0){
+          Dataflash_SelectChipFromPage(DELTA_STAGING_PAGE + (srcAddr >> DATAFLASH_PAGE_SHIFT));
+          Dataflash_Configure_Read_Page_Offset(DF_CMD_CONTARRAYREAD_LF, DELTA_STAGING_PAGE + (srcAddr >> DATAFLASH_PAGE_SHIFT), 0);
+        }
+        pageBuffer[curAddr & (SPM_PAGESIZE-1)] = Dataflash_ReceiveByte();
+        srcAddr++;
+      }
+      else{
+        pageBuffer[curAddr & (SPM_PAGESIZE-1)] = pgm_read_byte(srcAddr++);
+      }
+
+      /* See if we've finished a page, if so we commit it and load the current contents of the next one */
+      if((curAddr & (SPM_PAGESIZE-1)) == (SPM_PAGESIZE-1) || curAddr == endAddr){
+        /* Erase the page, refill it from the page buffer and commit it */
+        TASK_SPAWN(TaskState.Delta, CommitPageBuffer());
+
+        if(curAddr != endAddr)
+          LoadPageBuffer(pageBufferAddr + SPM_PAGESIZE);
+      }
+
+      curAddr++;
+    }
+
+    /* Deselect the dataflash */
+    if(opcode == DELTA_OP_COPY && staged)
+      Dataflash_DeselectChip();
+  }
+
+  /* Finished the delta stream, ack the host */
+  ClearDataStageOUT();
+
+  /* change the state and wait for the host to solicit the status via DFU_GETSTATUS. */
+  if(DFU_State == dfuDNBUSY)
+    DFU_State = dfuMANIFEST_SYNC;
+
+  TASK_END(TaskState.Delta);
 }
+#endif
 
-/** Routine to process an issued command from the host, via a DFU_DNLOAD request wrapper. This routine ensures
- *  that the command is allowed based on the current secure mode flag value, and passes the command off to the
- *  appropriate handler function.
+/** Moves count bytes from the control endpoint into the selected Dataflash. The next byte is fetched from the
+ *  endpoint while the previous one is still shifting out, so the SPI runs close to its line rate.
  */
-void ProcessFlipCommand()
+void Dataflash_PumpFromEndpoint(uint8_t count)
 {
-  switch (flipCommand.group) {
-    case CMD_GROUP_DOWNLOAD:
-      ProcessDownload();
-      break;
-    case CMD_GROUP_UPLOAD:
-      ProcessUpload();
-      break;
-    case CMD_GROUP_EXEC:
-      ProcessExec();
-      break;
-    case CMD_GROUP_READ:
-      ProcessRead();
-      break;
-    case CMD_GROUP_SELECT:
-      ProcessSelect();
-      break;
+  if(!count)
+    return;
+
+#if defined(DATAFLASH_USE_USART_SPI)
+  /* The transmitter is double buffered, so keep it topped up and let the clocked back bytes drop */
+  UCSR1A |= _BV(TXC1);
+
+  while(count--){
+    uint8_t nextByte = Endpoint_Read_Byte();
+    while(!(UCSR1A & _BV(UDRE1))){};
+    UDR1 = nextByte;
+  }
+
+  /* Wait for the last byte to leave the shift register and drain the receiver */
+  while(!(UCSR1A & _BV(TXC1))){};
+  while(UCSR1A & _BV(RXC1))
+    (void)UDR1;
+#elif defined(DATAFLASH_USE_SPI_ENGINE)
+  /* Stage the run in SRAM while the engine may still be draining the previous one from the other buffer */
+  static uint8_t packetBuffer[2][FIXED_CONTROL_ENDPOINT_SIZE];
+  static uint8_t curBuffer = 0;
+  uint8_t* buffer = packetBuffer[curBuffer];
+
+  for(uint8_t i=0;i<count;i++)
+    buffer[i] = Endpoint_Read_Byte();
+
+  /* Hand the run to the SPI interrupt, which moves it while the next packet is fetched */
+  SPIEngine_Wait();
+  SPIEngine_Start(buffer, count);
+  curBuffer ^= 1;
+#else
+  uint8_t nextByte = Endpoint_Read_Byte();
+
+  while(--count){
+    SPDR     = nextByte;
+    nextByte = Endpoint_Read_Byte();
+    while(!(SPSR & _BV(SPIF))){};
   }
+
+  SPDR = nextByte;
+  while(!(SPSR & _BV(SPIF))){};
+#endif
 }
 
-/** Handler for a Memory Program command issued by the host. This routine handles the preparations needed
- *  to write subsequent data from the host into the specified memory.
+/** Waits for the bytes handed to Dataflash_PumpFromEndpoint() to reach the Dataflash. Must be called before the
+ *  chip select changes, as the SPI engine may still be moving them in the background.
  */
-void ProcessDownload(void)
+void Dataflash_PumpFlush(void)
 {
-  if(flipCommand.data[0] == 0x00){ // Init FLASH programming
-    /* Enter download mode if in dfuIDLE, if not in dfuDNLOAD_IDLE then enter dfuERROR */
-    if(DFU_State != dfuIDLE){
-      DFU_State = dfuERROR;
-      return;
-    }
-    else{
-      uint16_t startAddr = ((uint16_t)flipCommand.data[1] << 8) | (uint16_t)flipCommand.data[2];
-      uint16_t endAddr   = ((uint16_t)flipCommand.data[3] << 8) | (uint16_t)flipCommand.data[4];
-      uint16_t curAddr   = startAddr;
+#if defined(DATAFLASH_USE_SPI_ENGINE)
+  SPIEngine_Wait();
+#endif
+}
+
+/** Moves count bytes from the selected Dataflash into the control endpoint. The next byte is clocked in while the
+ *  previous one is written to the endpoint. No byte is clocked past the last one, so continuous reads stay in step.
+ */
+void Dataflash_PumpToEndpoint(uint8_t count)
+{
+  if(!count)
+    return;
+
+#if defined(DATAFLASH_USE_USART_SPI)
+  /* Keep up to two bytes in flight, one shifting and one waiting in the transmit buffer */
+  uint8_t toClock = count;
+
+  while(!(UCSR1A & _BV(UDRE1))){};
+  UDR1 = 0x00;
+  if(--toClock){
+    while(!(UCSR1A & _BV(UDRE1))){};
+    UDR1 = 0x00;
+    toClock--;
+  }
 
-      /* Start downloading the firmware */
-      while(DFU_State != dfuMANIFEST_SYNC){
+  while(count--){
+    while(!(UCSR1A & _BV(RXC1))){};
+    uint8_t curByte = UDR1;
 
-        /* Wait for the OUT packet */
-        while(!Endpoint_IsOUTReceived()){};
+    if(toClock){
+      while(!(UCSR1A & _BV(UDRE1))){};
+      UDR1 = 0x00;
+      toClock--;
+    }
 
-        /* Packet received, start reading the payload */
-        DFU_State = dfuDNBUSY;
+    Endpoint_Write_Byte(curByte);
+  }
+#else
+  SPDR = 0x00;
+
+  while(--count){
+    while(!(SPSR & _BV(SPIF))){};
+    uint8_t curByte = SPDR;
+    SPDR = 0x00;
+    Endpoint_Write_Byte(curByte);
+  }
 
-        for(uint8_t i=0;i<FIXED_CONTROL_ENDPOINT_SIZE;i+=2,curAddr+=2){
+  while(!(SPSR & _BV(SPIF))){};
+  Endpoint_Write_Byte(SPDR);
+#endif
+}
 
-          /* See if it's a new page, if so we commit for the last page and erase the current one */
-          if (curAddr%SPM_PAGESIZE==0) {
-            
-            /* Erase the current page */
-            boot_page_erase(curAddr); boot_spm_busy_wait();
+/** Handler for a Memory Read command issued by the host. This routine handles the preparations needed
+ *  to read subsequent data from the specified memory out to the host, as well as implementing the memory
+ *  blank check command.
+ */
+uint8_t ProcessUpload(void)
+{
+  static uint32_t curAddr;
+  static uint32_t endAddr;
+  static uint16_t curPage;
+  static uint16_t lastPage;
+  static uint16_t pagesLeft;
+  static uint16_t pageLeft;
+  static uint16_t run;
 
-            /* Commit the last page */
-            if(curAddr!=startAddr)
-              boot_page_write(curAddr-2); boot_spm_busy_wait();
+  TASK_BEGIN(TaskState.Upload);
 
-            /* Re-enable the RWW section of flash as writing to the flash locks it out */
-            boot_rww_enable();
+  GetCommandRange(&curAddr, &endAddr);
 
-            /* This packet has been fully downloaded, change the state */
-            if(curAddr > endAddr){
-              DFU_State = dfuMANIFEST_SYNC;
-              break;
-            }
-          }
+  if (IsBlankCheckCommand()) { // Blank Check in FLASH (0x01), EEPROM (0x03) or Dataflash (0x11)
+    SelectMemory((flipCommand.data[0] & 0x10) ? MEMORY_DATAFLASH : (flipCommand.data[0] >> 1));
 
-          /* Write the next word into the current flash page */
-          boot_page_fill(curAddr, Endpoint_Read_Word_LE());
-        }
+    /* Check the range in runs which end at the page boundary */
+    for(;curAddr<endAddr;curAddr+=run){
+      run = ((uint16_t)1 << memory.PageShift) - ((uint16_t)curAddr & (((uint16_t)1 << memory.PageShift) - 1));
+      if (run > endAddr - curAddr)
+        run = endAddr - curAddr;
 
-        /* Finished this packet, ack the host */
-        Endpoint_ClearOUT(); 
+      /* Pages known to be erased are not read */
+      if (memory.IsPageErased && memory.IsPageErased(curAddr >> memory.PageShift))
+        continue;
 
-        /* change the state and wait for the host to solicit the status via DFU_GETSTATUS. */
-        if(DFU_State == dfuDNBUSY)
-          DFU_State = dfuDNLOAD_SYNC;
+      uint16_t offset = memory.FindNonBlank(curAddr, run);
+      if (offset < run) { // Found a non-blank byte
+        DFU_State  = dfuERROR;
+        DFU_Status = errCHECK_ERASED;
+        nonBlankAddr = curAddr + offset;
+        break;
       }
+
+      /* Let the USB stack run between pages */
+      TASK_YIELD(TaskState.Upload);
     }
   }
-  else if(flipCommand.data[0] == 0x01){ // Init EEPROM programming
+  else if (flipCommand.data[0] == 0x00 || flipCommand.data[0] == 0x02 || flipCommand.data[0] == 0x10) { // Display FLASH, EEPROM or External Dataflash Data
     /* Enter download mode if in dfuIDLE, if not in dfuDNLOAD_IDLE then enter dfuERROR */
     if(DFU_State != dfuIDLE){
       DFU_State = dfuERROR;
-      return;
+      TASK_EXIT(TaskState.Upload);
     }
-    else{
-      uint16_t startAddr = ((uint16_t)flipCommand.data[1] << 8) | (uint16_t)flipCommand.data[2];
-      uint16_t endAddr   = ((uint16_t)flipCommand.data[3] << 8) | (uint16_t)flipCommand.data[4];
-      uint16_t curAddr   = startAddr;
 
-      /* Start downloading the EEPROM data */
-      while(DFU_State != dfuMANIFEST_SYNC){
+    SelectMemory((flipCommand.data[0] & 0x10) ? MEMORY_DATAFLASH : (flipCommand.data[0] >> 1));
 
-        /* Wait for the OUT packet */
-        while(!Endpoint_IsOUTReceived()){};
+    /* Track the transfer as an address plus the bytes left in its page, so that runs never cross a page boundary */
+    pageLeft = ((uint16_t)1 << memory.PageShift) - ((uint16_t)curAddr & (((uint16_t)1 << memory.PageShift) - 1));
+    if(memory.Seek)
+      memory.Seek(curAddr);
 
-        /* Packet received, start reading the payload */
-        DFU_State = dfuDNBUSY;
+    /* Change the state */
+    DFU_State = dfuUPLOAD_IDLE;
 
-        for(uint8_t i=0;i<FIXED_CONTROL_ENDPOINT_SIZE;i++,curAddr++){
+    /* Start uploading the data */
+    while(curAddr < endAddr){
 
-          /* This packet has been fully downloaded, change the state */
-          if(curAddr > endAddr){
-            DFU_State = dfuMANIFEST_SYNC;
-            break;
-          }
+      /* Wait for the IN Ready */
+      TASK_WAIT_TRANSFER(TaskState.Upload, Endpoint_IsINReady());
 
-          /* Read the byte from the USB interface and write to to the EEPROM */
-          eeprom_write_byte((uint8_t*)curAddr, Endpoint_Read_Byte());
-          eeprom_busy_wait();
-        }
+      /* Write the next bytes into the endpoint, in runs which end at the packet or the page boundary */
+      for(uint8_t packetLeft=FIXED_CONTROL_ENDPOINT_SIZE;packetLeft;packetLeft-=run){
+        run = (pageLeft < packetLeft) ? pageLeft : packetLeft;
 
-        /* Finished this packet, ack the host */
-        Endpoint_ClearOUT(); 
+        memory.Read(curAddr, run);
+        curAddr  += run;
+        pageLeft -= run;
 
-        /* change the state and wait for the host to solicit the status via DFU_GETSTATUS. */
-        if(DFU_State == dfuDNBUSY)
-          DFU_State = dfuDNLOAD_SYNC;
+        if(!pageLeft)
+          pageLeft = (uint16_t)1 << memory.PageShift;
       }
+
+      /* Finished this packet, ack the host */
+      Endpoint_ClearIN();
     }
+
+    /* Deselect the dataflash, in case it was the memory read */
+    Dataflash_DeselectChip();
   }
-  else if(flipCommand.data[0] == 0x10){ // Init External Dataflash programming
+  else if (flipCommand.data[0] == 0x04 || flipCommand.data[0] == 0x14) { // Page hashes of FLASH (0x04) or Dataflash (0x14)
     /* Enter download mode if in dfuIDLE, if not in dfuDNLOAD_IDLE then enter dfuERROR */
     if(DFU_State != dfuIDLE){
       DFU_State = dfuERROR;
-      return;
+      TASK_EXIT(TaskState.Upload);
+    }
+
+    /* One hash per page holding a byte of the range, the end address is inclusive */
+    if(flipCommand.data[0] == 0x04){
+      curPage  = curAddr / SPM_PAGESIZE;
+      lastPage = endAddr / SPM_PAGESIZE;
     }
     else{
-      uint32_t startAddr = ((uint32_t)curFlash64KBPageNumber << 16) | ((uint32_t)flipCommand.data[1] << 8) | (uint32_t)flipCommand.data[2];
-      uint32_t endAddr   = ((uint32_t)curFlash64KBPageNumber << 16) | ((uint32_t)flipCommand.data[3] << 8) | (uint32_t)flipCommand.data[4];
-      uint32_t curAddr   = startAddr;
-
-      /* Since we only have one dataflash, we always enable CHIP1 */
-      Dataflash_SelectChip(DATAFLASH_CHIP1);
-
-      /* Enter buffer 1 write mode */
-      Dataflash_Configure_Write_Page_Offset(DF_CMD_BUFF1WRITE, curAddr/DATAFLASH_PAGE_SIZE, curAddr%DATAFLASH_PAGE_SIZE);
-
-      /* Start downloading the firmware */
-      while(DFU_State != dfuMANIFEST_SYNC){
-
-        /* Wait for the OUT packet */
-        while(!Endpoint_IsOUTReceived()){};
-
-        /* Packet received, start reading the payload */
-        DFU_State = dfuDNBUSY;
-
-        /* Start receiving the firmware */
-        for(uint8_t i=0;i<FIXED_CONTROL_ENDPOINT_SIZE;i++,curAddr++){
-
-          /* See if we've finished a page, if so we commit for the page */
-          if (curAddr!=startAddr && curAddr%DATAFLASH_PAGE_SIZE==0) {
-            /* Write the Dataflash buffer contents back to the Dataflash page */
-            Dataflash_ToggleSelectedChipCS();
-            Dataflash_Configure_Write_Page_Offset(DF_CMD_BUFF1TOMAINMEMWITHERASE, (curAddr/DATAFLASH_PAGE_SIZE)-1, 0);
-            Dataflash_ToggleSelectedChipCS();
-            Dataflash_WaitWhileBusy();
-
-            /* This packet has been fully downloaded */
-            if(curAddr > endAddr){
-              /* Deselect the dataflash */
-              Dataflash_DeselectChip();
-
-              /* Change the state */
-              DFU_State = dfuMANIFEST_SYNC;
-              break;
-            } else { /* Return to buffer 1 write mode */
-              Dataflash_Configure_Write_Page_Offset(DF_CMD_BUFF1WRITE, curAddr/DATAFLASH_PAGE_SIZE, 0);
-            }
-          }
-
-          /* Write the next word into the current flash page */
-          Dataflash_SendByte(Endpoint_Read_Byte());
-        }
+      curPage  = curAddr >> DATAFLASH_PAGE_SHIFT;
+      lastPage = endAddr >> DATAFLASH_PAGE_SHIFT;
+    }
 
-        /* Finished this packet, ack the host */
-        Endpoint_ClearOUT(); 
+    /* Count the pages rather than compare against the last one, which may be the very last page of the memory */
+    pagesLeft = (endAddr >= curAddr) ? (lastPage - curPage + 1) : 0;
 
-        /* change the state and wait for the host to solicit the status via DFU_GETSTATUS. */
-        if(DFU_State == dfuDNBUSY)
-          DFU_State = dfuDNLOAD_SYNC;
-      }
+    /* Change the state */
+    DFU_State = dfuUPLOAD_IDLE;
+
+    /* Start uploading the hashes */
+    while(pagesLeft){
+
+      /* Wait for the IN Ready */
+      TASK_WAIT_TRANSFER(TaskState.Upload, Endpoint_IsINReady());
+
+      /* Write the hashes of the next pages into the endpoint */
+      for(uint8_t i=0;i<FIXED_CONTROL_ENDPOINT_SIZE && pagesLeft;i+=2,curPage++,pagesLeft--)
+        Endpoint_Write_Word_LE((flipCommand.data[0] == 0x04) ? HashFlashPage(curPage) : HashDataflashPage(curPage));
+
+      /* Finished this packet, ack the host */
+      Endpoint_ClearIN();
     }
   }
+
+  TASK_END(TaskState.Upload);
 }
 
-/** Handler for a Memory Read command issued by the host. This routine handles the preparations needed
- *  to read subsequent data from the specified memory out to the host, as well as implementing the memory
- *  blank check command.
+/** Marks the application as no longer startable and the flash pages firstAddr to lastAddr as possibly programmed.
+ *  Ranges reaching into the boot section, or starting at an odd address, which Flash_Write() cannot fill a whole
+ *  word at, are refused.
  */
-void ProcessUpload(void)
+uint8_t Flash_PrepareWrite(uint32_t firstAddr, uint32_t lastAddr)
 {
-  if (flipCommand.data[0] == 0x00) { // Display FLASH Data
-    /* Enter download mode if in dfuIDLE, if not in dfuDNLOAD_IDLE then enter dfuERROR */
-    if(DFU_State != dfuIDLE){
-      DFU_State = dfuERROR;
-      return;
-    }
-    else{
-      uint16_t startAddr = ((uint16_t)flipCommand.data[1] << 8) | (uint16_t)flipCommand.data[2];
-      uint16_t endAddr   = ((uint16_t)flipCommand.data[3] << 8) | (uint16_t)flipCommand.data[4];
-      uint16_t curAddr   = startAddr;
+  TASK_BEGIN(TaskState.Memory);
 
-      /* Change the state */
-      DFU_State = dfuUPLOAD_IDLE;
+  if(lastAddr >= BOOT_START_ADDR || (firstAddr & 0x01)){
+    DFU_State  = dfuERROR;
+    DFU_Status = errADDRESS;
+    TASK_EXIT(TaskState.Memory);
+  }
 
-      /* Start uploading the data */
-      while(curAddr < endAddr){
+  /* The application cannot be started at reset until the new image is complete, and the pages about to be
+     programmed are no longer known to be erased */
+  SetApplicationValid(false);
+  recordPending = false;
+  TASK_SPAWN(TaskState.Memory, UpdateFlashBitmap(firstAddr / SPM_PAGESIZE, lastAddr / SPM_PAGESIZE, false));
 
-        /* Wait for the IN Ready */
-        while(!Endpoint_IsINReady()){};
+  TASK_END(TaskState.Memory);
+}
 
-        /* Write the next word into the endpoint */
-        for(uint8_t i=0;i<FIXED_CONTROL_ENDPOINT_SIZE;i+=2,curAddr+=2)
-          Endpoint_Write_Word_LE(pgm_read_word(curAddr));
+/** Fills a run of words from the control endpoint into the flash page buffer. */
+uint8_t Flash_Write(uint32_t addr, uint8_t count)
+{
+  for(;count;count-=2,addr+=2)
+    boot_page_fill(addr, Endpoint_Read_Word_LE());
 
-        /* Finished this packet, ack the host */
-        Endpoint_ClearIN(); 
-      }
-    }
+  return TASK_DONE;
+}
+
+/** Erases the flash page holding addr and programs it from the page buffer. */
+uint8_t Flash_EndPage(uint32_t addr)
+{
+  TASK_BEGIN(TaskState.Memory);
+
+  boot_page_erase(addr);
+  TASK_WAIT_UNTIL(TaskState.Memory, !boot_spm_busy());
+
+  boot_page_write(addr);
+  TASK_WAIT_UNTIL(TaskState.Memory, !boot_spm_busy());
+
+  /* Re-enable the RWW section of flash as writing to the flash locks it out */
+  boot_rww_enable();
+
+  TASK_END(TaskState.Memory);
+}
+
+/** Copies a run of flash into the control endpoint, through the lpm Z+ kernel for the whole groups of four bytes. */
+void Flash_Read(uint32_t addr, uint8_t count)
+{
+  uint8_t groups = count >> 2;
+
+  if(groups)
+    Flash_WriteGroupsToEndpoint(addr, groups);
+
+  for(addr+=(groups << 2);count & 0x03;count--)
+    Endpoint_Write_Byte(pgm_read_byte(addr++));
+}
+
+/** Skips the blank groups of four flash bytes, then finds the non-blank byte or checks the tail one byte at a time. */
+uint16_t Flash_FindNonBlank(uint32_t addr, uint16_t count)
+{
+  uint16_t curAddr = addr;
+  uint16_t endAddr = addr + count;
+
+  if(count >= 4)
+    curAddr = Flash_SkipBlankGroups(curAddr, count >> 2);
+
+  while(curAddr < endAddr && pgm_read_byte(curAddr) == 0xFF)
+    curAddr++;
+
+  return curAddr - (uint16_t)addr;
+}
+
+/** Refuses EEPROM downloads reaching the bootloader's own records at the top of the EEPROM. */
+uint8_t EEPROM_PrepareWrite(uint32_t firstAddr, uint32_t lastAddr)
+{
+  if(lastAddr >= EEPROM_RESERVED_START){
+    DFU_State  = dfuERROR;
+    DFU_Status = errADDRESS;
   }
-  else if (flipCommand.data[0] == 0x01) { // Blank Check in FLASH
-    uint16_t startAddr = ((uint16_t)flipCommand.data[1] << 8) | (uint16_t)flipCommand.data[2];
-    uint16_t endAddr   = ((uint16_t)flipCommand.data[3] << 8) | (uint16_t)flipCommand.data[4];
-    uint16_t curAddr=startAddr;
 
-    for(curAddr=startAddr;curAddr<endAddr;curAddr++){
-      if (pgm_read_byte(curAddr) != 0xFF) { // Found a non-blank byte
-        DFU_State  = dfuERROR;
-        DFU_Status = errCHECK_ERASED;
-        nonBlankAddr = curAddr;
-        break;
-      }
-    }
+  return TASK_DONE;
+}
+
+/** Writes a run of bytes from the control endpoint into the EEPROM, other tasks run while each byte programs. */
+uint8_t EEPROM_Write(uint32_t addr, uint8_t count)
+{
+  static uint8_t i;
+
+  TASK_BEGIN(TaskState.Memory);
+
+  for(i=0;i<count;i++){
+    eeprom_write_byte((uint8_t*)(uintptr_t)addr + i, Endpoint_Read_Byte());
+    TASK_WAIT_UNTIL(TaskState.Memory, eeprom_is_ready());
   }
-  else if (flipCommand.data[0] == 0x02) { // Display EEPROM Data
-    /* Enter download mode if in dfuIDLE, if not in dfuDNLOAD_IDLE then enter dfuERROR */
-    if(DFU_State != dfuIDLE){
-      DFU_State = dfuERROR;
-      return;
-    }
-    else{
-      uint16_t startAddr = ((uint16_t)flipCommand.data[1] << 8) | (uint16_t)flipCommand.data[2];
-      uint16_t endAddr   = ((uint16_t)flipCommand.data[3] << 8) | (uint16_t)flipCommand.data[4];
-      uint16_t curAddr   = startAddr;
 
-      /* Change the state */
-      DFU_State = dfuUPLOAD_IDLE;
+  TASK_END(TaskState.Memory);
+}
+
+/** Copies a run of EEPROM bytes into the control endpoint. */
+void EEPROM_Read(uint32_t addr, uint8_t count)
+{
+  while(count--)
+    Endpoint_Write_Byte(eeprom_read_byte((uint8_t*)(uintptr_t)addr++));
+}
+
+/** Copies a run of at most EEPROM_CHECK_CHUNK_SIZE bytes into SRAM and looks for a non-blank byte there. The
+ *  bootloader's own records at the top of the EEPROM are not part of the host's EEPROM and count as blank.
+ */
+uint16_t EEPROM_FindNonBlank(uint32_t addr, uint16_t count)
+{
+  uint8_t chunk[EEPROM_CHECK_CHUNK_SIZE];
+  uint8_t checked = count;
+  uint8_t i;
 
-      /* Start uploading the data */
-      while(curAddr < endAddr){
+  if(addr >= EEPROM_RESERVED_START)
+    return count;
+  if(addr + count > EEPROM_RESERVED_START)
+    checked = EEPROM_RESERVED_START - addr;
 
-        /* Wait for the IN Ready */
-        while(!Endpoint_IsINReady()){};
+  eeprom_read_block(chunk, (const void*)(uintptr_t)addr, checked);
 
-        /* Read the EEPROM byte and send it via USB to the host */
-        for(uint8_t i=0;i<FIXED_CONTROL_ENDPOINT_SIZE;i++,curAddr++)
-          Endpoint_Write_Byte(eeprom_read_byte((uint8_t*)curAddr));
+  for(i=0;i<checked && chunk[i] == 0xFF;i++);
 
-        /* Finished this packet, ack the host */
-        Endpoint_ClearIN(); 
-      }
-    }
+  return (i < checked) ? i : count;
+}
+
+/** Refuses Dataflash downloads reaching the bitmap and the delta staging area at the top of the Dataflash, and
+ *  marks the pages holding firstAddr to lastAddr as possibly programmed.
+ */
+uint8_t Dataflash_PrepareWrite(uint32_t firstAddr, uint32_t lastAddr)
+{
+  TASK_BEGIN(TaskState.Memory);
+
+  if((lastAddr >> DATAFLASH_PAGE_SHIFT) >= DATAFLASH_BITMAP_PAGE){
+    DFU_State  = dfuERROR;
+    DFU_Status = errADDRESS;
+    TASK_EXIT(TaskState.Memory);
   }
-  //else if (flipCommand.data[0] == 0x03) { // Blank Check in EEPROM 
-  //  uint16_t startAddr = ((uint16_t)flipCommand.data[1] << 8) | (uint16_t)flipCommand.data[2];
-  //  uint16_t endAddr   = ((uint16_t)flipCommand.data[3] << 8) | (uint16_t)flipCommand.data[4];
-  //  uint16_t curAddr=startAddr;
-  //  for(curAddr=startAddr;curAddr<endAddr;curAddr++){
-  //    if (eeprom_read_byte((uint8_t*)curAddr) != 0xFF) { // Found a non-blank byte
-  //      DFU_State  = dfuERROR;
-  //      DFU_Status = errCHECK_ERASED;
-  //      nonBlankAddr = curAddr;
-  //      break;
-  //    }
-  //  }
-  //}
-  else if(flipCommand.data[0] == 0x10){ // Display External Dataflash Data 
-    /* Enter download mode if in dfuIDLE, if not in dfuDNLOAD_IDLE then enter dfuERROR */
-    if(DFU_State != dfuIDLE){
-      DFU_State = dfuERROR;
-      return;
-    }
-    else{
-      uint32_t startAddr = ((uint32_t)curFlash64KBPageNumber << 16) | ((uint32_t)flipCommand.data[1] << 8) | (uint32_t)flipCommand.data[2];
-      uint32_t endAddr   = ((uint32_t)curFlash64KBPageNumber << 16) | ((uint32_t)flipCommand.data[3] << 8) | (uint32_t)flipCommand.data[4];
-      uint32_t curAddr   = startAddr;
 
-      /* Change the state */
-      DFU_State = dfuUPLOAD_IDLE;
+  TASK_SPAWN(TaskState.Memory, UpdateDataflashBitmap(firstAddr >> DATAFLASH_PAGE_SHIFT, lastAddr >> DATAFLASH_PAGE_SHIFT, false));
+
+  TASK_END(TaskState.Memory);
+}
 
-      /* Since we only have one dataflash, we always enable CHIP1 */
-      Dataflash_SelectChip(DATAFLASH_CHIP1);
+/** Selects the chip holding the page of addr, waits for it to be idle and enters buffer 1 write mode at addr. With
+ *  two chips the chip selected is not the one still programming the previous page.
+ */
+uint8_t Dataflash_BeginPage(uint32_t addr)
+{
+  TASK_BEGIN(TaskState.Memory);
 
-      /* Enter buffer 1 write mode */
-      Dataflash_Configure_Read_Page_Offset(DF_CMD_CONTARRAYREAD_LF, curAddr/DATAFLASH_PAGE_SIZE, curAddr%DATAFLASH_PAGE_SIZE);
+  Dataflash_SelectChipFromPage(addr >> DATAFLASH_PAGE_SHIFT);
+  TASK_WAIT_UNTIL(TaskState.Memory, !Dataflash_IsBusy());
+  Dataflash_Configure_Write_Page_Offset(DF_CMD_BUFF1WRITE, addr >> DATAFLASH_PAGE_SHIFT, addr & DATAFLASH_PAGE_MASK);
 
-      /* Start uploading the data */
-      while(curAddr < endAddr){
+  TASK_END(TaskState.Memory);
+}
 
-        /* Wait for the IN Ready */
-        while(!Endpoint_IsINReady()){};
+/** Writes a run of bytes from the control endpoint into the Dataflash buffer. */
+uint8_t Dataflash_Write(uint32_t addr, uint8_t count)
+{
+  Dataflash_PumpFromEndpoint(count);
 
-        /* Write the next word int the endpoint */
-        for(uint8_t i=0;i<FIXED_CONTROL_ENDPOINT_SIZE;i++,curAddr++)
-          Endpoint_Write_Byte(Dataflash_ReceiveByte());
+  return TASK_DONE;
+}
 
-        /* Finished this packet, ack the host */
-        Endpoint_ClearIN(); 
-      }
+/** Writes the Dataflash buffer back to the page holding addr, the chip programs it in the background. */
+uint8_t Dataflash_EndPage(uint32_t addr)
+{
+  /* Let the last bytes of the page reach the Dataflash buffer */
+  Dataflash_PumpFlush();
 
-      /* Deselect the dataflash */
-      Dataflash_DeselectChip();
+  Dataflash_ToggleSelectedChipCS();
+  Dataflash_Configure_Write_Page_Offset(DF_CMD_BUFF1TOMAINMEMWITHERASE, addr >> DATAFLASH_PAGE_SHIFT, 0);
+  Dataflash_DeselectChip();
+
+  return TASK_DONE;
+}
+
+/** Waits for the last pages to be programmed. */
+uint8_t Dataflash_FinishWrite(void)
+{
+  TASK_BEGIN(TaskState.Memory);
+
+  TASK_WAIT_UNTIL(TaskState.Memory, !Dataflash_IsAnyBusy());
+
+  TASK_END(TaskState.Memory);
+}
+
+/** Selects the chip holding the page of addr and enters continuous read mode at addr. */
+void Dataflash_Seek(uint32_t addr)
+{
+  Dataflash_SelectChipFromPage(addr >> DATAFLASH_PAGE_SHIFT);
+  Dataflash_Configure_Read_Page_Offset(DF_CMD_CONTARRAYREAD_LF, addr >> DATAFLASH_PAGE_SHIFT, addr & DATAFLASH_PAGE_MASK);
+}
+
+/** Copies a run of Dataflash bytes into the control endpoint. The read is restarted on each new page unless the
+ *  next used byte follows on in the same chip.
+ */
+void Dataflash_Read(uint32_t addr, uint8_t count)
+{
+  if(!(addr & DATAFLASH_PAGE_MASK) && !DATAFLASH_PAGES_CONTIGUOUS)
+    Dataflash_Seek(addr);
+
+  Dataflash_PumpToEndpoint(count);
+}
+
+/** Reads a run of the Dataflash and looks for a non-blank byte. */
+uint16_t Dataflash_FindNonBlank(uint32_t addr, uint16_t count)
+{
+  uint16_t i;
+
+  /* The bitmap and the delta staging area are the bootloader's own, and are reported blank */
+  if((addr >> DATAFLASH_PAGE_SHIFT) >= DATAFLASH_BITMAP_PAGE)
+    return count;
+
+  Dataflash_Seek(addr);
+  for(i=0;i<count && Dataflash_ReceiveByte() == 0xFF;i++);
+  Dataflash_DeselectChip();
+
+  return i;
+}
+
+/** Returns the bits of the page state bitmap byte byteIndex which belong to pages firstPage to lastPage. */
+uint8_t GetBitmapMask(uint16_t byteIndex, uint16_t firstPage, uint16_t lastPage)
+{
+  uint8_t mask = 0xFF;
+
+  if(byteIndex == (firstPage >> 3))
+    mask &= (uint8_t)(0xFF << (firstPage & 0x07));
+  if(byteIndex == (lastPage >> 3))
+    mask &= (uint8_t)(0xFF >> (7 - (lastPage & 0x07)));
+
+  return mask;
+}
+
+/** Tells whether the application flash page is known to be erased, from the bitmap in EEPROM. */
+bool IsFlashPageErased(uint16_t page)
+{
+  if(page >= FLASH_BITMAP_PAGES)
+    return false;
+
+  return !(eeprom_read_byte((uint8_t*)(FLASH_BITMAP_EEPROM_ADDR + (page >> 3))) & _BV(page & 0x07));
+}
+
+/** Marks the application flash pages firstPage to lastPage as known to be erased, or as possibly programmed. Only
+ *  the bitmap bytes which change are written, pages beyond the application section are ignored.
+ */
+uint8_t UpdateFlashBitmap(uint16_t firstPage, uint16_t lastPage, bool erased)
+{
+  static uint8_t curByte;
+
+  if(lastPage >= FLASH_BITMAP_PAGES)
+    lastPage = FLASH_BITMAP_PAGES - 1;
+
+  TASK_BEGIN(TaskState.Bitmap);
+
+  for(curByte=(firstPage >> 3);firstPage<=lastPage && curByte<=(lastPage >> 3);curByte++){
+    uint8_t mask     = GetBitmapMask(curByte, firstPage, lastPage);
+    uint8_t oldValue = eeprom_read_byte((uint8_t*)(FLASH_BITMAP_EEPROM_ADDR + curByte));
+    uint8_t newValue = erased ? (oldValue & ~mask) : (oldValue | mask);
+
+    if(newValue != oldValue){
+      eeprom_write_byte((uint8_t*)(FLASH_BITMAP_EEPROM_ADDR + curByte), newValue);
+      TASK_WAIT_UNTIL(TaskState.Bitmap, eeprom_is_ready());
     }
   }
-  else if (flipCommand.data[0] == 0x11) { // Blank Check in Dataflash 
-    uint32_t startAddr = ((uint32_t)curFlash64KBPageNumber << 16) | ((uint32_t)flipCommand.data[1] << 8) | (uint32_t)flipCommand.data[2];
-    uint32_t endAddr   = ((uint32_t)curFlash64KBPageNumber << 16) | ((uint32_t)flipCommand.data[3] << 8) | (uint32_t)flipCommand.data[4];
-    uint32_t curAddr   = startAddr;
 
-    /* Since we only have one dataflash, we always enable CHIP1 */
-    Dataflash_SelectChip(DATAFLASH_CHIP1);
+  TASK_END(TaskState.Bitmap);
+}
 
-    /* Enter buffer 1 write mode */
-    Dataflash_Configure_Read_Page_Offset(DF_CMD_CONTARRAYREAD_LF, curAddr/DATAFLASH_PAGE_SIZE, curAddr%DATAFLASH_PAGE_SIZE);
+/** Tells whether the Dataflash page is known to be erased, from the bitmap held in the Dataflash. */
+bool IsDataflashPageErased(uint16_t page)
+{
+  if(page >= DATAFLASH_BITMAP_PAGE)
+    return false;
 
-    /* Start uploading the data */
-    for(curAddr=startAddr;curAddr<endAddr;curAddr++){
-      if (Dataflash_ReceiveByte() != 0xFF) { // Found a non-blank byte
-        DFU_State  = dfuERROR;
-        DFU_Status = errCHECK_ERASED;
-        nonBlankAddr = curAddr;
-        break;
+  uint16_t bitmapPage = DATAFLASH_BITMAP_PAGE + ((page >> 3) >> DATAFLASH_PAGE_SHIFT);
+
+  Dataflash_SelectChipFromPage(bitmapPage);
+  Dataflash_Configure_Read_Page_Offset(DF_CMD_CONTARRAYREAD_LF, bitmapPage, (page >> 3) & DATAFLASH_PAGE_MASK);
+  uint8_t bitmapByte = Dataflash_ReceiveByte();
+  Dataflash_DeselectChip();
+
+  return !(bitmapByte & _BV(page & 0x07));
+}
+
+/** Marks the Dataflash pages firstPage to lastPage as known to be erased, or as possibly programmed. Each bitmap
+ *  page touched is copied into buffer 1, updated there and programmed back. Pages from the bitmap up are ignored.
+ */
+uint8_t UpdateDataflashBitmap(uint16_t firstPage, uint16_t lastPage, bool erased)
+{
+  static uint16_t curByte;
+  static uint16_t bitmapPage;
+
+  if(lastPage >= DATAFLASH_BITMAP_PAGE)
+    lastPage = DATAFLASH_BITMAP_PAGE - 1;
+
+  TASK_BEGIN(TaskState.Bitmap);
+
+  for(curByte=(firstPage >> 3);firstPage<=lastPage && curByte<=(lastPage >> 3);){
+    bitmapPage = DATAFLASH_BITMAP_PAGE + (curByte >> DATAFLASH_PAGE_SHIFT);
+
+    /* Copy the bitmap page into buffer 1, so that the bytes outside the range are kept */
+    Dataflash_SelectChipFromPage(bitmapPage);
+    TASK_WAIT_UNTIL(TaskState.Bitmap, !Dataflash_IsBusy());
+    Dataflash_Configure_Write_Page_Offset(DF_CMD_MAINMEMTOBUFF1, bitmapPage, 0);
+    Dataflash_ToggleSelectedChipCS();
+    TASK_WAIT_UNTIL(TaskState.Bitmap, !Dataflash_IsBusy());
+
+    /* Update the bytes of the range held in this bitmap page */
+    do{
+      uint8_t mask     = GetBitmapMask(curByte, firstPage, lastPage);
+      uint8_t newValue = erased ? 0x00 : 0xFF;
+
+      /* Bytes shared with pages outside the range keep their other bits */
+      if(mask != 0xFF){
+        Dataflash_Configure_Write_Page_Offset(DF_CMD_BUFF1READ_LF, bitmapPage, curByte & DATAFLASH_PAGE_MASK);
+        newValue = (Dataflash_ReceiveByte() & ~mask) | (newValue & mask);
+        Dataflash_ToggleSelectedChipCS();
       }
-    }
 
-    /* Deselect the dataflash */
+      Dataflash_Configure_Write_Page_Offset(DF_CMD_BUFF1WRITE, bitmapPage, curByte & DATAFLASH_PAGE_MASK);
+      Dataflash_SendByte(newValue);
+      Dataflash_ToggleSelectedChipCS();
+    } while(++curByte <= (lastPage >> 3) && (curByte & DATAFLASH_PAGE_MASK));
+
+    /* Program the bitmap page back, the chip programs it in the background */
+    Dataflash_Configure_Write_Page_Offset(DF_CMD_BUFF1TOMAINMEMWITHERASE, bitmapPage, 0);
     Dataflash_DeselectChip();
   }
+
+  /* Wait for the bitmap pages to be programmed */
+  TASK_WAIT_UNTIL(TaskState.Bitmap, !Dataflash_IsAnyBusy());
+
+  TASK_END(TaskState.Bitmap);
+}
+
+/** Returns the CRC-16 of a whole flash page, as computed by _crc16_update() from an initial value of 0xFFFF. */
+uint16_t HashFlashPage(uint16_t page)
+{
+  uint16_t crc     = 0xFFFF;
+  uint16_t curAddr = page * SPM_PAGESIZE;
+
+  for(uint16_t i=0;i<SPM_PAGESIZE;i++)
+    crc = _crc16_update(crc, pgm_read_byte(curAddr + i));
+
+  return crc;
+}
+
+/** Returns the CRC-16 of a whole Dataflash page, computed the same way as HashFlashPage(). */
+uint16_t HashDataflashPage(uint16_t page)
+{
+  uint16_t crc = 0xFFFF;
+
+  Dataflash_SelectChipFromPage(page);
+  Dataflash_Configure_Read_Page_Offset(DF_CMD_CONTARRAYREAD_LF, page, 0);
+
+  for(uint16_t i=0;i<DATAFLASH_PAGE_SIZE;i++)
+    crc = _crc16_update(crc, Dataflash_ReceiveByte());
+
+  Dataflash_DeselectChip();
+  return crc;
 }
 
 /** Handler for a Data Write command issued by the host. This routine handles non-programming commands such as
  *  bootloader exit (both via software jumps and hardware watchdog resets) and flash memory erasure.
  */
-void ProcessExec(void)
+uint8_t ProcessExec(void)
 {
+  static uint16_t curAddr;
+  static uint16_t blocksEnd;
+
+  TASK_BEGIN(TaskState.Exec);
+
   if (flipCommand.data[0] == 0x00 && flipCommand.data[1] == 0xFF) { // Erase flash
-    /* Clear the application section of flash */
-    for(uint16_t curAddr=0;curAddr<BOOT_START_ADDR;curAddr+=SPM_PAGESIZE) {
-      boot_page_erase(curAddr); boot_spm_busy_wait();
+    /* Clear the application section of flash, leaving nothing to start at reset */
+    SetApplicationValid(false);
+    recordPending = false;
+    for(curAddr=0;curAddr<BOOT_START_ADDR;curAddr+=SPM_PAGESIZE) {
+      boot_page_erase(curAddr);
+      TASK_WAIT_UNTIL(TaskState.Exec, !boot_spm_busy());
     }
     /* Re-enable the RWW section of flash as writing to the flash locks it out */
     boot_rww_enable();
+
+    /* Every application page is now known to be erased */
+    TASK_SPAWN(TaskState.Exec, UpdateFlashBitmap(0, FLASH_BITMAP_PAGES - 1, true));
   }
-  if (flipCommand.data[0] == 0x01 && flipCommand.data[1] == 0xFF) { // Erase eeprom 
-    for(uint16_t curAddr=0;curAddr<1024;curAddr++) {
-      eeprom_write_byte((uint8_t*)curAddr, 0xFF);
-      eeprom_busy_wait();
+  if (flipCommand.data[0] == 0x01 && flipCommand.data[1] == 0xFF) { // Erase eeprom
+    /* Only the bytes which are not blank yet are written, each write takes several milliseconds */
+    for(curAddr=0;curAddr<EEPROM_RESERVED_START;curAddr++) {
+      if (eeprom_read_byte((uint8_t*)(uintptr_t)curAddr) != 0xFF) {
+        eeprom_write_byte((uint8_t*)(uintptr_t)curAddr, 0xFF);
+        TASK_WAIT_UNTIL(TaskState.Exec, eeprom_is_ready());
+      }
     }
   }
-  else if (flipCommand.data[0] == 0x10 && flipCommand.data[1] == 0xFF) { // Erase External Flash 
-    Dataflash_SelectChip(DATAFLASH_CHIP1);
-    Dataflash_SendByte(0xC7);
-    Dataflash_SendByte(0x94);
-    Dataflash_SendByte(0x80);
-    Dataflash_SendByte(0x9A);
-    Dataflash_ToggleSelectedChipCS();
-    Dataflash_WaitWhileBusy();
-    Dataflash_DeselectChip();
+  else if (flipCommand.data[0] == 0x10 && flipCommand.data[1] == 0xFF) { // Erase External Flash
+    /* Erase the pages below the bitmap in blocks of 8 pages of each chip, and the pages past the last whole block
+       one at a time. The bitmap and the delta staging area above are left alone. */
+    blocksEnd = DATAFLASH_BITMAP_PAGE & ~(8 * DATAFLASH_TOTALCHIPS - 1);
+
+    for(curAddr=0;curAddr<DATAFLASH_BITMAP_PAGE;curAddr++){
+      /* The other pages of a block went with its first one */
+      if(curAddr < blocksEnd && ((curAddr >> (DATAFLASH_TOTALCHIPS - 1)) & 0x07))
+        continue;
+
+      Dataflash_SelectChipFromPage(curAddr);
+      TASK_WAIT_UNTIL(TaskState.Exec, !Dataflash_IsBusy());
+      Dataflash_Configure_Write_Page_Offset((curAddr < blocksEnd) ? DF_CMD_BLOCKERASE : DF_CMD_PAGEERASE, curAddr, 0);
+      Dataflash_DeselectChip();
+    }
+    TASK_WAIT_UNTIL(TaskState.Exec, !Dataflash_IsAnyBusy());
+
+    /* Every page below the bitmap is now known to be erased */
+    TASK_SPAWN(TaskState.Exec, UpdateDataflashBitmap(0, DATAFLASH_BITMAP_PAGE - 1, true));
   }
   else if (flipCommand.data[0] == 0x01){ // Set configuration
   }
   else if (flipCommand.data[0] == 0x03){ // Start application
+    /* Record the image downloaded last before the watchdog may reset the AVR */
+    if(recordPending)
+      TASK_SPAWN(TaskState.Exec, RecordApplication());
+
     if (flipCommand.data[1] == 0x00) { // Start via watchdog
       /* Start the watchdog to reset the AVR once the communications are finalized */
       wdt_enable(WDTO_250MS);
-    } 
+    }
     else if (flipCommand.data[1] == 0x01) { // Start via jump
       /* Load in the jump address into the application start address pointer */
-      AppStartPtr = ((uint16_t)flipCommand.data[3] << 8) | (uint16_t)flipCommand.data[4];
+      AppStartPtr = (AppPtr_t)(uintptr_t)(((uint16_t)flipCommand.data[3] << 8) | flipCommand.data[4]);
     }
   }
+
+  TASK_END(TaskState.Exec);
 }
 
 /** Handler for reading configuration information or manufacturer information.
  */
-void ProcessRead(void)
+uint8_t ProcessRead(void)
 {
-  while(!Endpoint_IsINReady()){};
+  TASK_BEGIN(TaskState.Read);
+
+  TASK_WAIT_TRANSFER(TaskState.Read, Endpoint_IsINReady());
 
   switch (flipCommand.data[0])
   {
@@ -491,18 +1785,25 @@ void ProcessRead(void)
       break;
   }
 
-  Endpoint_ClearIN(); 
+  Endpoint_ClearIN();
+
+  TASK_END(TaskState.Read);
 }
 
-/** Handler for a Change Base Address command issued by the host. 
- * 
+/** Handler for a Change Base Address command issued by the host. The vendor specific 0x04 subcommand turns the
+ *  background commands on or off. They are off until the host turns them on, as stock FLIP hosts do not poll
+ *  through dfuDNBUSY. For such a host a long erase or blank check still runs inside its DFU_DNLOAD request, which
+ *  does not complete until the command has finished, as before. Only hosts which send 0x04, as flip_open() of the
+ *  library in Host/ does, get the request back at once and poll DFU_GETSTATUS while the command runs.
  */
 void ProcessSelect(void)
 {
   if (flipCommand.data[0] == 0x03){
-    if (flipCommand.data[1] == 0x00) // Select Memory Page 
+    if (flipCommand.data[1] == 0x00) // Select Memory Page
       curFlash64KBPageNumber = flipCommand.data[2];
   }
+  else if (flipCommand.data[0] == 0x04) // Run commands in the background
+    backgroundCommands = flipCommand.data[1];
 }
 
 void UpdateState(void)
@@ -520,112 +1821,19 @@ void UpdateState(void)
 
 void EVENT_USB_Device_UnhandledControlRequest(void)
 {
-  /* Send ACK */
-  Endpoint_ClearSETUP();
-
-  switch (USB_ControlRequest.bRequest)
-  {
-    case DFU_DETACH:
-      break;
-
-    case DFU_DNLOAD:
-      /* Check if there's a FLIP command */
-      if(USB_ControlRequest.wLength){
-        /* Wait for the packet */
-        while(!Endpoint_IsOUTReceived()){};
-
-        /* Retrieve the FLIP command */
-        flipCommand.group   = Endpoint_Read_Byte();
-        for(uint8_t i=0;i<5 && i<(USB_ControlRequest.wLength-1);i++)
-          flipCommand.data[i] = Endpoint_Read_Byte();
-        Endpoint_ClearOUT();
-
-        /* If wLength is not 6 then it's a downlaod command, we discard the paddings and process it */
-        if(
-            (flipCommand.group == CMD_GROUP_DOWNLOAD) ||        
-            (flipCommand.group == CMD_GROUP_UPLOAD && flipCommand.data[0] == 0x01) || // Flash blank check
-            (flipCommand.group == CMD_GROUP_UPLOAD && flipCommand.data[0] == 0x03) || // EEPROM blank check
-            (flipCommand.group == CMD_GROUP_UPLOAD && flipCommand.data[0] == 0x11) || // Dataflash blank check
-            (flipCommand.group == CMD_GROUP_EXEC) ||
-            (flipCommand.group == CMD_GROUP_SELECT)
-          )
-          waitForSecondRequest = false;
-        else
-          waitForSecondRequest = true;
-
-        /* Process the command if not waiting for the second request */
-        if(!waitForSecondRequest)
-          ProcessFlipCommand();
-      }
-      /* DFU_DNLOAD with no data means it's a terminating signal */
-      else {
-        ResetHardware();
-        /* Start the user application */
-        AppStartPtr();
-      }
-      break;
-
-    case DFU_UPLOAD:
-
-      /* Blank checking is performed in the DFU_DNLOAD request - if we get here we've told the host
-         that the memory isn't blank, and the host is requesting the first non-blank address */
-      if (
-           (flipCommand.group == CMD_GROUP_UPLOAD && flipCommand.data[0] == 0x01) || // Flash blank check
-           (flipCommand.group == CMD_GROUP_UPLOAD && flipCommand.data[0] == 0x03) || // EEPROM blank check
-           (flipCommand.group == CMD_GROUP_UPLOAD && flipCommand.data[0] == 0x11)    // Dataflash blank check
-         ) {
-        /* Wait for the IN Ready */
-        while(!Endpoint_IsINReady()){};
-
-        /* Write the first non-blank address */
-        Endpoint_Write_Word_LE((uint16_t)nonBlankAddr);
-
-        /* Finished this packet, ack the host */
-        Endpoint_ClearIN(); 
-
-        break;
-      }
-
-      /* We have received the command through the last DFU_DNLOAD, process it directly */
-      ProcessFlipCommand();
-
-    case DFU_GETSTATUS:
-      /* Update the state */
-      UpdateState();
-      /* Wait for the IN Ready */
-      while(!Endpoint_IsINReady()){};
-      /* 1 byte status value */
-      Endpoint_Write_Byte(DFU_Status);
-      /* 3 byte poll timeout value */
-      Endpoint_Write_Byte(0);
-      Endpoint_Write_Byte(0);
-      Endpoint_Write_Byte(0);
-      /* 1 byte status value */
-      Endpoint_Write_Byte(DFU_State);
-      /* 1 byte state string ID number */
-      Endpoint_Write_Byte(0);
-      Endpoint_ClearIN();
-      break;    
-
-    case DFU_CLRSTATUS:
-
-      DFU_State = dfuIDLE;
-      DFU_Status = OK;
-      break;
+  /* The host has moved on, drop whatever is left of the previous request */
+  AbortControlTask();
 
-    case DFU_GETSTATE:
+  /* Only the status may be read while a command runs in the background, the stack stalls any other request
+     which is left unacknowledged */
+  if((runningTasks & TASK_COMMAND) &&
+     USB_ControlRequest.bRequest != DFU_GETSTATUS && USB_ControlRequest.bRequest != DFU_GETSTATE)
+    return;
 
-      /* Wait for the IN Ready */
-      while(!Endpoint_IsINReady()){};
-      Endpoint_Write_Byte(DFU_State);
-      Endpoint_ClearIN();
-      break;
-
-    case DFU_ABORT:
+  /* Send ACK */
+  Endpoint_ClearSETUP();
 
-      DFU_State = dfuIDLE;
-      DFU_Status = OK;
-      break;
-  }
-  Endpoint_ClearStatusStage();
+  /* Serve the request from the main loop, where it may wait without holding up the USB stack */
+  controlRequest = USB_ControlRequest;
+  runningTasks |= TASK_CONTROL;
 }
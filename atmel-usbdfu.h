@@ -8,10 +8,22 @@
 #define _RRAM_USB_DFU_BOOTLOADER_H_
 
 #include <avr/wdt.h>
+#include <string.h>
+#include <util/crc16.h>
 
 #include <LUFA/Drivers/Board/Dataflash.h>
+#include <LUFA/Drivers/Board/HWB.h>
 
 #include "Descriptors.h"
+#include "SPIEngine.h"
+#include "Scheduler.h"
+#include "Timeout.h"
+#include "FlashKernels.h"
+
+/* Preprocessor Checks: */
+#if defined(DATAFLASH_USE_SPI_ENGINE) && defined(DATAFLASH_USE_USART_SPI)
+  #error The interrupt driven SPI engine requires the plain SPI Dataflash transport.
+#endif
 
 /** Bootloader Information */
 #define BOOTLOADER_VERSION_MAJOR 2
@@ -73,6 +85,9 @@ enum DFU_State_t
   dfuERROR               = 10
 };
 
+/** Time the host is asked to wait before polling DFU_GETSTATUS again while a command runs in the background */
+#define DFU_POLL_TIMEOUT_MS 20
+
 /** Flip commands */
 typedef struct
 {
@@ -86,21 +101,237 @@ enum FLIP_Group_Command_t
   CMD_GROUP_UPLOAD   = 3,
   CMD_GROUP_EXEC     = 4,
   CMD_GROUP_READ     = 5,
-  CMD_GROUP_SELECT   = 6
+  CMD_GROUP_SELECT   = 6,
+  CMD_GROUP_SCRIPT   = 7  // Several of the above in one DFU_DNLOAD, the second byte gives how many follow
+};
+
+/** Most commands a command script can carry, they follow its own 6 byte header in the same packet. Only commands
+ *  without a data stage of their own (select, blank checks and exec) can be scripted. NO_COMMAND_SCRIPTS leaves
+ *  scripts out of the build, which then refuses them with errUNKNOWN.
+ */
+#define SCRIPT_MAX_COMMANDS ((FIXED_CONTROL_ENDPOINT_SIZE / sizeof(USB_FLIP_Command_t)) - 1)
+
+/** Failing command index reported when every command of a script has succeeded */
+#define SCRIPT_NO_FAILURE   0xFF
+
+/** Delta patch records, sent back to back after a FLASH delta download command. Addresses and lengths are big endian. */
+enum Delta_Opcode_t
+{
+  DELTA_OP_COPY   = 0x00, // 2-byte source address and 2-byte length, copied from the installed image
+  DELTA_OP_INSERT = 0x01  // 2-byte length followed by that many bytes of new data
+};
+
+/** Most ranges a FLASH scatter download may describe. The download command gives the range count in its second
+ *  byte, and the data stage opens with one descriptor per range, followed by the data of every range back to back.
+ */
+#define SCATTER_MAX_RANGES 8
+
+/** Scatter download range descriptor, sent big endian with the ranges in ascending address order */
+typedef struct
+{
+  uint16_t Start;
+  uint16_t Length;
+} Scatter_Range_t;
+
+/** Number of Dataflash pages on the board, 65536 for two AT45DB641E, which only a 32 bit value holds */
+#define DATAFLASH_BOARD_PAGES_OF(geometry) ((uint32_t)(geometry).Pages * DATAFLASH_TOTALCHIPS)
+
+/** First Dataflash page of the area holding a copy of the installed image while a staged delta patch is applied, for
+ *  the given geometry and for the fitted Dataflash
+ */
+#define DELTA_STAGING_PAGE_OF(geometry) ((uint16_t)(DATAFLASH_BOARD_PAGES_OF(geometry) - (BOOT_START_ADDR >> (geometry).PageShift)))
+#define DELTA_STAGING_PAGE              DELTA_STAGING_PAGE_OF(Dataflash_Geometry)
+
+/** Tasks run from the main loop, as bits of the running task mask */
+enum Task_ID_t
+{
+  TASK_CONTROL = (1 << 0), // Serves the current DFU class control request
+  TASK_COMMAND = (1 << 1)  // Runs a FLIP command without a data stage after its request has been acknowledged
 };
 
+/** Resume points of every bootloader task, cleared together when a control transfer is abandoned */
+typedef struct
+{
+  Task_t Control;
+  Task_t Discard;
+  Task_t Command;
+  Task_t Flip;
+  Task_t Script;
+  Task_t Download;
+  Task_t Stage;
+  Task_t Delta;
+  Task_t Scatter;
+  Task_t Commit;
+  Task_t Bitmap;
+  Task_t Upload;
+  Task_t Exec;
+  Task_t Read;
+  Task_t Record;
+  Task_t Memory;
+} Task_State_t;
+
+/** Waits for an endpoint condition, arming the transfer deadline while the task is blocked on it */
+#define TASK_WAIT_TRANSFER(task, cond) do{ Timeout_Arm(TRANSFER_TIMEOUT_MS); TASK_WAIT_UNTIL(task, cond); Timeout_Disarm(); }while(0)
+
+/** Number of application flash pages covered by the page state bitmap, one bit per page. A cleared bit marks a
+ *  page known to be erased, so that an erased EEPROM or Dataflash leaves every page to be checked the slow way.
+ */
+#define FLASH_BITMAP_PAGES       (BOOT_START_ADDR / SPM_PAGESIZE)
+
+/** EEPROM address of the flash page state bitmap, at the very top of the EEPROM */
+#define FLASH_BITMAP_EEPROM_ADDR ((E2END + 1) - ((FLASH_BITMAP_PAGES + 7) / 8))
+
+/** EEPROM address of the application valid marker, just below the flash page state bitmap */
+#define APP_VALID_EEPROM_ADDR    (FLASH_BITMAP_EEPROM_ADDR - 1)
+
+/** Marker value stored once a flash image has been downloaded completely, any other value keeps the bootloader running */
+#define APP_VALID_MARKER         0xA5
+
+/** Key an application leaves in the top SRAM word at MAGIC_BOOT_KEY_ADDR, with interrupts disabled, before
+ *  resetting through the watchdog, to enter the bootloader whatever state the application section is in.
+ */
+#define MAGIC_BOOT_KEY           0xDC42
+#define MAGIC_BOOT_KEY_ADDR      (RAMEND - 1)
+
+/** Ways of checking the application at reset before starting it, on top of the application valid marker */
+#define APP_CHECK_MARKER         0 // Trust the marker alone
+#define APP_CHECK_QUICK          1 // Compare the first and last application words against the record
+#define APP_CHECK_FULL           2 // Recompute the CRC-32 of the application and compare it against the record
+
+#if !defined(APP_CHECK)
+  #define APP_CHECK APP_CHECK_QUICK
+#endif
+
+/** The scatter and delta downloads, which NO_SCATTER_DOWNLOAD and NO_DELTA_DOWNLOAD leave out of the build to save
+ *  boot section space, assemble flash pages in a shared SRAM page buffer
+ */
+#if !defined(NO_SCATTER_DOWNLOAD) || !defined(NO_DELTA_DOWNLOAD)
+  #define PAGE_BUFFER_DOWNLOADS
+#endif
+
+/** Record of the application downloaded last, written before the application valid marker is set */
+typedef struct
+{
+  uint32_t Crc;     // CRC-32 of the flash from address 0 up to Length, as computed by zlib's crc32()
+  uint16_t Length;  // Number of bytes covered, up to and including the last programmed word
+  uint16_t Header;  // First application word, its reset vector
+  uint16_t Trailer; // Last application word covered by Length
+} App_Record_t;
+
+/** EEPROM address of the application record, just below the application valid marker */
+#define APP_RECORD_EEPROM_ADDR   (APP_VALID_EEPROM_ADDR - sizeof(App_Record_t))
+
+/** Start of the EEPROM area holding the bootloader's own records, which host EEPROM downloads may not reach */
+#define EEPROM_RESERVED_START    APP_RECORD_EEPROM_ADDR
+
+/** EEPROM bytes are moved in runs of EEPROM_CHECK_CHUNK_SIZE bytes, which the blank check copies into SRAM at once */
+#define EEPROM_CHECK_CHUNK_SHIFT 4
+#define EEPROM_CHECK_CHUNK_SIZE  (1 << EEPROM_CHECK_CHUNK_SHIFT)
+
+/** Number of Dataflash pages holding the Dataflash page state bitmap, one bit per page of the board */
+#define DATAFLASH_BITMAP_PAGES_OF(geometry) ((uint16_t)((DATAFLASH_BOARD_PAGES_OF(geometry) >> 3) >> (geometry).PageShift))
+#define DATAFLASH_BITMAP_PAGES              DATAFLASH_BITMAP_PAGES_OF(Dataflash_Geometry)
+
+/** First Dataflash page of the bitmap, just below the delta staging area. The pages from here up are not tracked. */
+#define DATAFLASH_BITMAP_PAGE_OF(geometry) ((uint16_t)(DATAFLASH_BOARD_PAGES_OF(geometry) - (BOOT_START_ADDR >> (geometry).PageShift) - \
+                                                       DATAFLASH_BITMAP_PAGES_OF(geometry)))
+#define DATAFLASH_BITMAP_PAGE              DATAFLASH_BITMAP_PAGE_OF(Dataflash_Geometry)
+
+/** log2 of SPM_PAGESIZE, the flash page size as seen by the download and upload engines */
+#define FLASH_PAGE_SHIFT 7
+
+#if ((1 << FLASH_PAGE_SHIFT) != SPM_PAGESIZE)
+  #error FLASH_PAGE_SHIFT does not match the flash page size of this part.
+#endif
+
+/** Memories moved by the download and upload engines, indexing MemoryBackends */
+enum Memory_ID_t
+{
+  MEMORY_FLASH     = 0,
+  MEMORY_EEPROM    = 1,
+  MEMORY_DATAFLASH = 2
+};
+
+/** Operations of a memory, as used by the download and upload engines. Addresses carry the selected 64KB page in
+ *  their upper bits. Transfers are split into runs which never cross a page boundary; the operations returning a
+ *  uint8_t are tasks, which keep their resume point in TaskState.Memory. Optional operations are NULL when the
+ *  memory has nothing to do at that point.
+ */
+typedef struct
+{
+  uint8_t  PageShift;                                              // log2 of the page size, zero for the Dataflash until selected
+  bool     WholePages;                                             // Downloads run on to the end of their last page
+  uint8_t  (*PrepareWrite)(uint32_t firstAddr, uint32_t lastAddr); // Optional, checks and marks the range, failing with dfuERROR
+  uint8_t  (*BeginPage)(uint32_t addr);                            // Optional, opens the page before its first run is written
+  uint8_t  (*Write)(uint32_t addr, uint8_t count);                 // Moves a run from the control endpoint into the memory
+  uint8_t  (*EndPage)(uint32_t addr);                              // Optional, commits the page after its last run
+  uint8_t  (*FinishWrite)(void);                                   // Optional, waits for the memory once the last page is committed
+  void     (*Seek)(uint32_t addr);                                 // Optional, opens the memory before the first run is read
+  void     (*Read)(uint32_t addr, uint8_t count);                  // Moves a run from the memory into the control endpoint
+  uint16_t (*FindNonBlank)(uint32_t addr, uint16_t count);         // Offset of the first non-blank byte of a run, count if none
+  bool     (*IsPageErased)(uint16_t page);                         // Optional, tells whether the page is known to be erased
+} Memory_Backend_t;
+
 /** Type define for a non-returning function pointer to the loaded application. */
 typedef void (*AppPtr_t)(void) ATTR_NO_RETURN;
 
+void CaptureMagicBootKey(void) ATTR_INIT_SECTION(3);
+bool IsBootloaderRequested(void);
+bool IsApplicationIntact(void);
+void SetApplicationValid(bool valid);
+uint16_t FindApplicationEnd(void);
+uint8_t RecordApplication(void);
 void SetupHardware(void);
 void ResetHardware(void);
-void DiscardFillerBytes(uint8_t NumberOfBytes);
-void ProcessFlipCommand(void);
+uint8_t ControlTask(void);
+void ClearDataStageOUT(void);
+uint8_t DiscardDataStage(void);
+uint8_t CommandTask(void);
+void AbortControlTask(void);
+bool IsBlankCheckCommand(void);
+bool IsDataflashCommand(void);
+uint8_t ProcessFlipCommand(void);
+uint8_t ProcessScript(void);
 
-void ProcessDownload(void);
-void ProcessUpload(void);
-void ProcessExec(void);
-void ProcessRead(void);
+void SelectMemory(uint8_t memoryID);
+void GetCommandRange(uint32_t* startAddr, uint32_t* endAddr);
+uint8_t ProcessDownload(void);
+uint8_t StageInstalledImage(void);
+bool IsStreamByteReady(void);
+void LoadPageBuffer(uint16_t pageAddr);
+uint8_t CommitPageBuffer(void);
+uint8_t ApplyScatter(uint8_t rangeCount);
+uint8_t ApplyDelta(uint16_t startAddr, uint16_t endAddr, bool staged);
+void Dataflash_PumpFromEndpoint(uint8_t count);
+void Dataflash_PumpToEndpoint(uint8_t count);
+void Dataflash_PumpFlush(void);
+uint8_t ProcessUpload(void);
+uint8_t Flash_PrepareWrite(uint32_t firstAddr, uint32_t lastAddr);
+uint8_t Flash_Write(uint32_t addr, uint8_t count);
+uint8_t Flash_EndPage(uint32_t addr);
+void Flash_Read(uint32_t addr, uint8_t count);
+uint16_t Flash_FindNonBlank(uint32_t addr, uint16_t count);
+uint8_t EEPROM_PrepareWrite(uint32_t firstAddr, uint32_t lastAddr);
+uint8_t EEPROM_Write(uint32_t addr, uint8_t count);
+void EEPROM_Read(uint32_t addr, uint8_t count);
+uint16_t EEPROM_FindNonBlank(uint32_t addr, uint16_t count);
+uint8_t Dataflash_PrepareWrite(uint32_t firstAddr, uint32_t lastAddr);
+uint8_t Dataflash_BeginPage(uint32_t addr);
+uint8_t Dataflash_Write(uint32_t addr, uint8_t count);
+uint8_t Dataflash_EndPage(uint32_t addr);
+uint8_t Dataflash_FinishWrite(void);
+void Dataflash_Seek(uint32_t addr);
+void Dataflash_Read(uint32_t addr, uint8_t count);
+uint16_t Dataflash_FindNonBlank(uint32_t addr, uint16_t count);
+uint8_t GetBitmapMask(uint16_t byteIndex, uint16_t firstPage, uint16_t lastPage);
+bool IsFlashPageErased(uint16_t page);
+uint8_t UpdateFlashBitmap(uint16_t firstPage, uint16_t lastPage, bool erased);
+bool IsDataflashPageErased(uint16_t page);
+uint8_t UpdateDataflashBitmap(uint16_t firstPage, uint16_t lastPage, bool erased);
+uint16_t HashFlashPage(uint16_t page);
+uint16_t HashDataflashPage(uint16_t page);
+uint8_t ProcessExec(void);
+uint8_t ProcessRead(void);
 void ProcessSelect(void);
     
 void UpdateState(void);